@@ -128,6 +128,9 @@ pushd ${WORKDIR}/${ASTERISK_DIR}
 make NOISY_BUILD=yes && sudo make install
 popd
 
+printf "\e[93mBuilding tools...\e[39m\n"
+make -C tools && sudo make -C tools install
+
 sudo cp -v config/* /etc/asterisk/
 if [ ! -e /etc/asterisk/svc_key.json ]; then
     cat << EOF > /tmp/svc_key.json
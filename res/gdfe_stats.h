@@ -0,0 +1,135 @@
+/*
+ * res_speech_gdfe -- an Asterisk speech driver for Google DialogFlow for Enterprise
+ * 
+ * Copyright (C) 2018, USAN, Inc.
+ * 
+ * Daniel Collins <daniel.collins@usan.com>
+ * 
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source asterisk tree.
+ *
+ */
+
+/*! \file
+ *
+ * \brief Layout of the shared-memory stats segment kept by res_speech_gdfe
+ *
+ * The segment is a plain file (normally under /dev/shm) that the module maps
+ * read/write and monitoring tools map read only. Counters are kept in per-CPU
+ * slots so writers never share a cache line; readers add the slots together.
+ * Gauges are counters that go up and down, so their sum is the current value.
+ * Latency histograms are kept per logical agent.
+ *
+ * Readers must check magic and version and should take counter and stage
+ * names from the segment rather than assuming an order. Any change to the
+ * structures below bumps GDFE_STATS_VERSION; new counters may be appended
+ * without one, as stat_count says how many are in use.
+ */
+
+#ifndef _GDFE_STATS_H
+#define _GDFE_STATS_H
+
+#include <stdint.h>
+
+#define GDFE_STATS_MAGIC		0x53464447 /* "GDFS" */
+#define GDFE_STATS_VERSION		1
+#define GDFE_STATS_DEFAULT_PATH		"/dev/shm/gdfe_stats"
+
+#define GDFE_STATS_CPU_SLOTS		64
+#define GDFE_STATS_MAX_COUNTERS		48
+#define GDFE_STATS_MAX_AGENTS		32
+#define GDFE_STATS_NAME_LEN		64
+#define GDFE_STATS_MAX_STAGES		16
+
+/* log-linear like an HDR histogram, 16 linear buckets per power of two (about 6% precision) */
+#define GDFE_STATS_SUB_BUCKETS		16
+#define GDFE_STATS_BUCKETS		(GDFE_STATS_SUB_BUCKETS * 24) /* microseconds, up to 2^27 (about 134s) */
+
+struct gdfe_stats_cpu_slot {
+	int64_t values[GDFE_STATS_MAX_COUNTERS];
+} __attribute__((aligned(64)));
+
+struct gdfe_stats_histogram {
+	int32_t counts[GDFE_STATS_BUCKETS];
+	int32_t total;
+	int32_t max_us;
+};
+
+struct gdfe_stats_agent {
+	char name[GDFE_STATS_NAME_LEN];
+	struct gdfe_stats_histogram latency[GDFE_STATS_MAX_STAGES];
+};
+
+struct gdfe_stats_segment {
+	uint32_t magic; /* written last, once the rest of the header is filled in */
+	uint32_t version;
+	uint32_t size; /* of the whole segment */
+	int32_t pid;
+	int64_t started; /* seconds since the epoch */
+
+	uint32_t cpu_slots;
+	uint32_t stat_count;
+	uint32_t stage_count;
+	uint32_t agent_count; /* slots in use; a slot's name is set before it is counted */
+
+	char stat_names[GDFE_STATS_MAX_COUNTERS][GDFE_STATS_NAME_LEN];
+	char stage_names[GDFE_STATS_MAX_STAGES][GDFE_STATS_NAME_LEN];
+
+	struct gdfe_stats_cpu_slot cpus[GDFE_STATS_CPU_SLOTS];
+	struct gdfe_stats_agent agents[GDFE_STATS_MAX_AGENTS];
+};
+
+static inline int gdfe_stats_bucket(int64_t us)
+{
+	int power;
+
+	if (us < GDFE_STATS_SUB_BUCKETS) {
+		return us < 0 ? 0 : us;
+	}
+	if (us >= (1 << 27)) {
+		return GDFE_STATS_BUCKETS - 1;
+	}
+	power = 63 - __builtin_clzll(us); /* at least 4 */
+	return (power - 3) * GDFE_STATS_SUB_BUCKETS + ((us >> (power - 4)) & (GDFE_STATS_SUB_BUCKETS - 1));
+}
+
+/*! \brief the largest value that falls in a bucket */
+static inline int64_t gdfe_stats_bucket_limit(int bucket)
+{
+	int power;
+	int sub;
+
+	if (bucket < GDFE_STATS_SUB_BUCKETS) {
+		return bucket;
+	}
+	power = bucket / GDFE_STATS_SUB_BUCKETS + 3;
+	sub = bucket % GDFE_STATS_SUB_BUCKETS;
+	return ((int64_t) (GDFE_STATS_SUB_BUCKETS + sub + 1) << (power - 4)) - 1;
+}
+
+/*! \brief the bucket limit below which the given percent of samples fall, in microseconds */
+static inline int64_t gdfe_stats_percentile(const struct gdfe_stats_histogram *histogram, int total, int percent)
+{
+	int64_t wanted = ((int64_t) total * percent + 99) / 100;
+	int64_t seen = 0;
+	int64_t limit;
+	int i;
+
+	for (i = 0; i < GDFE_STATS_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= wanted) {
+			limit = gdfe_stats_bucket_limit(i);
+			return limit < histogram->max_us ? limit : histogram->max_us;
+		}
+	}
+	return histogram->max_us;
+}
+
+#endif /* _GDFE_STATS_H */
@@ -28,6 +28,7 @@
 
 /*** MODULEINFO
 	<depend>curl</depend>
+	<use type="module">res_statsd</use>
 	<support_level>extended</support_level>
  ***/
 
@@ -62,6 +63,10 @@ static struct timeval interval_end;
 static int max_consecutive_failures = 2;
 static int interval = 5;
 static const char *report_url = "http://localhost:4242/report";
+/*! mirror the channel count and report outcomes to StatsD */
+static int statsd_enabled = 0;
+/*! fraction of channel count updates and report counters sent, as they can arrive on every call */
+static double statsd_sample_rate = 1.0;
 
 static struct timeval next_interval_end(int interval_minutes, struct timeval basis)
 {
@@ -165,6 +170,7 @@ static int send_metric_data(const void *_)
         struct ast_tm tmstart = {};
         struct ast_tm tmend = {};
         long http_code = 0;
+        struct timeval report_start;
         
         ast_localtime(&tvstart, &tmstart, NULL);
         ast_localtime(&tvend, &tmend, NULL);
@@ -200,10 +206,18 @@ static int send_metric_data(const void *_)
             ast_log(LOG_DEBUG, "Posting usage metric '%s' to %s\n", body, report_url);
         }
 
+        report_start = ast_tvnow();
         res = curl_easy_perform(curl);
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (statsd_enabled) {
+            ast_statsd_log("metering.report", AST_STATSD_TIMER, ast_tvdiff_ms(ast_tvnow(), report_start));
+        }
         if (res != CURLE_OK || http_code != 200) {
             consecutive_failures++;
+            if (statsd_enabled) {
+                ast_statsd_log_full("metering.reports.failed", AST_STATSD_COUNTER, 1, statsd_sample_rate);
+                ast_statsd_log("metering.consecutive_failures", AST_STATSD_GAUGE, consecutive_failures);
+            }
             ast_log(LOG_WARNING, "Got error %d posting metric to %s -- %s\n", http_code, report_url, curl_easy_strerror(res));
 
             /* try to reset the metrics so if we do eventually get through it's correct */
@@ -218,6 +232,10 @@ static int send_metric_data(const void *_)
             }
         } else {
             consecutive_failures = 0;
+            if (statsd_enabled) {
+                ast_statsd_log_full("metering.reports.sent", AST_STATSD_COUNTER, 1, statsd_sample_rate);
+                ast_statsd_log("metering.consecutive_failures", AST_STATSD_GAUGE, 0);
+            }
         }
     }
 
@@ -242,6 +260,10 @@ static int update_channel_count(int addend)
         interval_max_channel_count = current;
     }
     ast_mutex_unlock(&count_lock);
+    if (statsd_enabled) {
+        /* a gauge carries the whole count, so a dropped update is corrected by the next one sent */
+        ast_statsd_log_full("metering.channels", AST_STATSD_GAUGE, current, statsd_sample_rate);
+    }
     return current;
 }
 
@@ -374,6 +396,21 @@ static void load_config(void)
     if (!ast_strlen_zero(val)) {
         report_url = ast_strdup(val);
     }
+
+    val = ast_variable_retrieve(cfg, "general", "statsd");
+    if (!ast_strlen_zero(val)) {
+        statsd_enabled = ast_true(val);
+    }
+
+    val = ast_variable_retrieve(cfg, "general", "statsd_sample_rate");
+    if (!ast_strlen_zero(val)) {
+        double d;
+        if (sscanf(val, "%lf", &d) == 1 && d > 0 && d <= 1) {
+            statsd_sample_rate = d;
+        } else {
+            ast_log(LOG_WARNING, "'statsd_sample_rate' must be greater than 0 and at most 1\n");
+        }
+    }
 }
 
 static int load_module(void)
@@ -20,6 +20,7 @@
 /*** MODULEINFO
     <depend>res_speech</depend>
 	<depend>dfegrpc</depend>
+	<use type="module">res_statsd</use>
  ***/
 
 #include <asterisk.h>
@@ -29,6 +30,8 @@
 #include <asterisk/cli.h>
 #include <asterisk/term.h>
 #include <asterisk/speech.h>
+#include <asterisk/taskprocessor.h>
+#include <asterisk/threadpool.h>
 
 #ifdef RAII_VAR
 #define ASTERISK_13_OR_LATER
@@ -45,15 +48,33 @@
 #endif
 
 #include <asterisk/chanvars.h>
+#include <asterisk/channel.h>
+#include <asterisk/framehook.h>
+#include <asterisk/manager.h>
+#include <asterisk/sched.h>
 #include <asterisk/pbx.h>
 #include <asterisk/config.h>
 #include <asterisk/ulaw.h>
+#include <asterisk/statsd.h>
 
 #include <libdfegrpc.h>
 
+#include "gdfe_stats.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <regex.h>
+#include <sched.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifndef ASTERISK_13_OR_LATER
 #include <jansson.h>
@@ -69,6 +90,17 @@
 #define VAD_PROP_VOICE_THRESHOLD	"voice_threshold"
 #define VAD_PROP_VOICE_DURATION		"voice_duration"
 #define VAD_PROP_SILENCE_DURATION	"silence_duration"
+#define GDF_PROP_ADMISSION		"admission"
+#define GDF_PROP_CONTINUOUS_STREAMING	"continuous_streaming"
+#define GDF_PROP_BARGE_IN		"barge_in"
+#define GDF_PROP_BARGE_IN_DURATION	"barge_in_duration"
+#define GDF_PROP_CHANNEL		"channel"
+
+#define GDF_VAR_INTERIM_TRANSCRIPT	"GDFE_INTERIM_TRANSCRIPT"
+#define GDF_VAR_INTERIM_SCORE		"GDFE_INTERIM_SCORE"
+#define GDF_PROP_NO_INPUT_TIMEOUT	"no_input_timeout"
+#define GDF_PROP_MAX_SPEECH_DURATION	"max_speech_duration"
+#define GDF_PROP_UPLINK_BYTES		"uplink_bytes"
 
 enum VAD_STATE {
 	VAD_STATE_START,
@@ -76,9 +108,93 @@ enum VAD_STATE {
 	VAD_STATE_SILENT
 };
 
+static const char *vad_state_names[] = {
+	[VAD_STATE_START] = "start",
+	[VAD_STATE_SPEAK] = "speaking",
+	[VAD_STATE_SILENT] = "silent",
+};
+
+enum gdf_barge_in_policy {
+	BARGE_IN_ON_RESPONSE, /* first streaming response from DialogFlow */
+	BARGE_IN_ON_SPEECH /* confirmed local speech */
+};
+
+enum gdf_dtmf_mode {
+	DTMF_MODE_OFF, /* digits are left to the dialplan */
+	DTMF_MODE_COLLECT, /* digits end the turn and are returned as a dtmf result */
+	DTMF_MODE_EVENT /* digits end the turn and are sent to DialogFlow as an event */
+};
+
+#define GDF_MAX_DTMF_DIGITS	32
+
+#define MULAW_BYTES_PER_MS	8 /* what libdfegrpc streams are always declared as */
+
+enum gdf_prefetch_state {
+	PREFETCH_NONE,
+	PREFETCH_RUNNING, /* sent from gdf_activate, no response yet */
+	PREFETCH_COMPLETE /* the response is held in the session for the next gdf_start */
+};
+
+enum gdf_admission_result {
+	ADMISSION_NOT_ATTEMPTED,
+	ADMISSION_ADMITTED,
+	ADMISSION_QUEUED, /* admitted after waiting */
+	ADMISSION_REJECTED,
+	ADMISSION_TIMEOUT,
+	ADMISSION_WAITING /* queued by gdf_try_admit_request, not yet admitted */
+};
+
+static const char *admission_result_names[] = {
+	[ADMISSION_NOT_ATTEMPTED] = "",
+	[ADMISSION_ADMITTED] = "admitted",
+	[ADMISSION_QUEUED] = "queued",
+	[ADMISSION_REJECTED] = "rejected",
+	[ADMISSION_TIMEOUT] = "timeout",
+	[ADMISSION_WAITING] = "waiting",
+};
+
+struct gdf_agent_runtime;
+
+/* the results of an event request, replayed to later callers of the same agent, event and language */
+struct gdf_cached_response {
+	struct timeval created;
+	struct timeval expires;
+	int result_count;
+	struct dialogflow_result *results;
+	const char *agent_name; /* points past the key; reloads drop entries whose agent changed */
+	char key[0];
+};
+
+/* attached to the channel as a framehook so digits reach the engine instead of SpeechBackground */
+struct gdf_dtmf_hook {
+	struct ast_speech *speech; /* cleared when the speech object is destroyed */
+};
+
+/* a result produced by the engine itself rather than by DialogFlow */
+struct gdf_local_result {
+	AST_LIST_ENTRY(gdf_local_result) list;
+	int score;
+	char *value;
+	char slot[0];
+};
+
+#define GDF_MAX_ENDPOINTS		8
+#define GDF_ENDPOINT_LEN		128
+#define GDF_LATENCY_SAMPLES		64
+
+#define RESAMPLER_TAPS			32 /* of the half-band low-pass filter, at 16kHz */
+
+/* converts between 8kHz and 16kHz, keeping the filter history between frames */
+struct gdf_resampler {
+	int up; /* doubles the rate if set, halves it otherwise */
+	short history[RESAMPLER_TAPS];
+	int history_len;
+};
+
 struct gdf_pvt {
 	ast_mutex_t lock;
 	struct dialogflow_session *session;
+	struct ast_speech *speech; /* cleared by gdf_destroy, for requests finishing off the channel thread */
 	
 	enum VAD_STATE vad_state;
 	int vad_state_duration; /* ms */
@@ -88,11 +204,108 @@ struct gdf_pvt {
 	int voice_minimum_duration; /* ms */
 	int silence_minimum_duration; /* ms */
 
+	enum gdf_barge_in_policy barge_in_policy;
+	int barge_in_minimum_duration; /* ms of speech after start of speech */
+
 	int call_log_open_already_attempted;
 	FILE *call_log_file_handle;
 
 	int utterance_counter;
 
+	enum gdf_admission_result last_admission_result;
+	struct gdf_agent_runtime *admitted_runtime; /* holds a concurrency slot while set */
+	struct gdf_agent_runtime *waiting_runtime; /* holds a place in the queue while set */
+	struct timeval admission_deadline; /* for the place in the queue */
+
+	int pending_requests; /* abandoned requests still running against this pvt */
+	int destroyed; /* torn down, freed when the last pending request finishes */
+	int recognition_active; /* a stream has been started and not yet finished */
+	int async_query_active; /* event requests (the turn's and a prefetch) running on the event pool */
+	int close_session_after_query; /* torn down while a request was running, the last one closes the session */
+	ast_cond_t async_query_done;
+
+	struct gdf_cached_response *cached_response; /* serving this turn's results */
+	int cache_ttl; /* seconds, when this turn's response is cacheable */
+
+	/* monotonic, for the latency histograms; 0 until reached this turn */
+	struct gdf_agent_runtime *turn_runtime; /* the histograms of the turn's agent, looked up once by gdf_start */
+	int64_t turn_start_us;
+	int64_t speech_start_us;
+	int64_t first_audio_us;
+	int64_t turn_result_us;
+	int turn_query; /* an event rather than speech */
+
+	int sample_rate; /* of the audio given to gdf_write */
+	int turn_record_pre; /* pre-endpointer recordings were enabled when the turn started */
+	int turn_record_post; /* post-endpointer recordings were enabled when the turn started */
+	struct gdf_resampler narrow_resampler; /* to 8kHz for recordings and mu-law, if sample_rate is 16kHz */
+	short *narrow_buffer; /* a frame narrowed to 8kHz */
+	char *mulaw_buffer; /* a frame as mu-law */
+	int frame_buffer_samples; /* room in each, grown to the largest frame seen */
+	int64_t turn_uplink_bytes;
+	int turn_uplink_messages;
+	char *chunk_buffer; /* mu-law waiting to be sent as one message */
+	size_t chunk_buffer_size;
+	size_t chunk_len;
+	int64_t uplink_bytes; /* sent for the whole call */
+
+	enum gdf_prefetch_state prefetch_state;
+	int prefetch_claimed; /* the running prefetch finishes the turn when it lands */
+	int prefetch_discarded; /* the running prefetch is not for this turn, its result is dropped */
+	int prefetch_result;
+
+	int stream_pending; /* speech has started and the stream opens once it is admitted */
+	char *held_audio; /* uplink audio from the start of speech, sent when the stream opens */
+	size_t held_audio_len;
+	size_t held_audio_size;
+
+	int continuous_streaming; /* -1 to follow the logical agent */
+	int stream_preopened; /* opened ahead of speech and no audio written yet */
+	int stream_preopening; /* being opened on the event pool */
+	int preopen_turn_over; /* the turn ended while its stream was being opened */
+	int preopen_reopen; /* the kept stream is stale or on the wrong endpoint, the pre-open replaces it */
+	int stream_closing; /* the pre-opened stream is being stopped on the reaper */
+	struct timeval stream_opened_at;
+	int64_t stream_setup_ms;
+
+	struct timeval created;
+	struct timeval destroy_requested;
+
+	const char *last_error; /* the name of the error's counter */
+	struct timeval last_error_time;
+
+	AST_LIST_ENTRY(gdf_pvt) registry_entry;
+
+	int no_input_timeout; /* ms, -1 to follow the logical agent */
+	int max_speech_duration; /* ms, -1 to follow the logical agent */
+	int turn_no_input_timeout; /* ms, effective for the current turn */
+	int turn_max_speech_duration; /* ms, effective for the current turn */
+	int speech_duration; /* ms of audio sent since start of speech */
+
+	AST_LIST_HEAD_NOLOCK(, gdf_local_result) local_results;
+	int turn_finished_locally; /* DialogFlow's results for this turn are not used */
+	int interim_response_count; /* streaming responses already checked for a new transcript */
+
+	enum gdf_dtmf_mode dtmf_mode; /* effective for the current turn */
+	char dtmf_terminator;
+	int dtmf_interdigit_timeout; /* ms */
+	int dtmf_max_digits;
+	char dtmf_digits[GDF_MAX_DTMF_DIGITS + 1];
+	int dtmf_digit_count;
+	int dtmf_complete; /* terminator or last digit received */
+	struct timeval dtmf_last_digit;
+	struct gdf_dtmf_hook *dtmf_hook;
+	int dtmf_hook_id;
+
+	/* audio sent for the current utterance, replayed onto a new stream if the stream fails */
+	char *replay_buffer;
+	size_t replay_buffer_len;
+	size_t replay_buffer_limit;
+	int replay_buffer_ms;
+	int replay_buffer_overflowed;
+	int replay_attempts;
+	int replay_max_attempts;
+
 	int utterance_preendpointer_recording_open_already_attempted;
 	FILE *utterance_preendpointer_recording_file_handle;
 	int utterance_postendpointer_recording_open_already_attempted;
@@ -104,9 +317,18 @@ struct gdf_pvt {
 		AST_STRING_FIELD(session_id);
 		AST_STRING_FIELD(service_key);
 		AST_STRING_FIELD(endpoint);
+		AST_STRING_FIELD(active_endpoint);
 		AST_STRING_FIELD(event);
+		AST_STRING_FIELD(prefetch_event);
+		AST_STRING_FIELD(cache_key);
+		AST_STRING_FIELD(prefetch_language);
 		AST_STRING_FIELD(language);
 		AST_STRING_FIELD(lastAudioResponse);
+		AST_STRING_FIELD(channel_name);
+		AST_STRING_FIELD(last_interim_transcript);
+		AST_STRING_FIELD(dtmf_hook_channel); /* the channel the hook is attached to */
+		AST_STRING_FIELD(dtmf_event); /* effective for the current turn */
+		AST_STRING_FIELD(statsd_prefix); /* gdfe.<agent> for the current turn */
 
 		AST_STRING_FIELD(call_log_path);
 		AST_STRING_FIELD(call_log_file_basename);
@@ -121,24 +343,202 @@ struct gdf_logical_agent {
 	const char *name;
 	const char *project_id;
 	const char *service_key;
-	char endpoint[0];
+
+	int max_concurrent_streams; /* 0 for unlimited */
+	double max_requests_per_second; /* 0 for unlimited */
+	int max_queue_length;
+	int queue_timeout; /* ms */
+
+	int circuit_breaker_errors;
+	int circuit_breaker_timeout; /* ms */
+	int hedge_events;
+	int hedge_min_delay; /* ms */
+
+	int request_timeout; /* ms, 0 for no deadline */
+
+	int continuous_streaming;
+	int continuous_stream_max_idle; /* ms */
+
+	char *interim_match; /* ends the turn early when an interim transcript matches */
+	regex_t interim_match_regex;
+	int interim_match_compiled;
+	int interim_match_score;
+
+	int no_input_timeout; /* ms */
+	int max_speech_duration; /* ms */
+
+	int stream_chunk_ms; /* audio coalesced into each df_write_audio */
+
+	char *prefetch_events; /* events sent as soon as their grammar is activated */
+	char *cache_events; /* events whose responses are the same for every caller */
+	int cache_ttl; /* seconds */
+
+	enum gdf_dtmf_mode dtmf_mode;
+	char dtmf_terminator;
+	int dtmf_interdigit_timeout; /* ms */
+	int dtmf_max_digits;
+	char *dtmf_event; /* the prefix of the event digits are sent as */
+
+	char endpoint[0]; /* comma separated, in order of preference */
+};
+
+struct gdf_endpoint_health {
+	char endpoint[GDF_ENDPOINT_LEN];
+	double latency_score; /* ms, exponentially weighted; 0 until measured */
+	int latency_samples[GDF_LATENCY_SAMPLES];
+	unsigned int latency_sample_count;
+	int consecutive_errors;
+	int ejected;
+	struct timeval ejected_until;
+	int probe_in_flight;
+	struct timeval probe_started;
+
+	unsigned int requests;
+	unsigned int errors;
+	unsigned int ejections;
+	unsigned int hedges;
+};
+
+enum gdf_latency_stage {
+	LATENCY_SPEECH_START,	/* gdf_start to the caller starting to speak */
+	LATENCY_STREAM_OPEN,	/* df_start_recognition */
+	LATENCY_FIRST_AUDIO,	/* start of speech to the first audio sent */
+	LATENCY_FINAL_RESULT,	/* start of speech to the final result */
+	LATENCY_QUERY,		/* gdf_start to the result of an event */
+	LATENCY_TTS,		/* synthesizing fulfillment text */
+	LATENCY_GET_RESULTS,	/* gdf_get_results, including any synthesis */
+	LATENCY_TURN,		/* gdf_start to the end of gdf_get_results */
+	LATENCY_STAGE_COUNT
+};
+
+static const char *latency_stage_names[] = {
+	[LATENCY_SPEECH_START] = "speech_start",
+	[LATENCY_STREAM_OPEN] = "stream_open",
+	[LATENCY_FIRST_AUDIO] = "first_audio",
+	[LATENCY_FINAL_RESULT] = "final_result",
+	[LATENCY_QUERY] = "query",
+	[LATENCY_TTS] = "tts",
+	[LATENCY_GET_RESULTS] = "get_results",
+	[LATENCY_TURN] = "turn",
+};
+
+/* counters in the shared stats segment (at most GDFE_STATS_MAX_COUNTERS), also sent to StatsD under the same names */
+enum gdf_stat {
+	STAT_SESSIONS_ACTIVE,
+	STAT_SESSIONS_CREATED,
+	STAT_SESSIONS_TORN_DOWN,
+	STAT_STREAMS_ACTIVE,
+	STAT_STREAMS_OPENED,
+	STAT_STREAMS_RECOVERED,
+	STAT_ADMISSION_QUEUED,
+	STAT_ADMISSION_REJECTED,
+	STAT_ADMISSION_TIMEOUT,
+	STAT_ERRORS_STREAM_OPEN,
+	STAT_ERRORS_STREAM,
+	STAT_ERRORS_QUERY,
+	STAT_ERRORS_TTS,
+	STAT_TTS_CALLS,
+	STAT_CACHE_HITS,
+	STAT_CACHE_MISSES,
+	STAT_PREFETCHES,
+	STAT_PREFETCH_HITS,
+	STAT_PREFETCH_WASTED,
+	STAT_VAD_START_OF_SPEECH,
+	STAT_VAD_END_OF_SPEECH,
+	STAT_VAD_BARGE_IN,
+	STAT_UPLINK_BYTES,
+	STAT_UPLINK_MESSAGES,
+	STAT_ABANDONED_RPCS,
+	STAT_DEADLINES_EXCEEDED,
+	STAT_COUNT
+};
+
+static const char *stat_names[] = {
+	[STAT_SESSIONS_ACTIVE] = "sessions.active",
+	[STAT_SESSIONS_CREATED] = "sessions.created",
+	[STAT_SESSIONS_TORN_DOWN] = "sessions.torn_down",
+	[STAT_STREAMS_ACTIVE] = "streams.active",
+	[STAT_STREAMS_OPENED] = "streams.opened",
+	[STAT_STREAMS_RECOVERED] = "streams.recovered",
+	[STAT_ADMISSION_QUEUED] = "admission.queued",
+	[STAT_ADMISSION_REJECTED] = "admission.rejected",
+	[STAT_ADMISSION_TIMEOUT] = "admission.timeout",
+	[STAT_ERRORS_STREAM_OPEN] = "errors.stream_open",
+	[STAT_ERRORS_STREAM] = "errors.stream",
+	[STAT_ERRORS_QUERY] = "errors.query",
+	[STAT_ERRORS_TTS] = "errors.tts",
+	[STAT_TTS_CALLS] = "tts.calls",
+	[STAT_CACHE_HITS] = "cache.hits",
+	[STAT_CACHE_MISSES] = "cache.misses",
+	[STAT_PREFETCHES] = "prefetch.sent",
+	[STAT_PREFETCH_HITS] = "prefetch.hits",
+	[STAT_PREFETCH_WASTED] = "prefetch.wasted",
+	[STAT_VAD_START_OF_SPEECH] = "vad.start_of_speech",
+	[STAT_VAD_END_OF_SPEECH] = "vad.end_of_speech",
+	[STAT_VAD_BARGE_IN] = "vad.barge_in",
+	[STAT_UPLINK_BYTES] = "uplink.bytes",
+	[STAT_UPLINK_MESSAGES] = "uplink.messages",
+	[STAT_ABANDONED_RPCS] = "rpcs.abandoned",
+	[STAT_DEADLINES_EXCEEDED] = "rpcs.deadlines_exceeded",
+};
+
+/* the histograms have the same layout as the shared stats segment's and are updated with atomic operations only */
+#define LATENCY_BUCKETS		GDFE_STATS_BUCKETS
+
+/* live per-agent state, kept across reloads and keyed by logical agent name */
+struct gdf_agent_runtime {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+
+	int active_streams;
+	int waiting;
+	double tokens;
+	struct timeval last_refill;
+
+	unsigned int admitted;
+	unsigned int queued;
+	unsigned int rejected;
+	unsigned int timed_out;
+
+	int endpoint_count;
+	struct gdf_endpoint_health endpoints[GDF_MAX_ENDPOINTS];
+
+	struct gdfe_stats_histogram latency[LATENCY_STAGE_COUNT];
+	struct gdfe_stats_agent *stats; /* in the shared stats segment, if it has room */
+
+	char name[0];
 };
 
+static struct ao2_container *agent_runtimes;
+
 struct gdf_config {
 	int vad_voice_threshold;
 	int vad_voice_minimum_duration;
 	int vad_silence_minimum_duration;
 
+	enum gdf_barge_in_policy barge_in_policy;
+	int barge_in_minimum_duration;
+
 	int enable_call_logs;
 	int enable_preendpointer_recordings;
 	int enable_postendpointer_recordings;
 
+	int stream_recovery_attempts;
+	int stream_recovery_buffer; /* ms */
+
+	int event_workers;
+
+	int statsd;
+	double statsd_sample_rate; /* applied to the latency timers */
+
 	struct ao2_container *logical_agents;
 
 	AST_DECLARE_STRING_FIELDS(
 		AST_STRING_FIELD(service_key);
 		AST_STRING_FIELD(endpoint);
+		AST_STRING_FIELD(tts_endpoint);
 		AST_STRING_FIELD(call_log_location);
+		AST_STRING_FIELD(stats_segment);
 	);
 };
 
@@ -151,7 +551,207 @@ enum gdf_call_log_type {
 static struct gdf_config *gdf_get_config(void);
 static struct gdf_logical_agent *get_logical_agent_by_name(struct gdf_config *config, const char *name);
 static void gdf_log_call_event(struct gdf_pvt *pvt, enum gdf_call_log_type type, const char *event, size_t log_data_size, const struct dialogflow_log_data *log_data);
+static void write_call_log_line(struct gdf_pvt *pvt, enum gdf_call_log_type type, const char *event, size_t log_data_size, const struct dialogflow_log_data *log_data);
+static void clear_local_results(struct gdf_pvt *pvt);
 #define gdf_log_call_event_only(pvt, type, event)       gdf_log_call_event(pvt, type, event, 0, NULL)
+static enum gdf_admission_result gdf_admit_request(struct gdf_pvt *pvt);
+static enum gdf_admission_result gdf_try_admit_request(struct gdf_pvt *pvt);
+static void gdf_release_admission(struct gdf_pvt *pvt);
+static int route_session_endpoint(struct gdf_pvt *pvt, int only_if_ejected);
+static void record_endpoint_result(struct gdf_pvt *pvt, int64_t latency_ms, int success);
+static int64_t monotonic_us(void);
+static struct gdf_agent_runtime *get_agent_runtime(const char *name);
+static void record_latency(struct gdf_pvt *pvt, enum gdf_latency_stage stage, int64_t since_us);
+static size_t format_statsd_prefix(char *prefix, size_t size, const char *agent);
+static void gdf_statsd(const char *agent, const char *metric, const char *type, intmax_t value, int sampled);
+static void gdf_pvt_statsd(struct gdf_pvt *pvt, const char *metric, const char *type, intmax_t value, int sampled);
+static void gdf_stats_add(enum gdf_stat stat, int64_t value);
+static void gdf_count(const char *agent, enum gdf_stat stat, int64_t value);
+static void gdf_pvt_count(struct gdf_pvt *pvt, enum gdf_stat stat, int64_t value);
+struct gdf_async_query;
+static void gdf_recognize_event(struct gdf_async_query *query);
+static void finish_async_query(struct gdf_async_query *query, int res);
+static void close_preopened_stream(struct gdf_pvt *pvt);
+static void stop_stream_async(struct gdf_pvt *pvt);
+static int start_async_query(struct gdf_pvt *pvt, const char *event, const char *language, int prefetch);
+static int claim_preopened_stream(struct gdf_pvt *pvt);
+static void maybe_prefetch_event(struct gdf_pvt *pvt);
+static int dtmf_turn_ready(struct gdf_pvt *pvt);
+static void complete_dtmf_turn(struct ast_speech *speech, struct gdf_pvt *pvt);
+static void detach_dtmf_hook(struct gdf_pvt *pvt);
+static void first_endpoint(const char *endpoints, char *buf, size_t len);
+static int get_agent_request_timeout(const char *name);
+static void gdf_pvt_release_pending(struct gdf_pvt *pvt);
+
+/* engine wide counters shown by 'gdfe show stats' */
+static struct {
+	ast_mutex_t lock;
+	int abandoned_rpcs;
+	int deadlines_exceeded;
+	unsigned int teardowns;
+	int64_t teardown_ms_total;
+	int64_t teardown_ms_max;
+	unsigned int prefetches;
+	unsigned int prefetch_hits;
+	unsigned int prefetches_wasted; /* not used by the turn that followed, or failed */
+	unsigned int cache_hits;
+	unsigned int cache_misses;
+	int64_t uplink_bytes; /* sent to DialogFlow */
+	int64_t uplink_messages;
+	struct timeval started;
+} engine_stats;
+
+/* speech objects that exist, for the StatsD gauge */
+static int active_sessions;
+
+/* copied from the config by load_config, so sending a metric does not fetch the config */
+static int statsd_enabled;
+static int statsd_sample_ppm = 1000000; /* statsd_sample_rate, in millionths */
+
+/* mapped at load and never moved, so it is used without locking */
+static struct gdfe_stats_segment *stats_segment;
+static char *stats_segment_path;
+
+/*!
+ * \brief create and map the shared stats segment, replacing any left by an earlier run
+ *
+ * The old file is unlinked rather than reused, so a reader that still has it
+ * mapped keeps seeing the old values instead of a half-initialized segment.
+ */
+static void open_stats_segment(const char *path)
+{
+	struct gdfe_stats_segment *segment;
+	int fd;
+	int i;
+
+	if (ast_strlen_zero(path)) {
+		return;
+	}
+
+	unlink(path);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		ast_log(LOG_WARNING, "Unable to create stats segment %s: %s\n", path, strerror(errno));
+		return;
+	}
+	if (ftruncate(fd, sizeof(*segment))) {
+		ast_log(LOG_WARNING, "Unable to size stats segment %s: %s\n", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return;
+	}
+	segment = mmap(NULL, sizeof(*segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		ast_log(LOG_WARNING, "Unable to map stats segment %s: %s\n", path, strerror(errno));
+		unlink(path);
+		return;
+	}
+
+	segment->version = GDFE_STATS_VERSION;
+	segment->size = sizeof(*segment);
+	segment->pid = getpid();
+	segment->started = time(NULL);
+	segment->cpu_slots = GDFE_STATS_CPU_SLOTS;
+	segment->stat_count = STAT_COUNT;
+	for (i = 0; i < STAT_COUNT; i++) {
+		ast_copy_string(segment->stat_names[i], stat_names[i], sizeof(segment->stat_names[i]));
+	}
+	segment->stage_count = LATENCY_STAGE_COUNT;
+	for (i = 0; i < LATENCY_STAGE_COUNT; i++) {
+		ast_copy_string(segment->stage_names[i], latency_stage_names[i], sizeof(segment->stage_names[i]));
+	}
+	__sync_synchronize();
+	segment->magic = GDFE_STATS_MAGIC;
+
+	stats_segment_path = ast_strdup(path);
+	stats_segment = segment;
+}
+
+static void close_stats_segment(void)
+{
+	if (!stats_segment) {
+		return;
+	}
+	munmap(stats_segment, sizeof(*stats_segment));
+	stats_segment = NULL;
+	if (stats_segment_path) {
+		unlink(stats_segment_path);
+		ast_free(stats_segment_path);
+		stats_segment_path = NULL;
+	}
+}
+
+/*! \brief claim a slot for an agent's histograms in the shared stats segment; agent_runtimes is locked */
+static struct gdfe_stats_agent *gdf_stats_agent_slot(const char *name)
+{
+	struct gdfe_stats_agent *agent;
+
+	if (!stats_segment || stats_segment->agent_count >= GDFE_STATS_MAX_AGENTS) {
+		return NULL;
+	}
+	agent = &stats_segment->agents[stats_segment->agent_count];
+	ast_copy_string(agent->name, name, sizeof(agent->name));
+	/* readers only look at slots below agent_count */
+	__sync_synchronize();
+	stats_segment->agent_count++;
+	return agent;
+}
+
+#define SESSION_REGISTRY_SHARDS	16
+
+AST_LIST_HEAD(gdf_session_list, gdf_pvt);
+
+/* every session from gdf_create until it is freed, spread over several lists so
+ * channels starting and ending at the same time rarely wait on each other; the
+ * audio path never touches it */
+static struct gdf_session_list session_registry[SESSION_REGISTRY_SHARDS];
+
+static struct gdf_session_list *session_registry_shard(struct gdf_pvt *pvt)
+{
+	/* allocations are at least 16 byte aligned, so skip the bits that never change */
+	return &session_registry[((uintptr_t) pvt >> 4) % SESSION_REGISTRY_SHARDS];
+}
+
+static void register_session(struct gdf_pvt *pvt)
+{
+	struct gdf_session_list *shard = session_registry_shard(pvt);
+
+	AST_LIST_LOCK(shard);
+	AST_LIST_INSERT_TAIL(shard, pvt, registry_entry);
+	AST_LIST_UNLOCK(shard);
+}
+
+static void unregister_session(struct gdf_pvt *pvt)
+{
+	struct gdf_session_list *shard = session_registry_shard(pvt);
+
+	AST_LIST_LOCK(shard);
+	AST_LIST_REMOVE(shard, pvt, registry_entry);
+	AST_LIST_UNLOCK(shard);
+}
+
+/*! \brief remember the session's most recent error for gdfe show sessions, and count it */
+static void record_session_error(struct gdf_pvt *pvt, enum gdf_stat stat)
+{
+	ast_mutex_lock(&pvt->lock);
+	pvt->last_error = stat_names[stat];
+	pvt->last_error_time = ast_tvnow();
+	ast_mutex_unlock(&pvt->lock);
+
+	gdf_pvt_count(pvt, stat, 1);
+}
+
+/* tears down sessions off the channel thread */
+static struct ast_taskprocessor *reaper;
+
+/* runs event requests so gdf_start never waits on the network */
+static struct ast_threadpool *event_pool;
+
+static struct ao2_container *response_cache;
+static struct gdf_cached_response *find_cached_response(const char *key);
+static int event_in_list(const char *list, const char *event);
+static void resampler_init(struct gdf_resampler *resampler, int from_rate, int to_rate);
 
 static struct ast_str *build_log_related_filename_to_thread_local_str(struct gdf_pvt *pvt, int include_utterance_counter, const char *type, const char *extension);
 
@@ -176,6 +776,8 @@ static int gdf_create(struct ast_speech *speech, local_ast_format_t format)
 	}
 
 	ast_mutex_init(&pvt->lock);
+	ast_cond_init(&pvt->async_query_done, NULL);
+	pvt->created = ast_tvnow();
 
 	ast_build_string(&sid, &sidlen, "%p", pvt);
 
@@ -183,7 +785,11 @@ static int gdf_create(struct ast_speech *speech, local_ast_format_t format)
 
 	pvt->session = df_create_session(pvt);
 	df_set_auth_key(pvt->session, cfg->service_key);
-	df_set_endpoint(pvt->session, cfg->endpoint);
+	{
+		char endpoint[GDF_ENDPOINT_LEN];
+		first_endpoint(cfg->endpoint, endpoint, sizeof(endpoint));
+		df_set_endpoint(pvt->session, endpoint);
+	}
 
 	if (!pvt->session) {
 		ast_log(LOG_WARNING, "Error creating session for GDF\n");
@@ -198,7 +804,19 @@ static int gdf_create(struct ast_speech *speech, local_ast_format_t format)
 	pvt->voice_threshold = cfg->vad_voice_threshold;
 	pvt->voice_minimum_duration = cfg->vad_voice_minimum_duration;
 	pvt->silence_minimum_duration = cfg->vad_silence_minimum_duration;
+	pvt->barge_in_policy = cfg->barge_in_policy;
+	pvt->barge_in_minimum_duration = cfg->barge_in_minimum_duration;
 	ast_string_field_set(pvt, call_logging_application_name, "unknown");
+	pvt->speech = speech;
+	pvt->continuous_streaming = -1;
+	pvt->no_input_timeout = -1;
+	pvt->max_speech_duration = -1;
+#ifdef ASTERISK_13_OR_LATER
+	pvt->sample_rate = ast_format_get_sample_rate(format) == 16000 ? 16000 : 8000;
+#else
+	pvt->sample_rate = 8000;
+#endif
+	resampler_init(&pvt->narrow_resampler, pvt->sample_rate, 8000);
 
 	ast_mutex_lock(&speech->lock);
 	speech->state = AST_SPEECH_STATE_NOT_READY;
@@ -207,29 +825,176 @@ static int gdf_create(struct ast_speech *speech, local_ast_format_t format)
 
 	ao2_t_ref(cfg, -1, "done with creating session");
 
+	register_session(pvt);
+
+	gdf_statsd(NULL, "sessions.active", AST_STATSD_GAUGE, ast_atomic_fetchadd_int(&active_sessions, 1) + 1, 0);
+	gdf_stats_add(STAT_SESSIONS_ACTIVE, 1);
+	gdf_stats_add(STAT_SESSIONS_CREATED, 1);
+
 	return 0;
 }
 
-static int gdf_destroy(struct ast_speech *speech)
+/*! \brief pick the chunk size for a stream about to be opened */
+static void start_uplink(struct gdf_pvt *pvt)
 {
-	struct gdf_pvt *pvt = speech->data;
+	struct gdf_config *config;
+	int chunk_ms = 20;
+	size_t chunk_size;
 
-	if (speech->state == AST_SPEECH_STATE_READY) {
-		df_stop_recognition(pvt->session);
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent;
+		ast_mutex_lock(&pvt->lock);
+		agent = get_logical_agent_by_name(config, pvt->logical_agent_name);
+		ast_mutex_unlock(&pvt->lock);
+		if (agent) {
+			chunk_ms = agent->stream_chunk_ms;
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
 	}
 
-	if (!ast_strlen_zero(pvt->lastAudioResponse)) {
-		unlink(pvt->lastAudioResponse);
+	/* reused for the life of the session unless the size changes */
+	chunk_size = chunk_ms * MULAW_BYTES_PER_MS;
+	if (chunk_size != pvt->chunk_buffer_size) {
+		ast_free(pvt->chunk_buffer);
+		pvt->chunk_buffer = ast_malloc(chunk_size);
+		pvt->chunk_buffer_size = pvt->chunk_buffer ? chunk_size : 0;
+	}
+	pvt->chunk_len = 0;
+}
+
+static void gdf_pvt_free(struct gdf_pvt *pvt)
+{
+	unregister_session(pvt);
+
+	clear_local_results(pvt);
+
+	if (pvt->cached_response) {
+		ao2_ref(pvt->cached_response, -1);
+	}
+	if (pvt->turn_runtime) {
+		ao2_ref(pvt->turn_runtime, -1);
 	}
 
-	df_close_session(pvt->session);
+	ast_free(pvt->chunk_buffer);
+	ast_free(pvt->narrow_buffer);
+	ast_free(pvt->mulaw_buffer);
 
 	if (pvt->call_log_file_handle != NULL) {
 		fclose(pvt->call_log_file_handle);
 	}
 
+	ast_free(pvt->replay_buffer);
+	ast_free(pvt->held_audio);
+
 	ast_string_field_free_memory(pvt);
+	ast_cond_destroy(&pvt->async_query_done);
 	ast_mutex_destroy(&pvt->lock);
+	ast_free(pvt);
+}
+
+/* an abandoned request has finished with the pvt */
+static void gdf_pvt_release_pending(struct gdf_pvt *pvt)
+{
+	int free_now;
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->pending_requests--;
+	free_now = (pvt->destroyed && !pvt->pending_requests);
+	ast_mutex_unlock(&pvt->lock);
+
+	if (free_now) {
+		gdf_pvt_free(pvt);
+	}
+}
+
+/* runs on the reaper so a slow backend never holds up the channel thread */
+static int gdf_teardown_task(void *data)
+{
+	struct gdf_pvt *pvt = data;
+	int free_now;
+	int pending;
+	int preopening;
+	int64_t teardown_ms;
+
+	ast_mutex_lock(&pvt->lock);
+	preopening = pvt->stream_preopening;
+	if (preopening) {
+		/* the pre-open stops the stream and closes the session when it finishes */
+		pvt->close_session_after_query = 1;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	if (pvt->session && pvt->recognition_active && !preopening) {
+		df_stop_recognition(pvt->session);
+	}
+
+	if (!ast_strlen_zero(pvt->lastAudioResponse)) {
+		unlink(pvt->lastAudioResponse);
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->async_query_active) {
+		/* the session is still in use, the request closes it when it finishes */
+		pvt->close_session_after_query = 1;
+	} else if (pvt->session && !preopening) {
+		df_close_session(pvt->session);
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	gdf_release_admission(pvt);
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->destroyed = 1;
+	pending = pvt->pending_requests;
+	free_now = !pending;
+	teardown_ms = ast_tvdiff_ms(ast_tvnow(), pvt->destroy_requested);
+	ast_mutex_unlock(&pvt->lock);
+
+	/* anything still pending has been abandoned -- its result is discarded when it finishes */
+	ast_atomic_fetchadd_int(&engine_stats.abandoned_rpcs, pending);
+	gdf_stats_add(STAT_ABANDONED_RPCS, pending);
+	gdf_stats_add(STAT_SESSIONS_TORN_DOWN, 1);
+
+	ast_mutex_lock(&engine_stats.lock);
+	engine_stats.teardowns++;
+	engine_stats.teardown_ms_total += teardown_ms;
+	if (teardown_ms > engine_stats.teardown_ms_max) {
+		engine_stats.teardown_ms_max = teardown_ms;
+	}
+	ast_mutex_unlock(&engine_stats.lock);
+
+	if (free_now) {
+		gdf_pvt_free(pvt);
+	}
+
+	return 0;
+}
+
+static int gdf_destroy(struct ast_speech *speech)
+{
+	struct gdf_pvt *pvt = speech->data;
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->destroy_requested = ast_tvnow();
+	pvt->speech = NULL;
+	ast_mutex_unlock(&pvt->lock);
+
+	gdf_statsd(NULL, "sessions.active", AST_STATSD_GAUGE, ast_atomic_fetchadd_int(&active_sessions, -1) - 1, 0);
+	gdf_stats_add(STAT_SESSIONS_ACTIVE, -1);
+
+	if (pvt->dtmf_hook) {
+		detach_dtmf_hook(pvt);
+	}
+
+	speech->data = NULL;
+
+	if (!reaper || ast_taskprocessor_push(reaper, gdf_teardown_task, pvt)) {
+		ast_log(LOG_WARNING, "Unable to queue teardown of %s, tearing down in place\n", pvt->session_id);
+		gdf_teardown_task(pvt);
+	}
+
 	return 0;
 }
 
@@ -294,7 +1059,7 @@ static void activate_agent_for_name(struct gdf_pvt *pvt, const char *name, size_
 		ast_mutex_unlock(&pvt->lock);
 	}
 	df_set_project_id(pvt->session, pvt->project_id);
-	df_set_endpoint(pvt->session, pvt->endpoint);
+	route_session_endpoint(pvt, 0);
 	df_set_auth_key(pvt->session, pvt->service_key);
 
 	if (!ast_strlen_zero(event)) {
@@ -333,10 +1098,15 @@ static int gdf_activate(struct ast_speech *speech, const char *grammar_name)
 		activate_old_style_event(pvt, grammar_name);
 	} else if (is_grammar_new_style_format(grammar_name)) {
 		activate_new_style_grammar(pvt, grammar_name);
+	} else if (!strncasecmp(grammar_name, "text:", 5)) {
+		/* libdfegrpc only sends events and streamed audio, so there is no request to put text in */
+		ast_log(LOG_WARNING, "Text queries are not supported by libdfegrpc, ignoring grammar %s on %s\n", grammar_name, pvt->session_id);
+		return -1;
 	} else {
 		ast_log(LOG_WARNING, "Do not understand grammar name %s on %s\n", grammar_name, pvt->session_id);
 		return -1;
 	}
+	maybe_prefetch_event(pvt);
 	return 0;
 }
 
@@ -345,64 +1115,244 @@ static int gdf_deactivate(struct ast_speech *speech, const char *grammar_name)
 	return 0;
 }
 
-static int calculate_audio_level(const short *slin, int len)
+/* Q15, computed at load */
+static short resampler_down_taps[RESAMPLER_TAPS];
+static short resampler_up_taps[2][RESAMPLER_TAPS / 2]; /* for even and odd output samples */
+
+/*! \brief windowed sinc low-pass just under 4kHz, split into its two phases for doubling the rate */
+static void init_resampler_taps(void)
 {
+	double taps[RESAMPLER_TAPS];
+	double cutoff = 0.45 * 0.5; /* of the 16kHz rate */
+	double sum = 0;
 	int i;
-	long long sum = 0;
-	for (i = 0; i < len; i++) {
-		short sample = slin[i];
-		sum += abs(sample);
+
+	for (i = 0; i < RESAMPLER_TAPS; i++) {
+		double t = i - (RESAMPLER_TAPS - 1) / 2.0; /* never 0 with an even number of taps */
+		double window = 0.54 - 0.46 * cos(2 * M_PI * i / (RESAMPLER_TAPS - 1));
+		taps[i] = sin(2 * M_PI * cutoff * t) / (M_PI * t) * window;
+		sum += taps[i];
+	}
+
+	for (i = 0; i < RESAMPLER_TAPS; i++) {
+		resampler_down_taps[i] = lrint(taps[i] / sum * 32768);
+	}
+	/* each phase only sees every other tap, so twice the gain makes up for the zeros between input samples */
+	for (i = 0; i < RESAMPLER_TAPS / 2; i++) {
+		resampler_up_taps[0][i] = lrint(taps[2 * i + 1] / sum * 65536);
+		resampler_up_taps[1][i] = lrint(taps[2 * i] / sum * 65536);
 	}
-#ifdef RES_SPEECH_GDFE_DEBUG_VAD
-	ast_log(LOG_DEBUG, "packet sum = %lld, average = %d\n", sum, (int)(sum / len));
-#endif
-	return sum / len;
 }
 
-static void write_end_of_recognition_call_event(struct gdf_pvt *pvt)
+static void resampler_init(struct gdf_resampler *resampler, int from_rate, int to_rate)
 {
-	gdf_log_call_event_only(pvt, CALL_LOG_TYPE_SESSION, "end");
+	resampler->up = to_rate > from_rate;
+	resampler->history_len = (resampler->up ? RESAMPLER_TAPS / 2 : RESAMPLER_TAPS) - 1;
+	memset(resampler->history, 0, sizeof(resampler->history));
 }
 
-static int are_currently_recording_pre_endpointed_audio(struct gdf_pvt *pvt)
+static int dot_q15(const short *samples, const short *taps, int count)
 {
-	int are_recording;
-	ast_mutex_lock(&pvt->lock);
-	are_recording = (pvt->utterance_preendpointer_recording_file_handle != NULL);
-	ast_mutex_unlock(&pvt->lock);
-	return are_recording;
+	int sum = 0;
+	int i = 0;
+
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	int lanes[4];
+
+	for (; i + 8 <= count; i += 8) {
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (samples + i)),
+			_mm_loadu_si128((const __m128i *) (taps + i))));
+	}
+	_mm_storeu_si128((__m128i *) lanes, acc);
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+	for (; i < count; i++) {
+		sum += samples[i] * taps[i];
+	}
+
+	return sum;
 }
 
-static int open_preendpointed_recording_file(struct gdf_pvt *pvt)
+static short clamp_q15(int sum)
 {
-	struct ast_str *path = build_log_related_filename_to_thread_local_str(pvt, 1, "pre", "ul");
-	FILE *record_file;
-
-	ast_mutex_lock(&pvt->lock);
-	pvt->utterance_preendpointer_recording_open_already_attempted = 1;
-	ast_mutex_unlock(&pvt->lock);
+	sum = (sum + (1 << 14)) >> 15;
+	return sum > SHRT_MAX ? SHRT_MAX : sum < SHRT_MIN ? SHRT_MIN : sum;
+}
 
-	record_file = fopen(ast_str_buffer(path), "w");
-	if (record_file) {
-		struct dialogflow_log_data log_data[] = {
-			{ "filename", ast_str_buffer(path) }
-		};
-		gdf_log_call_event(pvt, CALL_LOG_TYPE_ENDPOINTER, "pre_recording_start", ARRAY_LEN(log_data), log_data);
-		ast_log(LOG_DEBUG, "Opened %s for preendpointer recording for %s\n", ast_str_buffer(path), pvt->session_id);
-		ast_mutex_lock(&pvt->lock);
-		pvt->utterance_preendpointer_recording_file_handle = record_file;
-		ast_mutex_unlock(&pvt->lock);
+/*!
+ * \brief resample a frame between 8kHz and 16kHz
+ * \param out room for twice count samples when doubling the rate, count otherwise
+ * \return the number of samples written to out
+ */
+static int resample(struct gdf_resampler *resampler, const short *in, int count, short *out)
+{
+	int taps = resampler->up ? RESAMPLER_TAPS / 2 : RESAMPLER_TAPS;
+	int len = resampler->history_len + count;
+	short *work = alloca(len * sizeof(short));
+	int produced = 0;
+	int pos;
+
+	memcpy(work, resampler->history, resampler->history_len * sizeof(short));
+	memcpy(work + resampler->history_len, in, count * sizeof(short));
+
+	if (resampler->up) {
+		for (pos = 0; pos + taps <= len; pos++) {
+			out[produced++] = clamp_q15(dot_q15(work + pos, resampler_up_taps[0], taps));
+			out[produced++] = clamp_q15(dot_q15(work + pos, resampler_up_taps[1], taps));
+		}
 	} else {
-		ast_log(LOG_WARNING, "Unable to open %s for preendpointer recording for %s -- %d: %s\n", ast_str_buffer(path), pvt->session_id, errno, strerror(errno));
+		for (pos = 0; pos + taps <= len; pos += 2) {
+			out[produced++] = clamp_q15(dot_q15(work + pos, resampler_down_taps, taps));
+		}
 	}
 
-	return (record_file == NULL ? -1 : 0);
+	resampler->history_len = len - pos;
+	memcpy(resampler->history, work + pos, resampler->history_len * sizeof(short));
+
+	return produced;
 }
 
-static int open_postendpointed_recording_file(struct gdf_pvt *pvt)
+/* only called from gdf_write, so the frame buffers need no locking */
+static int reserve_frame_buffers(struct gdf_pvt *pvt, int samples)
 {
-	struct ast_str *path = build_log_related_filename_to_thread_local_str(pvt, 1, "post", "ul");
-	FILE *record_file;
+	short *narrow;
+	char *mulaw;
+
+	if (samples <= pvt->frame_buffer_samples) {
+		return 0;
+	}
+	narrow = ast_realloc(pvt->narrow_buffer, samples * sizeof(short));
+	if (!narrow) {
+		return -1;
+	}
+	pvt->narrow_buffer = narrow;
+	mulaw = ast_realloc(pvt->mulaw_buffer, samples);
+	if (!mulaw) {
+		return -1;
+	}
+	pvt->mulaw_buffer = mulaw;
+	pvt->frame_buffer_samples = samples;
+	return 0;
+}
+
+/*!
+ * \brief 8kHz mu-law of a frame, for the recordings and the uplink
+ * \return the number of bytes left in pvt->mulaw_buffer, 0 if there was no room for them
+ */
+static int narrow_to_mulaw(struct gdf_pvt *pvt, const short *slin, int samples)
+{
+	const short *narrow = slin;
+	int i;
+
+	if (reserve_frame_buffers(pvt, samples)) {
+		return 0;
+	}
+
+	if (pvt->sample_rate != 8000) {
+		samples = resample(&pvt->narrow_resampler, slin, samples, pvt->narrow_buffer);
+		narrow = pvt->narrow_buffer;
+	}
+
+	for (i = 0; i < samples; i++) {
+		pvt->mulaw_buffer[i] = AST_LIN2MU(narrow[i]);
+	}
+
+	return samples;
+}
+
+static int calculate_audio_level(const short *slin, int len)
+{
+	int i;
+	long long sum = 0;
+	for (i = 0; i < len; i++) {
+		short sample = slin[i];
+		sum += abs(sample);
+	}
+#ifdef RES_SPEECH_GDFE_DEBUG_VAD
+	ast_log(LOG_DEBUG, "packet sum = %lld, average = %d\n", sum, (int)(sum / len));
+#endif
+	return sum / len;
+}
+
+static void write_end_of_recognition_call_event(struct gdf_pvt *pvt)
+{
+	char uplink_bytes[21];
+	char uplink_messages[11];
+	struct dialogflow_log_data log_data[] = {
+		{ "uplink_bytes", uplink_bytes },
+		{ "uplink_messages", uplink_messages }
+	};
+
+	if (!pvt->turn_result_us && !pvt->turn_finished_locally) {
+		pvt->turn_result_us = monotonic_us();
+		if (pvt->turn_query) {
+			record_latency(pvt, LATENCY_QUERY, pvt->turn_start_us);
+		} else {
+			record_latency(pvt, LATENCY_FINAL_RESULT, pvt->speech_start_us);
+		}
+	}
+
+	sprintf(uplink_bytes, "%" PRId64, pvt->turn_uplink_bytes);
+	sprintf(uplink_messages, "%d", pvt->turn_uplink_messages);
+	if (pvt->turn_uplink_messages) {
+		gdf_pvt_count(pvt, STAT_UPLINK_BYTES, pvt->turn_uplink_bytes);
+		gdf_pvt_count(pvt, STAT_UPLINK_MESSAGES, pvt->turn_uplink_messages);
+	}
+	gdf_log_call_event(pvt, CALL_LOG_TYPE_SESSION, "end", ARRAY_LEN(log_data), log_data);
+
+	ast_mutex_lock(&engine_stats.lock);
+	engine_stats.uplink_bytes += pvt->turn_uplink_bytes;
+	engine_stats.uplink_messages += pvt->turn_uplink_messages;
+	ast_mutex_unlock(&engine_stats.lock);
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->uplink_bytes += pvt->turn_uplink_bytes;
+	pvt->turn_uplink_bytes = 0;
+	pvt->turn_uplink_messages = 0;
+	ast_mutex_unlock(&pvt->lock);
+}
+
+static int are_currently_recording_pre_endpointed_audio(struct gdf_pvt *pvt)
+{
+	int are_recording;
+	ast_mutex_lock(&pvt->lock);
+	are_recording = (pvt->utterance_preendpointer_recording_file_handle != NULL);
+	ast_mutex_unlock(&pvt->lock);
+	return are_recording;
+}
+
+static int open_preendpointed_recording_file(struct gdf_pvt *pvt)
+{
+	struct ast_str *path = build_log_related_filename_to_thread_local_str(pvt, 1, "pre", "ul");
+	FILE *record_file;
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->utterance_preendpointer_recording_open_already_attempted = 1;
+	ast_mutex_unlock(&pvt->lock);
+
+	record_file = fopen(ast_str_buffer(path), "w");
+	if (record_file) {
+		struct dialogflow_log_data log_data[] = {
+			{ "filename", ast_str_buffer(path) }
+		};
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_ENDPOINTER, "pre_recording_start", ARRAY_LEN(log_data), log_data);
+		ast_log(LOG_DEBUG, "Opened %s for preendpointer recording for %s\n", ast_str_buffer(path), pvt->session_id);
+		ast_mutex_lock(&pvt->lock);
+		pvt->utterance_preendpointer_recording_file_handle = record_file;
+		ast_mutex_unlock(&pvt->lock);
+	} else {
+		ast_log(LOG_WARNING, "Unable to open %s for preendpointer recording for %s -- %d: %s\n", ast_str_buffer(path), pvt->session_id, errno, strerror(errno));
+	}
+
+	return (record_file == NULL ? -1 : 0);
+}
+
+static int open_postendpointed_recording_file(struct gdf_pvt *pvt)
+{
+	struct ast_str *path = build_log_related_filename_to_thread_local_str(pvt, 1, "post", "ul");
+	FILE *record_file;
 
 	ast_mutex_lock(&pvt->lock);
 	pvt->utterance_postendpointer_recording_open_already_attempted = 1;
@@ -427,20 +1377,14 @@ static int open_postendpointed_recording_file(struct gdf_pvt *pvt)
 
 static void maybe_record_audio(struct gdf_pvt *pvt, const char *mulaw, size_t mulaw_len, enum VAD_STATE current_vad_state)
 {
-	struct gdf_config *config = gdf_get_config();
-	int enable_preendpointer_recordings = 0;
-	int enable_postendpointer_recordings = 0;
+	/* fixed for the turn by gdf_start, so a reload mid-utterance does not start a recording halfway */
+	int enable_preendpointer_recordings = pvt->turn_record_pre;
+	int enable_postendpointer_recordings = pvt->turn_record_post;
 	int currently_recording_preendpointed_audio = 0;
 	int currently_recording_postendpointed_audio = 0;
 	int already_attempted_open_for_preendpointed_audio = 0;
 	int already_attempted_open_for_postendpointed_audio = 0;
 
-	if (config) {
-		enable_preendpointer_recordings = config->enable_preendpointer_recordings;
-		enable_postendpointer_recordings = config->enable_postendpointer_recordings;		
-		ao2_t_ref(config, -1, "done with config checking for recording");
-	}
-
 	if (enable_postendpointer_recordings || enable_preendpointer_recordings) {
 		int have_call_log_path;
 		ast_mutex_lock(&pvt->lock);
@@ -511,927 +1455,6323 @@ static int gdf_stop_recognition(struct ast_speech *speech, struct gdf_pvt *pvt)
 {
 	close_preendpointed_audio_recording(pvt);
 	close_postendpointed_audio_recording(pvt);
+	/* a pre-opened stream nothing was written to is kept for the next turn, but not its slot */
+	gdf_release_admission(pvt);
+	pvt->stream_pending = 0;
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->stream_preopening) {
+		pvt->preopen_turn_over = 1;
+	} else if (!pvt->stream_preopened) {
+		pvt->recognition_active = 0;
+	}
+	ast_mutex_unlock(&pvt->lock);
 	ast_speech_change_state(speech, AST_SPEECH_STATE_DONE);
 	write_end_of_recognition_call_event(pvt);
 	return 0;
 }
 
-/* speech structure is locked */
-static int gdf_write(struct ast_speech *speech, void *data, int len)
+static int parse_barge_in_policy(const char *value, enum gdf_barge_in_policy *policy)
 {
-	struct gdf_pvt *pvt = speech->data;
-	enum dialogflow_session_state state;
-	enum VAD_STATE vad_state;
-	enum VAD_STATE orig_vad_state;
-	int threshold;
-	int cur_duration;
-	int change_duration;
-	int avg_level;
-	int voice_duration;
-	int silence_duration;
-	int datams;
-	int datasamples;
+	if (!strcasecmp(value, "response")) {
+		*policy = BARGE_IN_ON_RESPONSE;
+	} else if (!strcasecmp(value, "speech")) {
+		*policy = BARGE_IN_ON_SPEECH;
+	} else {
+		return -1;
+	}
+	return 0;
+}
 
-	ast_mutex_lock(&pvt->lock);
-	orig_vad_state = vad_state = pvt->vad_state;
-	threshold = pvt->voice_threshold;
-	cur_duration = pvt->vad_state_duration;
-	change_duration = pvt->vad_change_duration;
-	voice_duration = pvt->voice_minimum_duration;
-	silence_duration = pvt->silence_minimum_duration;
-	ast_mutex_unlock(&pvt->lock);
+static const char *barge_in_policy_to_string(enum gdf_barge_in_policy policy)
+{
+	return policy == BARGE_IN_ON_SPEECH ? "speech" : "response";
+}
 
-	datasamples = len / sizeof(short); /* 2 bytes per sample for slin */
-	datams = datasamples / 8; /* 8 samples per millisecond */
+static int should_barge_in(struct gdf_pvt *pvt, enum gdf_barge_in_policy policy, int minimum_duration,
+	enum VAD_STATE vad_state, int vad_state_duration)
+{
+	if (policy == BARGE_IN_ON_SPEECH) {
+		return vad_state == VAD_STATE_SPEAK && vad_state_duration >= minimum_duration;
+	}
+	return df_get_response_count(pvt->session) > 0;
+}
 
-	cur_duration += datams;
+static void add_local_result(struct gdf_pvt *pvt, const char *slot, const char *value, int score)
+{
+	struct gdf_local_result *result = ast_calloc(1, sizeof(*result) + strlen(slot) + 1);
 
-	avg_level = calculate_audio_level((short *)data, len);
-	if (avg_level >= threshold) {
-		if (vad_state != VAD_STATE_SPEAK) {
-			change_duration += datams;
-		} else {
-			change_duration = 0;
-		}
-	} else {
-		if (vad_state != VAD_STATE_SPEAK) {
-			change_duration = 0;
-		} else {
-			change_duration += datams;
-		}
+	if (!result) {
+		return;
 	}
+	strcpy(result->slot, slot); /* safe */
+	result->value = ast_strdup(value);
+	result->score = score;
 
-	if (vad_state == VAD_STATE_START) {
-		if (change_duration >= voice_duration) {
-			/* speaking */
-			vad_state = VAD_STATE_SPEAK;
-			change_duration = 0;
-			cur_duration = 0;
-			gdf_log_call_event_only(pvt, CALL_LOG_TYPE_ENDPOINTER, "start_of_speech");
-		}
-	} else if (vad_state == VAD_STATE_SPEAK) {
-		if (change_duration >= silence_duration) {
-			/* stopped speaking */
-			/* noop at this time */
-			vad_state = VAD_STATE_SILENT;
-			change_duration = 0;
-			cur_duration = 0;
-			gdf_log_call_event_only(pvt, CALL_LOG_TYPE_ENDPOINTER, "end_of_speech");
-		}
+	ast_mutex_lock(&pvt->lock);
+	AST_LIST_INSERT_TAIL(&pvt->local_results, result, list);
+	ast_mutex_unlock(&pvt->lock);
+}
+
+static void clear_local_results(struct gdf_pvt *pvt)
+{
+	struct gdf_local_result *result;
+
+	ast_mutex_lock(&pvt->lock);
+	while ((result = AST_LIST_REMOVE_HEAD(&pvt->local_results, list))) {
+		ast_free(result->value);
+		ast_free(result);
 	}
+	ast_mutex_unlock(&pvt->lock);
+}
 
+/*! \brief end the turn without waiting for DialogFlow, reporting a result the engine produced itself */
+static void finish_turn_locally(struct ast_speech *speech, struct gdf_pvt *pvt, const char *slot, const char *value)
+{
+	add_local_result(pvt, slot, value, 100);
 	ast_mutex_lock(&pvt->lock);
-	pvt->vad_state = vad_state;
-	pvt->vad_state_duration = cur_duration;
-	pvt->vad_change_duration = change_duration;
+	pvt->turn_finished_locally = 1;
 	ast_mutex_unlock(&pvt->lock);
+	/* a pre-opened stream is left open for the next turn */
+	stop_stream_async(pvt);
+	gdf_stop_recognition(speech, pvt);
+}
 
-#ifdef RES_SPEECH_GDFE_DEBUG_VAD
-	ast_log(LOG_DEBUG, "avg: %d thr: %d dur: %d chg: %d vce: %d sil: %d old: %d new: %d\n",
-		avg_level, threshold, cur_duration, change_duration, voice_duration, silence_duration, 
-		orig_vad_state, vad_state);
-#endif
+static void publish_interim_transcript(struct gdf_pvt *pvt, const char *transcript, int score)
+{
+	struct ast_channel *chan;
+	char *channel_name;
+	char score_str[12];
+	struct dialogflow_log_data log_data[] = {
+		{ "transcript", transcript },
+		{ "score", score_str }
+	};
 
-	if (vad_state == VAD_STATE_SPEAK && orig_vad_state == VAD_STATE_START) {
-		if (df_start_recognition(pvt->session, pvt->language, 0)) {
-			ast_log(LOG_WARNING, "Error starting recognition on %s\n", pvt->session_id);
-			gdf_stop_recognition(speech, pvt);
-		}
+	sprintf(score_str, "%d", score);
+
+	ast_mutex_lock(&pvt->lock);
+	channel_name = ast_strdupa(S_OR(pvt->channel_name, pvt->session_id));
+	ast_mutex_unlock(&pvt->lock);
+
+	chan = ast_channel_get_by_name(channel_name);
+	if (chan) {
+		pbx_builtin_setvar_helper(chan, GDF_VAR_INTERIM_TRANSCRIPT, transcript);
+		pbx_builtin_setvar_helper(chan, GDF_VAR_INTERIM_SCORE, score_str);
+		ast_channel_unref(chan);
 	}
 
-	if (vad_state != VAD_STATE_START) {
-		int mulaw_len = datasamples * sizeof(char);
-		char *mulaw = alloca(mulaw_len);
-		int i;
+	manager_event(EVENT_FLAG_CALL, "DialogflowInterimTranscript",
+		"Channel: %s\r\n"
+		"SessionId: %s\r\n"
+		"Transcript: %s\r\n"
+		"Score: %s\r\n",
+		chan ? channel_name : "", pvt->session_id, transcript, score_str);
 
-		for (i = 0; i < datasamples; i++) {
-			mulaw[i] = AST_LIN2MU(((short *)data)[i]);
-		}
+	gdf_log_call_event(pvt, CALL_LOG_TYPE_DIALOGFLOW, "interim_transcript", ARRAY_LEN(log_data), log_data);
+}
 
-		maybe_record_audio(pvt, mulaw, mulaw_len, vad_state);
+/*! \brief publish the transcript of any new streaming response, returning it if it should end the turn
+ *
+ * libdfegrpc has no separate interim transcript call, so this looks for the query_text result each time
+ * df_get_response_count() goes up. Only called from gdf_write while the stream is open.
+ */
+static char *process_interim_transcript(struct gdf_pvt *pvt)
+{
+	struct gdf_config *config;
+	struct dialogflow_result *transcript = NULL;
+	int responses = df_get_response_count(pvt->session);
+	int count;
+	int match = 0;
+	int i;
 
-		state = df_write_audio(pvt->session, mulaw, mulaw_len);
+	if (responses <= pvt->interim_response_count) {
+		return NULL;
+	}
+	pvt->interim_response_count = responses;
 
-		if (!ast_test_flag(speech, AST_SPEECH_SPOKE) && df_get_response_count(pvt->session) > 0) {
-			ast_set_flag(speech, AST_SPEECH_QUIET);
-			ast_set_flag(speech, AST_SPEECH_SPOKE);
+	count = df_get_result_count(pvt->session);
+	for (i = 0; i < count; i++) {
+		struct dialogflow_result *df_result = df_get_result(pvt->session, i); /* this is a borrowed reference */
+		if (df_result && !strcasecmp(df_result->slot, "query_text")) {
+			transcript = df_result;
+			break;
 		}
+	}
+	if (!transcript || ast_strlen_zero(transcript->value)) {
+		return NULL;
+	}
 
-		if (state == DF_STATE_FINISHED || state == DF_STATE_ERROR) {
-			df_stop_recognition(pvt->session);
-			gdf_stop_recognition(speech, pvt);
-		}
-	} else if (are_currently_recording_pre_endpointed_audio(pvt)) {
-		int mulaw_len = datasamples * sizeof(char);
-		char *mulaw = alloca(mulaw_len);
-		int i;
+	ast_mutex_lock(&pvt->lock);
+	if (!strcmp(transcript->value, pvt->last_interim_transcript)) {
+		ast_mutex_unlock(&pvt->lock);
+		return NULL;
+	}
+	ast_string_field_set(pvt, last_interim_transcript, transcript->value);
+	ast_mutex_unlock(&pvt->lock);
 
-		for (i = 0; i < datasamples; i++) {
-			mulaw[i] = AST_LIN2MU(((short *)data)[i]);
-		}
+	publish_interim_transcript(pvt, transcript->value, transcript->score);
 
-		maybe_record_audio(pvt, mulaw, mulaw_len, vad_state);
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent = get_logical_agent_by_name(config, pvt->logical_agent_name);
+		if (agent) {
+			match = agent->interim_match_compiled && transcript->score >= agent->interim_match_score &&
+				!regexec(&agent->interim_match_regex, transcript->value, 0, NULL, 0);
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
 	}
 
-	return 0;
+	return match ? ast_strdup(transcript->value) : NULL;
 }
 
-static int gdf_dtmf(struct ast_speech *speech, const char *dtmf)
+static void finish_turn_on_timer(struct ast_speech *speech, struct gdf_pvt *pvt, const char *slot, int timeout)
 {
-	return -1;
+	char timeout_str[11];
+	struct dialogflow_log_data log_data[] = {
+		{ "timeout_ms", timeout_str }
+	};
+
+	sprintf(timeout_str, "%d", timeout);
+	gdf_log_call_event(pvt, CALL_LOG_TYPE_ENDPOINTER, slot, ARRAY_LEN(log_data), log_data);
+	finish_turn_locally(speech, pvt, slot, timeout_str);
 }
 
-static int should_start_call_log(struct gdf_pvt *pvt)
+/* only called from gdf_write, so the replay fields need no locking */
+static void append_replay_audio(struct gdf_pvt *pvt, const char *audio, size_t audio_len)
 {
-	int should_start;
-	ast_mutex_lock(&pvt->lock);
-	should_start = !pvt->call_log_open_already_attempted;
-	ast_mutex_unlock(&pvt->lock);
-	if (should_start) {
-		struct gdf_config *cfg;
-		cfg = gdf_get_config();
-		if (cfg) {
-			should_start &= cfg->enable_call_logs;
-			ao2_t_ref(cfg, -1, "done checking for starting call log");
+	size_t limit = pvt->replay_buffer_ms * MULAW_BYTES_PER_MS;
+
+	if (pvt->replay_max_attempts <= 0 || pvt->replay_buffer_overflowed) {
+		return;
+	}
+
+	if (limit != pvt->replay_buffer_limit && !pvt->replay_buffer_len) {
+		/* the stream's encoding is not the one the buffer was sized for */
+		ast_free(pvt->replay_buffer);
+		pvt->replay_buffer = NULL;
+		pvt->replay_buffer_limit = limit;
+	}
+
+	if (pvt->replay_buffer_len + audio_len > pvt->replay_buffer_limit) {
+		/* the start of the utterance would be lost, so a replay could no longer be faithful */
+		pvt->replay_buffer_overflowed = 1;
+		return;
+	}
+
+	if (!pvt->replay_buffer) {
+		pvt->replay_buffer = ast_malloc(pvt->replay_buffer_limit);
+		if (!pvt->replay_buffer) {
+			pvt->replay_buffer_overflowed = 1;
+			return;
 		}
 	}
-	return should_start;
+
+	memcpy(pvt->replay_buffer + pvt->replay_buffer_len, audio, audio_len);
+	pvt->replay_buffer_len += audio_len;
 }
 
-AST_THREADSTORAGE(call_log_path);
-static void calculate_log_path(struct gdf_pvt *pvt)
-{
-	struct varshead var_head = { .first = NULL, .last = NULL };
-	struct ast_var_t *var;
-	struct gdf_config *cfg;
+#define REPLAY_CHUNK_MS	100
 
-	ast_mutex_lock(&pvt->lock);
-	var = ast_var_assign("APPLICATION", pvt->call_logging_application_name);
-	ast_mutex_unlock(&pvt->lock);
+static void note_audio_sent(struct gdf_pvt *pvt)
+{
+	if (!pvt->first_audio_us) {
+		pvt->first_audio_us = monotonic_us();
+		record_latency(pvt, LATENCY_FIRST_AUDIO, pvt->speech_start_us);
+	}
+}
 
-	AST_LIST_INSERT_HEAD(&var_head, var, entries);
+/*! \brief send mu-law on the open stream, counting what was sent */
+static enum dialogflow_session_state send_uplink_audio(struct gdf_pvt *pvt, const char *audio, size_t audio_len)
+{
+	enum dialogflow_session_state state;
 
-	cfg = gdf_get_config();
-	if (cfg) {
-		struct ast_str *path = ast_str_thread_get(&call_log_path, 256);
+	state = df_write_audio(pvt->session, audio, audio_len);
+	pvt->turn_uplink_bytes += audio_len;
+	pvt->turn_uplink_messages++;
+	note_audio_sent(pvt);
+	return state;
+}
 
-		ast_str_substitute_variables_varshead(&path, 0, &var_head, cfg->call_log_location);
+/*!
+ * \brief add a frame to the chunk being built, sending it once it is full or when flush is set
+ *
+ * Until the chunk is sent the stream is reported as still started.
+ */
+static enum dialogflow_session_state queue_uplink_audio(struct gdf_pvt *pvt, const char *audio, size_t audio_len, int flush)
+{
+	enum dialogflow_session_state state;
 
-		ast_mutex_lock(&pvt->lock);
-		ast_string_field_set(pvt, call_log_path, ast_str_buffer(path));
-		ast_mutex_unlock(&pvt->lock);
+	if (pvt->chunk_buffer_size <= audio_len && !pvt->chunk_len) {
+		/* chunks no larger than a frame, nothing to coalesce */
+		return send_uplink_audio(pvt, audio, audio_len);
+	}
 
-		ao2_t_ref(cfg, -1, "done with config in calculating call log path");
+	if (pvt->chunk_len + audio_len > pvt->chunk_buffer_size) {
+		/* no room for this frame, send what we have first */
+		state = send_uplink_audio(pvt, pvt->chunk_buffer, pvt->chunk_len);
+		pvt->chunk_len = 0;
+		if (state == DF_STATE_ERROR || state == DF_STATE_FINISHED) {
+			return state;
+		}
+		if (audio_len > pvt->chunk_buffer_size) {
+			return send_uplink_audio(pvt, audio, audio_len);
+		}
 	}
-	
-	ast_var_delete(var);
-}
 
-static void calculate_log_file_basename(struct gdf_pvt *pvt)
-{
-	struct timeval t;
-	struct ast_tm now;
-	
-	t = ast_tvnow();
-	ast_localtime(&t, &now, NULL);
-	ast_string_field_build(pvt, call_log_file_basename, "%02d%02d_%s", now.tm_min, now.tm_sec, pvt->session_id);
+	memcpy(pvt->chunk_buffer + pvt->chunk_len, audio, audio_len);
+	pvt->chunk_len += audio_len;
+
+	if (!flush && pvt->chunk_len < pvt->chunk_buffer_size) {
+		return DF_STATE_STARTED;
+	}
+
+	state = send_uplink_audio(pvt, pvt->chunk_buffer, pvt->chunk_len);
+	pvt->chunk_len = 0;
+	return state;
 }
 
-static void mkdir_log_path(struct gdf_pvt *pvt)
+/* only called from gdf_write, so the held audio needs no locking */
+static void hold_audio(struct gdf_pvt *pvt, const char *audio, size_t audio_len)
 {
-	ast_mkdir(pvt->call_log_path, 0644);
+	if (pvt->held_audio_len + audio_len > pvt->held_audio_size) {
+		size_t size = MAX(pvt->held_audio_size * 2, pvt->held_audio_len + audio_len);
+		char *held = ast_realloc(pvt->held_audio, size);
+		if (!held) {
+			/* the stream will be missing the start of the utterance */
+			return;
+		}
+		pvt->held_audio = held;
+		pvt->held_audio_size = size;
+	}
+	memcpy(pvt->held_audio + pvt->held_audio_len, audio, audio_len);
+	pvt->held_audio_len += audio_len;
 }
 
-static struct ast_str *build_log_related_filename_to_thread_local_str(struct gdf_pvt *pvt, int include_utterance_counter, const char *type, const char *extension)
+/* the stream has just opened, so what was held goes out as fast as it will take it */
+static enum dialogflow_session_state send_held_audio(struct gdf_pvt *pvt)
 {
-	struct ast_str *path;
-	path = ast_str_thread_get(&call_log_path, 256);
-	ast_mutex_lock(&pvt->lock);
-	ast_str_set(&path, 0, pvt->call_log_path);
-	ast_str_append(&path, 0, pvt->call_log_file_basename);
-	ast_str_append(&path, 0, "_%s", type);
-	if (include_utterance_counter) {
-		ast_str_append(&path, 0, "_%d", pvt->utterance_counter);
+	enum dialogflow_session_state state = DF_STATE_STARTED;
+	size_t chunk = REPLAY_CHUNK_MS * MULAW_BYTES_PER_MS;
+	size_t offset;
+
+	for (offset = 0; offset < pvt->held_audio_len; offset += chunk) {
+		state = send_uplink_audio(pvt, pvt->held_audio + offset, MIN(chunk, pvt->held_audio_len - offset));
+		if (state == DF_STATE_ERROR || state == DF_STATE_FINISHED) {
+			break;
+		}
 	}
-	ast_str_append(&path, 0, ".%s" , extension);
-	ast_mutex_unlock(&pvt->lock);
-	return path;
+	pvt->held_audio_len = 0;
+
+	return state;
 }
 
-static void start_call_log(struct gdf_pvt *pvt)
+/*!
+ * \brief open the turn's stream once admission allows, without blocking the media thread
+ *
+ * Audio is held from the start of speech and sent as fast as the stream will take it once
+ * the stream opens. A stream still being pre-opened is waited for in the same way.
+ *
+ * \retval 0 the stream is open, or still waiting for admission if stream_pending is still set
+ * \retval -1 the stream could not be opened and the turn has been stopped
+ */
+static int open_pending_stream(struct ast_speech *speech, struct gdf_pvt *pvt, enum dialogflow_session_state *state)
 {
-	ast_mutex_lock(&pvt->lock);
-	pvt->call_log_open_already_attempted = 1;
-	ast_mutex_unlock(&pvt->lock);
+	enum gdf_admission_result admission;
+	int64_t open_start;
+
+	*state = DF_STATE_STARTED;
+	switch (claim_preopened_stream(pvt)) {
+	case -1:
+		return 0;
+	case 1:
+		pvt->stream_pending = 0;
+		*state = send_held_audio(pvt);
+		return 0;
+	}
 
-	calculate_log_path(pvt);
-	calculate_log_file_basename(pvt);
+	admission = gdf_try_admit_request(pvt);
+	if (admission == ADMISSION_WAITING) {
+		return 0;
+	}
 
-	if (!ast_strlen_zero(pvt->call_log_path)) {
-		struct ast_str *path;
-		FILE *log_file;
+	pvt->stream_pending = 0;
+	if (admission != ADMISSION_ADMITTED && admission != ADMISSION_QUEUED) {
+		ast_log(LOG_WARNING, "Recognition not admitted (%s) for agent '%s' on %s\n", admission_result_names[admission],
+			pvt->logical_agent_name, pvt->session_id);
+		gdf_stop_recognition(speech, pvt);
+		return -1;
+	}
 
-		mkdir_log_path(pvt);
+	open_start = monotonic_us();
+	if (df_start_recognition(pvt->session, pvt->language, 0)) {
+		ast_log(LOG_WARNING, "Error starting recognition on %s\n", pvt->session_id);
+		record_endpoint_result(pvt, -1, 0);
+		record_session_error(pvt, STAT_ERRORS_STREAM_OPEN);
+		gdf_stop_recognition(speech, pvt);
+		return -1;
+	}
+	record_latency(pvt, LATENCY_STREAM_OPEN, open_start);
+	gdf_pvt_count(pvt, STAT_STREAMS_OPENED, 1);
+	pvt->recognition_active = 1;
 
-		path = build_log_related_filename_to_thread_local_str(pvt, 0, "log", "jsonl");
+	*state = send_held_audio(pvt);
+	return 0;
+}
 
-		log_file = fopen(ast_str_buffer(path), "w");
-		if (log_file) {
-			ast_log(LOG_DEBUG, "Opened %s for call log for %s\n", ast_str_buffer(path), pvt->session_id);
-			ast_mutex_lock(&pvt->lock);
-			pvt->call_log_file_handle = log_file;
-			ast_mutex_unlock(&pvt->lock);
+/*! \brief reopen the stream after a failure and replay the utterance so far as fast as it will go
+ * \return the state after the replay, DF_STATE_ERROR if the stream could not be recovered
+ */
+static enum dialogflow_session_state recover_stream(struct gdf_pvt *pvt)
+{
+	enum dialogflow_session_state state = DF_STATE_ERROR;
+
+	while (pvt->replay_attempts < pvt->replay_max_attempts && !pvt->replay_buffer_overflowed && pvt->replay_buffer_len > 0) {
+		char attempt[11];
+		char buffered_ms[11];
+		char replay_ms[11];
+		struct timeval start;
+		size_t offset;
+		struct dialogflow_log_data start_log_data[] = {
+			{ "attempt", attempt },
+			{ "buffered_ms", buffered_ms }
+		};
+
+		pvt->replay_attempts++;
+		sprintf(attempt, "%d", pvt->replay_attempts);
+		sprintf(buffered_ms, "%d", (int) (pvt->replay_buffer_len / MULAW_BYTES_PER_MS));
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_DIALOGFLOW, "stream_recovery_start", ARRAY_LEN(start_log_data), start_log_data);
+		ast_log(LOG_NOTICE, "Recovering stream on %s, attempt %d, replaying %sms of audio\n", pvt->session_id,
+			pvt->replay_attempts, buffered_ms);
+
+		start = ast_tvnow();
+		df_stop_recognition(pvt->session);
+		route_session_endpoint(pvt, 1);
+
+		pvt->chunk_len = 0;
+		if (df_start_recognition(pvt->session, pvt->language, 0)) {
+			record_endpoint_result(pvt, -1, 0);
+			record_session_error(pvt, STAT_ERRORS_STREAM_OPEN);
+			state = DF_STATE_ERROR;
 		} else {
-			ast_log(LOG_WARNING, "Unable to open %s for writing call log for %s -- %d: %s\n", ast_str_buffer(path), pvt->session_id, errno, strerror(errno));
+			size_t chunk = REPLAY_CHUNK_MS * MULAW_BYTES_PER_MS;
+			for (offset = 0; offset < pvt->replay_buffer_len; offset += chunk) {
+				state = send_uplink_audio(pvt, pvt->replay_buffer + offset,
+					MIN(chunk, pvt->replay_buffer_len - offset));
+				if (state == DF_STATE_ERROR || state == DF_STATE_FINISHED) {
+					break;
+				}
+			}
 		}
-	} else {
-		ast_log(LOG_WARNING, "Not starting call log, path is empty\n");
-	}
-}
 
-static void log_endpointer_start_event(struct gdf_pvt *pvt)
-{
-	int pvt_threshold;
-	char threshold[11];
-	int pvt_voice_duration;
-	char voice_duration[11];
-	int pvt_silence_duration;
-	char silence_duration[11];
-	struct dialogflow_log_data log_data[] = {
-		{ VAD_PROP_VOICE_THRESHOLD, threshold },
-		{ VAD_PROP_VOICE_DURATION, voice_duration },
-		{ VAD_PROP_SILENCE_DURATION, silence_duration },
-	};
+		sprintf(replay_ms, "%d", (int) ast_tvdiff_ms(ast_tvnow(), start));
+		{
+			struct dialogflow_log_data end_log_data[] = {
+				{ "attempt", attempt },
+				{ "replay_ms", replay_ms },
+				{ "result", state == DF_STATE_ERROR ? "error" : "recovered" }
+			};
+			gdf_log_call_event(pvt, CALL_LOG_TYPE_DIALOGFLOW, "stream_recovery_end", ARRAY_LEN(end_log_data), end_log_data);
+		}
+		if (state != DF_STATE_ERROR) {
+			gdf_pvt_count(pvt, STAT_STREAMS_RECOVERED, 1);
+		}
 
-	ast_mutex_lock(&pvt->lock);
-	pvt_threshold = pvt->voice_threshold;
-	pvt_voice_duration = pvt->voice_minimum_duration;
-	pvt_silence_duration = pvt->silence_minimum_duration;
-	ast_mutex_unlock(&pvt->lock);
+		if (state != DF_STATE_ERROR) {
+			break;
+		}
+	}
 
-	sprintf(threshold, "%d", pvt_threshold);
-	sprintf(voice_duration, "%d", pvt_voice_duration);
-	sprintf(silence_duration, "%d", pvt_silence_duration);
+	/* anything waiting in the chunk was part of the replay */
+	pvt->chunk_len = 0;
 
-	gdf_log_call_event(pvt, CALL_LOG_TYPE_ENDPOINTER, "start", ARRAY_LEN(log_data), log_data);
+	return state;
 }
 
-static int gdf_start(struct ast_speech *speech)
+/* speech structure is locked */
+static int gdf_write(struct ast_speech *speech, void *data, int len)
 {
 	struct gdf_pvt *pvt = speech->data;
-	char *event = NULL;
-	char *language = NULL;
-	char *project_id = NULL;
+	enum dialogflow_session_state state;
+	enum VAD_STATE vad_state;
+	enum VAD_STATE orig_vad_state;
+	int threshold;
+	int cur_duration;
+	int change_duration;
+	int avg_level;
+	int voice_duration;
+	int silence_duration;
+	int datams;
+	int datasamples;
+	enum gdf_barge_in_policy barge_in_policy;
+	int barge_in_minimum_duration;
+	int no_input_timeout;
+	int max_speech_duration;
+	int speech_duration;
 
 	ast_mutex_lock(&pvt->lock);
-	event = ast_strdupa(pvt->event);
-	language = ast_strdupa(pvt->language);
-	project_id = ast_strdupa(pvt->project_id);
-	ast_string_field_set(pvt, event, "");
-	pvt->vad_state = VAD_STATE_START;
-	pvt->vad_state_duration = 0;
-	pvt->vad_change_duration = 0;
-	pvt->utterance_counter++;
+	if (pvt->async_query_active) {
+		/* waiting on an event request, not listening */
+		ast_mutex_unlock(&pvt->lock);
+		return 0;
+	}
 	ast_mutex_unlock(&pvt->lock);
 
-	if (should_start_call_log(pvt)) {
-		start_call_log(pvt);
+	if (dtmf_turn_ready(pvt)) {
+		complete_dtmf_turn(speech, pvt);
+		return 0;
 	}
 
-	{
-		char utterance_number[11];
-		struct dialogflow_log_data log_data[] = {
-			{ "event", event },
-			{ "language", language },
-			{ "project_id", project_id },
-			{ "logical_agent_name", pvt->logical_agent_name },
-			{ "utterance", utterance_number },
-			{ "context", pvt->call_logging_context },
-			{ "application", pvt->call_logging_application_name }
-		};
-		sprintf(utterance_number, "%d", pvt->utterance_counter);
-		gdf_log_call_event(pvt, CALL_LOG_TYPE_SESSION, "start", ARRAY_LEN(log_data), log_data);
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->dtmf_digit_count) {
+		/* collecting digits, the caller is not expected to speak */
+		ast_mutex_unlock(&pvt->lock);
+		return 0;
 	}
-	log_endpointer_start_event(pvt);
-	
-	if (!ast_strlen_zero(event)) {
-		if (df_recognize_event(pvt->session, event, language, 0)) {
-			ast_log(LOG_WARNING, "Error recognizing event on %s\n", pvt->session_id);
-			ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+	no_input_timeout = pvt->turn_no_input_timeout;
+	max_speech_duration = pvt->turn_max_speech_duration;
+	speech_duration = pvt->speech_duration;
+	barge_in_policy = pvt->barge_in_policy;
+	barge_in_minimum_duration = pvt->barge_in_minimum_duration;
+	orig_vad_state = vad_state = pvt->vad_state;
+	threshold = pvt->voice_threshold;
+	cur_duration = pvt->vad_state_duration;
+	change_duration = pvt->vad_change_duration;
+	voice_duration = pvt->voice_minimum_duration;
+	silence_duration = pvt->silence_minimum_duration;
+	ast_mutex_unlock(&pvt->lock);
+
+	datasamples = len / sizeof(short); /* 2 bytes per sample for slin */
+	datams = datasamples / (pvt->sample_rate / 1000);
+
+	cur_duration += datams;
+
+	avg_level = calculate_audio_level((short *)data, datasamples);
+	if (avg_level >= threshold) {
+		if (vad_state != VAD_STATE_SPEAK) {
+			change_duration += datams;
 		} else {
-			gdf_stop_recognition(speech, pvt);
+			change_duration = 0;
 		}
 	} else {
-		ast_speech_change_state(speech, AST_SPEECH_STATE_READY);
+		if (vad_state != VAD_STATE_SPEAK) {
+			change_duration = 0;
+		} else {
+			change_duration += datams;
+		}
 	}
 
-	return 0;
-}
+	if (vad_state == VAD_STATE_START) {
+		if (change_duration >= voice_duration) {
+			/* speaking */
+			vad_state = VAD_STATE_SPEAK;
+			change_duration = 0;
+			cur_duration = 0;
+			gdf_log_call_event_only(pvt, CALL_LOG_TYPE_ENDPOINTER, "start_of_speech");
+			gdf_pvt_count(pvt, STAT_VAD_START_OF_SPEECH, 1);
+			pvt->speech_start_us = monotonic_us();
+			record_latency(pvt, LATENCY_SPEECH_START, pvt->turn_start_us);
+		}
+	} else if (vad_state == VAD_STATE_SPEAK) {
+		if (change_duration >= silence_duration) {
+			/* stopped speaking */
+			/* noop at this time */
+			vad_state = VAD_STATE_SILENT;
+			change_duration = 0;
+			cur_duration = 0;
+			gdf_log_call_event_only(pvt, CALL_LOG_TYPE_ENDPOINTER, "end_of_speech");
+			gdf_pvt_count(pvt, STAT_VAD_END_OF_SPEECH, 1);
+		}
+	}
 
-static int gdf_change(struct ast_speech *speech, const char *name, const char *value)
-{
-	struct gdf_pvt *pvt = speech->data;
+	if (vad_state != VAD_STATE_START) {
+		speech_duration += datams;
+	}
 
-	if (!strcasecmp(name, GDF_PROP_SESSION_ID_NAME) || !strcasecmp(name, GDF_PROP_ALTERNATE_SESSION_NAME)) {
-		if (ast_strlen_zero(value)) {
-			ast_log(LOG_WARNING, "Session ID must have a value, refusing to set to nothing (remains %s)\n", df_get_session_id(pvt->session));
-			return -1;
-		}
-		df_set_session_id(pvt->session, value);
-		ast_mutex_lock(&pvt->lock);
-		ast_string_field_set(pvt, session_id, value);
-		ast_mutex_unlock(&pvt->lock);
-	} else if (!strcasecmp(name, GDF_PROP_PROJECT_ID_NAME)) {
-		if (ast_strlen_zero(value)) {
-			ast_log(LOG_WARNING, "Project ID must have a value, refusing to set to nothing (remains %s)\n", df_get_project_id(pvt->session));
-			return -1;
+	ast_mutex_lock(&pvt->lock);
+	pvt->vad_state = vad_state;
+	pvt->vad_state_duration = cur_duration;
+	pvt->vad_change_duration = change_duration;
+	pvt->speech_duration = speech_duration;
+	ast_mutex_unlock(&pvt->lock);
+
+#ifdef RES_SPEECH_GDFE_DEBUG_VAD
+	ast_log(LOG_DEBUG, "avg: %d thr: %d dur: %d chg: %d vce: %d sil: %d old: %d new: %d\n",
+		avg_level, threshold, cur_duration, change_duration, voice_duration, silence_duration, 
+		orig_vad_state, vad_state);
+#endif
+
+	if (vad_state == VAD_STATE_START && no_input_timeout > 0 && cur_duration >= no_input_timeout) {
+		/* the caller never spoke, so there is nothing to ask DialogFlow */
+		finish_turn_on_timer(speech, pvt, "no_input", no_input_timeout);
+		return 0;
+	}
+
+	if (vad_state == VAD_STATE_SPEAK && orig_vad_state == VAD_STATE_START) {
+		int claimed = claim_preopened_stream(pvt);
+		if (claimed <= 0) {
+			/* the stream is opened below once admission allows, or taken over once the pre-open finishes */
+			if (!claimed) {
+				start_uplink(pvt);
+			}
+			pvt->stream_pending = 1;
+			pvt->held_audio_len = 0;
 		}
-		ast_mutex_lock(&pvt->lock);
-		ast_string_field_set(pvt, project_id, value);
-		ast_mutex_unlock(&pvt->lock);
-		df_set_project_id(pvt->session, value);
-	} else if (!strcasecmp(name, GDF_PROP_LANGUAGE_NAME)) {
-		ast_mutex_lock(&pvt->lock);
-		ast_string_field_set(pvt, language, value);
-		ast_mutex_unlock(&pvt->lock);
-	} else if (!strcasecmp(name, GDF_PROP_LOG_CONTEXT) || !strcasecmp(name, GDF_PROP_ALTERNATE_LOG_CONTEXT)) {
-		ast_mutex_lock(&pvt->lock);
-		ast_string_field_set(pvt, call_logging_context, value);
-		ast_mutex_unlock(&pvt->lock);
-	} else if (!strcasecmp(name, GDF_PROP_APPLICATION_CONTEXT)) {
-		ast_mutex_lock(&pvt->lock);
-		ast_string_field_set(pvt, call_logging_application_name, value);
-		ast_mutex_unlock(&pvt->lock);
-	} else if (!strcasecmp(name, VAD_PROP_VOICE_THRESHOLD)) {
-		int i;
-		if (ast_strlen_zero(value)) {
-			ast_log(LOG_WARNING, "Cannot set " VAD_PROP_VOICE_THRESHOLD " to an empty value\n");
-			return -1;
-		} else if (sscanf(value, "%d", &i) == 1) {
-			ast_mutex_lock(&pvt->lock);
-			pvt->voice_threshold = i;
-			ast_mutex_unlock(&pvt->lock);
-		} else {
-			ast_log(LOG_WARNING, "Invalid value for " VAD_PROP_VOICE_THRESHOLD " -- '%s'\n", value);
-			return -1;
+	}
+
+	if (vad_state != VAD_STATE_START && max_speech_duration > 0 && speech_duration > max_speech_duration) {
+		finish_turn_on_timer(speech, pvt, "max_speech", max_speech_duration);
+		return 0;
+	}
+
+	if (vad_state != VAD_STATE_START) {
+		int mulaw_len = narrow_to_mulaw(pvt, data, datasamples);
+
+		if (!mulaw_len) {
+			/* no room for the frame, the stream will be missing it */
+			return 0;
 		}
-	} else if (!strcasecmp(name, VAD_PROP_VOICE_DURATION)) {
-		int i;
-		if (ast_strlen_zero(value)) {
-			ast_log(LOG_WARNING, "Cannot set " VAD_PROP_VOICE_DURATION " to an empty value\n");
-			return -1;
-		} else if (sscanf(value, "%d", &i) == 1) {
-			ast_mutex_lock(&pvt->lock);
-			pvt->voice_minimum_duration = i;
-			ast_mutex_unlock(&pvt->lock);
+		maybe_record_audio(pvt, pvt->mulaw_buffer, mulaw_len, vad_state);
+		append_replay_audio(pvt, pvt->mulaw_buffer, mulaw_len);
+
+		if (pvt->stream_pending) {
+			/* admission is retried on every frame rather than waited for here */
+			hold_audio(pvt, pvt->mulaw_buffer, mulaw_len);
+			if (open_pending_stream(speech, pvt, &state)) {
+				return 0;
+			}
 		} else {
-			ast_log(LOG_WARNING, "Invalid value for " VAD_PROP_VOICE_DURATION " -- '%s'\n", value);
-			return -1;
+			/* VAD transitions are where latency matters, so the chunk goes straight out */
+			state = queue_uplink_audio(pvt, pvt->mulaw_buffer, mulaw_len, vad_state != orig_vad_state);
 		}
-	} else if (!strcasecmp(name, VAD_PROP_SILENCE_DURATION)) {
-		int i;
-		if (ast_strlen_zero(value)) {
-			ast_log(LOG_WARNING, "Cannot set " VAD_PROP_SILENCE_DURATION " to an empty value\n");
-			return -1;
-		} else if (sscanf(value, "%d", &i) == 1) {
-			ast_mutex_lock(&pvt->lock);
-			pvt->silence_minimum_duration = i;
-			ast_mutex_unlock(&pvt->lock);
-		} else {
-			ast_log(LOG_WARNING, "Invalid value for " VAD_PROP_SILENCE_DURATION " -- '%s'\n", value);
-			return -1;
+
+		if (state == DF_STATE_ERROR) {
+			record_endpoint_result(pvt, -1, 0);
+			record_session_error(pvt, STAT_ERRORS_STREAM);
+			state = recover_stream(pvt);
 		}
-	} else {
-		ast_log(LOG_WARNING, "Unknown property '%s'\n", name);
-		return -1;
+
+		if (!ast_test_flag(speech, AST_SPEECH_SPOKE) &&
+			should_barge_in(pvt, barge_in_policy, barge_in_minimum_duration, vad_state, cur_duration)) {
+			struct dialogflow_log_data log_data[] = {
+				{ "policy", barge_in_policy_to_string(barge_in_policy) }
+			};
+			ast_set_flag(speech, AST_SPEECH_QUIET);
+			ast_set_flag(speech, AST_SPEECH_SPOKE);
+			gdf_log_call_event(pvt, CALL_LOG_TYPE_ENDPOINTER, "barge_in", ARRAY_LEN(log_data), log_data);
+			gdf_pvt_count(pvt, STAT_VAD_BARGE_IN, 1);
+		}
+
+		if (state == DF_STATE_STARTED) {
+			char *matched = process_interim_transcript(pvt);
+			if (matched) {
+				ast_log(LOG_DEBUG, "Interim transcript '%s' matched on %s, ending turn early\n", matched, pvt->session_id);
+				finish_turn_locally(speech, pvt, "interim_match", matched);
+				ast_free(matched);
+				return 0;
+			}
+		}
+
+		if (state == DF_STATE_FINISHED || state == DF_STATE_ERROR) {
+			if (state == DF_STATE_FINISHED) {
+				record_endpoint_result(pvt, -1, 1);
+			}
+			df_stop_recognition(pvt->session);
+			gdf_stop_recognition(speech, pvt);
+		}
+	} else if (pvt->turn_record_pre && are_currently_recording_pre_endpointed_audio(pvt)) {
+		int mulaw_len = narrow_to_mulaw(pvt, data, datasamples);
+
+		maybe_record_audio(pvt, pvt->mulaw_buffer, mulaw_len, vad_state);
 	}
 
 	return 0;
 }
 
-#ifdef ASTERISK_13_OR_LATER
-static int gdf_get_setting(struct ast_speech *speech, const char *name, char *buf, size_t len)
+static int gdf_dtmf(struct ast_speech *speech, const char *dtmf)
 {
+	/* speech is not locked, and this may be called from a framehook with the channel locked,
+	 * so digits are only collected here -- the turn is completed by the hook or gdf_write */
 	struct gdf_pvt *pvt = speech->data;
+	int collected = 0;
+	int quiet = 0;
 
-	if (!strcasecmp(name, GDF_PROP_SESSION_ID_NAME)) {
-		ast_copy_string(buf, df_get_session_id(pvt->session), len);
-	} else if (!strcasecmp(name, GDF_PROP_PROJECT_ID_NAME)) {
-		ast_copy_string(buf, df_get_project_id(pvt->session), len);
-	} else if (!strcasecmp(name, GDF_PROP_LANGUAGE_NAME)) {
-		ast_mutex_lock(&pvt->lock);
-		ast_copy_string(buf, pvt->language, len);
-		ast_mutex_unlock(&pvt->lock);
-	} else if (!strcasecmp(name, VAD_PROP_VOICE_THRESHOLD)) {
-		ast_mutex_lock(&pvt->lock);
-		ast_build_string(&buf, &len, "%d", pvt->voice_threshold);
-		ast_mutex_unlock(&pvt->lock);
-	} else if (!strcasecmp(name, VAD_PROP_VOICE_DURATION)) {
-		ast_mutex_lock(&pvt->lock);
-		ast_build_string(&buf, &len, "%d", pvt->voice_minimum_duration);
-		ast_mutex_unlock(&pvt->lock);
-	} else if (!strcasecmp(name, VAD_PROP_SILENCE_DURATION)) {
-		ast_mutex_lock(&pvt->lock);
-		ast_build_string(&buf, &len, "%d", pvt->silence_minimum_duration);
-		ast_mutex_unlock(&pvt->lock);
-	} else {
-		ast_log(LOG_WARNING, "Unknown property '%s'\n", name);
-		return -1;
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->dtmf_mode != DTMF_MODE_OFF && !pvt->dtmf_complete && !pvt->async_query_active) {
+		for (; *dtmf && !pvt->dtmf_complete; dtmf++) {
+			if (*dtmf == pvt->dtmf_terminator) {
+				/* a terminator with no digits before it is swallowed rather than ending the turn empty */
+				pvt->dtmf_complete = pvt->dtmf_digit_count > 0;
+			} else {
+				pvt->dtmf_digits[pvt->dtmf_digit_count++] = *dtmf;
+				pvt->dtmf_digits[pvt->dtmf_digit_count] = '\0';
+				if (pvt->dtmf_digit_count == GDF_MAX_DTMF_DIGITS || pvt->dtmf_digit_count == pvt->dtmf_max_digits) {
+					pvt->dtmf_complete = 1;
+				}
+			}
+		}
+		if (pvt->dtmf_digit_count) {
+			pvt->dtmf_last_digit = ast_tvnow();
+			quiet = 1;
+		}
+		collected = 1;
 	}
+	ast_mutex_unlock(&pvt->lock);
 
-	return 0;
+	if (quiet) {
+		ast_set_flag(speech, AST_SPEECH_QUIET);
+	}
+
+	return collected ? 0 : -1;
 }
-#endif
 
-static int gdf_change_results_type(struct ast_speech *speech, enum ast_speech_results_type results_type)
+static int dtmf_turn_ready(struct gdf_pvt *pvt)
 {
-	return 0;
+	int ready;
+
+	ast_mutex_lock(&pvt->lock);
+	ready = pvt->dtmf_complete ||
+		(pvt->dtmf_digit_count && ast_tvdiff_ms(ast_tvnow(), pvt->dtmf_last_digit) >= pvt->dtmf_interdigit_timeout);
+	ast_mutex_unlock(&pvt->lock);
+
+	return ready;
 }
 
-static struct ast_speech_result *gdf_get_results(struct ast_speech *speech)
+/*! \brief the event digits are sent as: the agent's dtmf_event, '_' and the digits, with * and # spelled out */
+static const char *build_dtmf_event(struct ast_str **buf, const char *prefix, const char *digits)
 {
-	/* speech is not locked */
-	struct gdf_pvt *pvt = speech->data;
-	int results = df_get_result_count(pvt->session);
-	int i;
-	struct ast_speech_result *start = NULL;
-	struct ast_speech_result *end = NULL;
-	static int last_resort = 0;
+	ast_str_set(buf, 0, "%s_", prefix);
+	for (; *digits; digits++) {
+		if (*digits == '*') {
+			ast_str_append(buf, 0, "star");
+		} else if (*digits == '#') {
+			ast_str_append(buf, 0, "pound");
+		} else {
+			ast_str_append(buf, 0, "%c", *digits);
+		}
+	}
+	return ast_str_buffer(*buf);
+}
 
-	struct dialogflow_result *fulfillment_text = NULL;
-	struct dialogflow_result *output_audio = NULL;
+AST_THREADSTORAGE(dtmf_event_buf);
+/*!
+ * \brief end the turn with the collected digits, without streaming audio
+ *
+ * In collect mode the digits are the turn's result. In event mode they are also sent to DialogFlow as
+ * a single event request on the event pool, whose results follow the dtmf result. Nothing here waits
+ * on the backend, so it is safe from the framehook.
+ */
+static void complete_dtmf_turn(struct ast_speech *speech, struct gdf_pvt *pvt)
+{
+	char *digits;
+	char *language;
+	const char *event = NULL;
+	enum gdf_dtmf_mode mode;
 
-	const char *audioFile = NULL;
+	ast_mutex_lock(&pvt->lock);
+	digits = ast_strdupa(pvt->dtmf_digits);
+	pvt->dtmf_digits[0] = '\0';
+	pvt->dtmf_digit_count = 0;
+	pvt->dtmf_complete = 0;
+	mode = pvt->dtmf_mode;
+	language = ast_strdupa(pvt->language);
+	if (mode == DTMF_MODE_EVENT) {
+		struct ast_str *buf = ast_str_thread_get(&dtmf_event_buf, 64);
+		event = buf ? ast_strdupa(build_dtmf_event(&buf, pvt->dtmf_event, digits)) : NULL;
+	}
+	ast_mutex_unlock(&pvt->lock);
 
-	for (i = 0; i < results; i++) {
-		struct dialogflow_result *df_result = df_get_result(pvt->session, i); /* this is a borrowed reference */
-		if (df_result) {
-			if (!strcasecmp(df_result->slot, "output_audio")) {
-				/* this is fine for now, but we really need a flag on the structure that says it's binary vs. text */
-				output_audio = df_result;
-			} else {
-				struct ast_speech_result *new = ast_calloc(1, sizeof(*new));
-				if (new) {
-					new->text = ast_strdup(df_result->value);
-					new->score = df_result->score;
-					new->grammar = ast_strdup(df_result->slot);
+	ast_set_flag(speech, AST_SPEECH_QUIET);
+	ast_set_flag(speech, AST_SPEECH_SPOKE);
 
-					if (!strcasecmp(df_result->slot, "fulfillment_text")) {
-						fulfillment_text = df_result;
-					}
-				}
+	{
+		struct dialogflow_log_data log_data[] = {
+			{ "digits", digits },
+			{ "event", S_OR(event, "") }
+		};
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_ENDPOINTER, "dtmf", ARRAY_LEN(log_data), log_data);
+	}
 
-				if (end) {
-					AST_LIST_NEXT(end, list) = new;
-					end = new;
-				} else {
-					start = end = new;
-				}
+	if (!event) {
+		/* a pre-opened stream is left open for the next turn */
+		finish_turn_locally(speech, pvt, "dtmf", digits);
+		return;
+	}
+
+	add_local_result(pvt, "dtmf", digits, 100);
+	/* the event request waits on the pool for the stream to stop and its admission slot to be freed */
+	stop_stream_async(pvt);
+	if (pvt->stream_pending) {
+		gdf_release_admission(pvt);
+		pvt->stream_pending = 0;
+	}
+	close_preendpointed_audio_recording(pvt);
+	close_postendpointed_audio_recording(pvt);
+	if (start_async_query(pvt, event, language, 0)) {
+		ast_log(LOG_WARNING, "Unable to queue DTMF event %s on %s, event requests need event_workers\n", event, pvt->session_id);
+		record_session_error(pvt, STAT_ERRORS_QUERY);
+		ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+	}
+}
+
+static struct ast_frame *dtmf_hook_event(struct ast_channel *chan, struct ast_frame *frame, enum ast_framehook_event event, void *data)
+{
+	struct gdf_dtmf_hook *hook = data;
+	int consumed = 0;
+	int ready = 0;
+
+	if (!frame || event != AST_FRAMEHOOK_EVENT_READ ||
+		(frame->frametype != AST_FRAME_DTMF_BEGIN && frame->frametype != AST_FRAME_DTMF_END)) {
+		return frame;
+	}
+
+	ao2_lock(hook);
+	if (hook->speech) {
+		/* the hook lock keeps the speech object from being destroyed under us */
+		ast_mutex_lock(&hook->speech->lock);
+		ready = hook->speech->state == AST_SPEECH_STATE_READY;
+		ast_mutex_unlock(&hook->speech->lock);
+	}
+	if (ready) {
+		struct gdf_pvt *pvt = hook->speech->data;
+		if (frame->frametype == AST_FRAME_DTMF_END) {
+			char digit[2] = { frame->subclass.integer, '\0' };
+			consumed = !gdf_dtmf(hook->speech, digit);
+			/* on the terminator or the last digit the turn ends now rather than on the next frame written */
+			ast_mutex_lock(&pvt->lock);
+			ready = consumed && pvt->dtmf_complete;
+			ast_mutex_unlock(&pvt->lock);
+			if (ready) {
+				complete_dtmf_turn(hook->speech, pvt);
 			}
+		} else {
+			ast_mutex_lock(&pvt->lock);
+			consumed = pvt->dtmf_mode != DTMF_MODE_OFF && !pvt->dtmf_complete && !pvt->async_query_active;
+			ast_mutex_unlock(&pvt->lock);
 		}
 	}
+	ao2_unlock(hook);
 
-	if (output_audio) { 
-		struct ast_speech_result *new;
-		char tmpFilename[128];
-		int fd;
-		ssize_t written;
+	if (consumed) {
+		ast_frfree(frame);
+		return &ast_null_frame;
+	}
+	return frame;
+}
 
-		ast_copy_string(tmpFilename, "/tmp/res_speech_gdfe_fulfillment_XXXXXX.wav", sizeof(tmpFilename));
-		fd = mkstemps(tmpFilename, 4);
+static void dtmf_hook_destroy(void *data)
+{
+	ao2_ref(data, -1);
+}
 
-		if (fd < 0) {
-			ast_log(LOG_WARNING, "Unable to create temporary file for fulfillment message\n");
-			sprintf(tmpFilename, "/tmp/res_speech_gdfe_fulfillment_%d.wav", ast_atomic_fetchadd_int(&last_resort, 1));
-			fd = open(tmpFilename, O_WRONLY | O_CREAT, 0600);
-		}
-		written = write(fd, output_audio->value, output_audio->valueLen);
-		if (written < output_audio->valueLen) {
-			ast_log(LOG_WARNING, "Short write to temporary file for fulfillment message\n");
-		}
-		close(fd);
+static void attach_dtmf_hook(struct ast_speech *speech, struct gdf_pvt *pvt)
+{
+	struct ast_framehook_interface interface = {
+		.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+		.event_cb = dtmf_hook_event,
+		.destroy_cb = dtmf_hook_destroy,
+	};
+	struct ast_channel *chan;
+	struct gdf_dtmf_hook *hook;
+	char *channel_name;
 
-		audioFile = tmpFilename;
+	ast_mutex_lock(&pvt->lock);
+	channel_name = ast_strdupa(S_OR(pvt->channel_name, pvt->session_id));
+	ast_mutex_unlock(&pvt->lock);
 
-		new = ast_calloc(1, sizeof(*new));
-		if (new) {
-			new->text = ast_strdup(tmpFilename);
-			new->score = 100;
-			new->grammar = ast_strdup("fulfillment_audio");
+	chan = ast_channel_get_by_name(channel_name);
+	if (!chan) {
+		ast_log(LOG_WARNING, "No channel '%s' to collect DTMF from, leaving digits to the dialplan; "
+			"set SPEECH_ENGINE(" GDF_PROP_CHANNEL ") if the session ID is not the channel name\n", channel_name);
+		return;
+	}
 
-			if (end) {
-				AST_LIST_NEXT(end, list) = new;
-				end = new;
-			} else {
-				start = end = new;
-			}
+	hook = ao2_alloc(sizeof(*hook), NULL);
+	if (!hook) {
+		ast_log(LOG_WARNING, "Unable to allocate DTMF hook for %s, leaving digits to the dialplan\n", channel_name);
+	} else {
+		hook->speech = speech;
+		ao2_ref(hook, +1); /* for the framehook */
+		interface.data = hook;
+		ast_channel_lock(chan);
+		pvt->dtmf_hook_id = ast_framehook_attach(chan, &interface);
+		ast_channel_unlock(chan);
+		if (pvt->dtmf_hook_id < 0) {
+			ast_log(LOG_WARNING, "Unable to attach DTMF hook to %s\n", channel_name);
+			ao2_ref(hook, -2);
+			hook = NULL;
 		} else {
-			ast_log(LOG_WARNING, "Unable to allocate speech result slot for synthesized fulfillment text\n");
+			ast_mutex_lock(&pvt->lock);
+			ast_string_field_set(pvt, dtmf_hook_channel, channel_name);
+			ast_mutex_unlock(&pvt->lock);
 		}
-	} else if (fulfillment_text && !ast_strlen_zero(fulfillment_text->value)) {
-		char tmpFilename[128];
-		int fd;
-		struct gdf_config *cfg;
-		char *key;
-		char *language;
+		pvt->dtmf_hook = hook;
+	}
 
-		cfg = gdf_get_config();
-		key = ast_strdupa(cfg->service_key);
-		ao2_t_ref(cfg, -1, "done with creating session");
+	ast_channel_unref(chan);
+}
+
+/*! \brief take the hook off the channel, disarming it first in case a frame is already on its way */
+static void detach_dtmf_hook(struct gdf_pvt *pvt)
+{
+	struct ast_channel *chan;
+
+	ao2_lock(pvt->dtmf_hook);
+	pvt->dtmf_hook->speech = NULL;
+	ao2_unlock(pvt->dtmf_hook);
+
+	/* a channel that is already gone destroyed the hook with it */
+	chan = ast_channel_get_by_name(pvt->dtmf_hook_channel);
+	if (chan) {
+		ast_channel_lock(chan);
+		ast_framehook_detach(chan, pvt->dtmf_hook_id);
+		ast_channel_unlock(chan);
+		ast_channel_unref(chan);
+	}
+
+	ao2_ref(pvt->dtmf_hook, -1);
+	pvt->dtmf_hook = NULL;
+}
+
+static void load_turn_dtmf_settings(struct gdf_pvt *pvt)
+{
+	struct gdf_config *config;
+	struct gdf_logical_agent *agent = NULL;
+
+	config = gdf_get_config();
+	ast_mutex_lock(&pvt->lock);
+	if (config) {
+		agent = get_logical_agent_by_name(config, pvt->logical_agent_name);
+	}
+	if (agent) {
+		pvt->dtmf_mode = agent->dtmf_mode;
+		pvt->dtmf_terminator = agent->dtmf_terminator;
+		pvt->dtmf_interdigit_timeout = agent->dtmf_interdigit_timeout;
+		pvt->dtmf_max_digits = agent->dtmf_max_digits;
+		ast_string_field_set(pvt, dtmf_event, agent->dtmf_event);
+		ao2_ref(agent, -1);
+	} else {
+		pvt->dtmf_mode = DTMF_MODE_OFF;
+	}
+	pvt->dtmf_digits[0] = '\0';
+	pvt->dtmf_digit_count = 0;
+	pvt->dtmf_complete = 0;
+	ast_mutex_unlock(&pvt->lock);
+	if (config) {
+		ao2_ref(config, -1);
+	}
+}
+
+static int should_start_call_log(struct gdf_pvt *pvt)
+{
+	int should_start;
+	ast_mutex_lock(&pvt->lock);
+	should_start = !pvt->call_log_open_already_attempted;
+	ast_mutex_unlock(&pvt->lock);
+	if (should_start) {
+		struct gdf_config *cfg;
+		cfg = gdf_get_config();
+		if (cfg) {
+			should_start &= cfg->enable_call_logs;
+			ao2_t_ref(cfg, -1, "done checking for starting call log");
+		}
+	}
+	return should_start;
+}
+
+AST_THREADSTORAGE(call_log_path);
+static void calculate_log_path(struct gdf_pvt *pvt)
+{
+	struct varshead var_head = { .first = NULL, .last = NULL };
+	struct ast_var_t *var;
+	struct gdf_config *cfg;
+
+	ast_mutex_lock(&pvt->lock);
+	var = ast_var_assign("APPLICATION", pvt->call_logging_application_name);
+	ast_mutex_unlock(&pvt->lock);
+
+	AST_LIST_INSERT_HEAD(&var_head, var, entries);
+
+	cfg = gdf_get_config();
+	if (cfg) {
+		struct ast_str *path = ast_str_thread_get(&call_log_path, 256);
+
+		ast_str_substitute_variables_varshead(&path, 0, &var_head, cfg->call_log_location);
+
+		ast_mutex_lock(&pvt->lock);
+		ast_string_field_set(pvt, call_log_path, ast_str_buffer(path));
+		ast_mutex_unlock(&pvt->lock);
+
+		ao2_t_ref(cfg, -1, "done with config in calculating call log path");
+	}
+	
+	ast_var_delete(var);
+}
+
+static void calculate_log_file_basename(struct gdf_pvt *pvt)
+{
+	struct timeval t;
+	struct ast_tm now;
+	
+	t = ast_tvnow();
+	ast_localtime(&t, &now, NULL);
+	ast_string_field_build(pvt, call_log_file_basename, "%02d%02d_%s", now.tm_min, now.tm_sec, pvt->session_id);
+}
+
+static void mkdir_log_path(struct gdf_pvt *pvt)
+{
+	ast_mkdir(pvt->call_log_path, 0644);
+}
+
+static struct ast_str *build_log_related_filename_to_thread_local_str(struct gdf_pvt *pvt, int include_utterance_counter, const char *type, const char *extension)
+{
+	struct ast_str *path;
+	path = ast_str_thread_get(&call_log_path, 256);
+	ast_mutex_lock(&pvt->lock);
+	ast_str_set(&path, 0, pvt->call_log_path);
+	ast_str_append(&path, 0, pvt->call_log_file_basename);
+	ast_str_append(&path, 0, "_%s", type);
+	if (include_utterance_counter) {
+		ast_str_append(&path, 0, "_%d", pvt->utterance_counter);
+	}
+	ast_str_append(&path, 0, ".%s" , extension);
+	ast_mutex_unlock(&pvt->lock);
+	return path;
+}
+
+static void start_call_log(struct gdf_pvt *pvt)
+{
+	ast_mutex_lock(&pvt->lock);
+	pvt->call_log_open_already_attempted = 1;
+	ast_mutex_unlock(&pvt->lock);
+
+	calculate_log_path(pvt);
+	calculate_log_file_basename(pvt);
+
+	if (!ast_strlen_zero(pvt->call_log_path)) {
+		struct ast_str *path;
+		FILE *log_file;
+
+		mkdir_log_path(pvt);
+
+		path = build_log_related_filename_to_thread_local_str(pvt, 0, "log", "jsonl");
+
+		log_file = fopen(ast_str_buffer(path), "w");
+		if (log_file) {
+			ast_log(LOG_DEBUG, "Opened %s for call log for %s\n", ast_str_buffer(path), pvt->session_id);
+			ast_mutex_lock(&pvt->lock);
+			pvt->call_log_file_handle = log_file;
+			ast_mutex_unlock(&pvt->lock);
+		} else {
+			ast_log(LOG_WARNING, "Unable to open %s for writing call log for %s -- %d: %s\n", ast_str_buffer(path), pvt->session_id, errno, strerror(errno));
+		}
+	} else {
+		ast_log(LOG_WARNING, "Not starting call log, path is empty\n");
+	}
+}
+
+static void log_endpointer_start_event(struct gdf_pvt *pvt)
+{
+	int pvt_threshold;
+	char threshold[11];
+	int pvt_voice_duration;
+	char voice_duration[11];
+	int pvt_silence_duration;
+	char silence_duration[11];
+	struct dialogflow_log_data log_data[] = {
+		{ VAD_PROP_VOICE_THRESHOLD, threshold },
+		{ VAD_PROP_VOICE_DURATION, voice_duration },
+		{ VAD_PROP_SILENCE_DURATION, silence_duration },
+	};
+
+	ast_mutex_lock(&pvt->lock);
+	pvt_threshold = pvt->voice_threshold;
+	pvt_voice_duration = pvt->voice_minimum_duration;
+	pvt_silence_duration = pvt->silence_minimum_duration;
+	ast_mutex_unlock(&pvt->lock);
+
+	sprintf(threshold, "%d", pvt_threshold);
+	sprintf(voice_duration, "%d", pvt_voice_duration);
+	sprintf(silence_duration, "%d", pvt_silence_duration);
+
+	gdf_log_call_event(pvt, CALL_LOG_TYPE_ENDPOINTER, "start", ARRAY_LEN(log_data), log_data);
+}
+
+static int continuous_streaming_enabled(struct gdf_pvt *pvt, int *max_idle)
+{
+	struct gdf_config *config;
+	int enabled = 0;
+
+	*max_idle = 10000;
+
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent;
+		ast_mutex_lock(&pvt->lock);
+		agent = get_logical_agent_by_name(config, pvt->logical_agent_name);
+		ast_mutex_unlock(&pvt->lock);
+		if (agent) {
+			enabled = agent->continuous_streaming;
+			*max_idle = agent->continuous_stream_max_idle;
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->continuous_streaming >= 0) {
+		enabled = pvt->continuous_streaming;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	return enabled;
+}
+
+/*! \brief close the pre-opened stream, waiting for one that is still being opened or closed -- event pool only */
+static void close_preopened_stream(struct gdf_pvt *pvt)
+{
+	int preopened;
+
+	ast_mutex_lock(&pvt->lock);
+	while (pvt->stream_preopening || pvt->stream_closing) {
+		ast_cond_wait(&pvt->async_query_done, &pvt->lock);
+	}
+	preopened = pvt->stream_preopened;
+	pvt->stream_preopened = 0;
+	if (preopened) {
+		pvt->recognition_active = 0;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	if (preopened) {
+		df_stop_recognition(pvt->session);
+		gdf_release_admission(pvt);
+	}
+}
+
+/* stops a stream on the reaper, for speech callbacks that must not wait on the backend */
+static int stop_stream_task(void *data)
+{
+	struct gdf_pvt *pvt = data;
+
+	df_stop_recognition(pvt->session);
+	gdf_release_admission(pvt);
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->stream_closing = 0;
+	ast_cond_broadcast(&pvt->async_query_done);
+	ast_mutex_unlock(&pvt->lock);
+
+	gdf_pvt_release_pending(pvt);
+	return 0;
+}
+
+/*!
+ * \brief close an idle pre-opened stream on the reaper, for speech callbacks that must not wait on the backend
+ *
+ * The reaper also runs the teardown, so the stop is always done before the session is closed. Until
+ * then claim_preopened_stream() reports the stream as busy and the next stream opens after it. A stream
+ * that is still being opened is left alone; the turn that started it gets it.
+ */
+static void close_preopened_stream_async(struct gdf_pvt *pvt)
+{
+	int preopened;
+
+	ast_mutex_lock(&pvt->lock);
+	preopened = pvt->stream_preopened && !pvt->stream_preopening && !pvt->stream_closing;
+	if (preopened) {
+		pvt->stream_preopened = 0;
+		pvt->recognition_active = 0;
+		pvt->stream_closing = 1;
+		pvt->pending_requests++;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	if (preopened && (!reaper || ast_taskprocessor_push(reaper, stop_stream_task, pvt))) {
+		/* leave it open, it is used or replaced by a later turn or stopped at teardown */
+		ast_log(LOG_WARNING, "Unable to queue closing the pre-opened stream on %s\n", pvt->session_id);
+		ast_mutex_lock(&pvt->lock);
+		pvt->stream_preopened = 1;
+		pvt->recognition_active = 1;
+		pvt->stream_closing = 0;
+		pvt->pending_requests--;
+		ast_mutex_unlock(&pvt->lock);
+	}
+}
+
+/*! \brief stop the utterance's stream on the reaper, like close_preopened_stream_async() */
+static void stop_stream_async(struct gdf_pvt *pvt)
+{
+	int stop;
+
+	ast_mutex_lock(&pvt->lock);
+	stop = pvt->recognition_active && !pvt->stream_preopened && !pvt->stream_preopening && !pvt->stream_closing;
+	if (stop) {
+		pvt->recognition_active = 0;
+		pvt->stream_closing = 1;
+		pvt->pending_requests++;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	if (stop && (!reaper || ast_taskprocessor_push(reaper, stop_stream_task, pvt))) {
+		ast_mutex_lock(&pvt->lock);
+		pvt->stream_closing = 0;
+		pvt->pending_requests--;
+		ast_mutex_unlock(&pvt->lock);
+		df_stop_recognition(pvt->session);
+	}
+}
+
+/*!
+ * \brief hand the pre-opened stream to the utterance that has just started
+ *
+ * \retval 1 the stream now belongs to the utterance
+ * \retval 0 there is no pre-opened stream
+ * \retval -1 the stream is still being opened or closed
+ */
+static int claim_preopened_stream(struct gdf_pvt *pvt)
+{
+	char setup_ms[21];
+	char idle_ms[21];
+	struct dialogflow_log_data log_data[] = {
+		{ "setup_ms_saved", setup_ms },
+		{ "idle_ms", idle_ms }
+	};
+
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->stream_preopening || pvt->stream_closing) {
+		ast_mutex_unlock(&pvt->lock);
+		return -1;
+	}
+	if (!pvt->stream_preopened) {
+		ast_mutex_unlock(&pvt->lock);
+		return 0;
+	}
+	pvt->stream_preopened = 0;
+	sprintf(setup_ms, "%" PRId64, pvt->stream_setup_ms);
+	sprintf(idle_ms, "%" PRId64, (int64_t) ast_tvdiff_ms(ast_tvnow(), pvt->stream_opened_at));
+	ast_mutex_unlock(&pvt->lock);
+
+	gdf_log_call_event(pvt, CALL_LOG_TYPE_SESSION, "stream_reuse", ARRAY_LEN(log_data), log_data);
+	return 1;
+}
+
+/*!
+ * \brief admit the turn and, unless an idle stream is being kept, open its stream -- runs on the event pool
+ *
+ * A kept stream does not hold a slot between turns, so it has to be admitted again; if it
+ * cannot be, it is closed and the turn falls back to opening a stream on speech.
+ */
+static int preopen_stream_task(void *data)
+{
+	struct gdf_pvt *pvt = data;
+	enum gdf_admission_result admission;
+	struct timeval start = { 0, };
+	int64_t open_start;
+	int reuse;
+	int opened = 0;
+	int release_slot;
+	int stop_stream;
+	int close_session;
+
+	ast_mutex_lock(&pvt->lock);
+	reuse = pvt->stream_preopened;
+	if (reuse && pvt->preopen_reopen) {
+		ast_mutex_unlock(&pvt->lock);
+		df_stop_recognition(pvt->session);
+		reuse = 0;
+		ast_mutex_lock(&pvt->lock);
+	}
+	pvt->preopen_reopen = 0;
+	ast_mutex_unlock(&pvt->lock);
+
+	admission = gdf_admit_request(pvt);
+	if (admission != ADMISSION_ADMITTED && admission != ADMISSION_QUEUED) {
+		if (reuse) {
+			df_stop_recognition(pvt->session);
+		}
+	} else if (reuse) {
+		opened = 1;
+	} else {
+		start = ast_tvnow();
+		open_start = monotonic_us();
+		if (df_start_recognition(pvt->session, pvt->language, 0)) {
+			ast_log(LOG_WARNING, "Error pre-opening recognition stream on %s\n", pvt->session_id);
+			record_endpoint_result(pvt, -1, 0);
+			record_session_error(pvt, STAT_ERRORS_STREAM_OPEN);
+			gdf_release_admission(pvt);
+		} else {
+			record_latency(pvt, LATENCY_STREAM_OPEN, open_start);
+			gdf_pvt_count(pvt, STAT_STREAMS_OPENED, 1);
+			opened = 1;
+		}
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	if (opened && !reuse) {
+		pvt->stream_opened_at = ast_tvnow();
+		pvt->stream_setup_ms = ast_tvdiff_ms(pvt->stream_opened_at, start);
+	}
+	pvt->stream_preopened = opened;
+	pvt->recognition_active = opened;
+	pvt->stream_preopening = 0;
+	/* the turn may have ended before the stream was ready, in which case it is kept idle */
+	release_slot = opened && pvt->preopen_turn_over;
+	stop_stream = opened && pvt->close_session_after_query;
+	close_session = pvt->close_session_after_query && !pvt->async_query_active;
+	ast_cond_broadcast(&pvt->async_query_done);
+	ast_mutex_unlock(&pvt->lock);
+
+	if (opened && !reuse) {
+		char setup_ms[21];
+		struct dialogflow_log_data log_data[] = {
+			{ "setup_ms", setup_ms }
+		};
+		sprintf(setup_ms, "%" PRId64, pvt->stream_setup_ms);
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_SESSION, "stream_preopen", ARRAY_LEN(log_data), log_data);
+	}
+
+	if (stop_stream) {
+		/* torn down while the stream was being opened */
+		df_stop_recognition(pvt->session);
+	}
+	if (close_session) {
+		gdf_release_admission(pvt);
+		df_close_session(pvt->session);
+	} else if (release_slot || stop_stream) {
+		gdf_release_admission(pvt);
+	}
+
+	gdf_pvt_release_pending(pvt);
+	return 0;
+}
+
+/*!
+ * \brief open the next turn's stream on the event pool, so its setup overlaps the prompt instead of following the caller's first words
+ *
+ * An unused stream is kept across turns until it has been idle for continuous_stream_max_idle, or the
+ * session has been moved to another endpoint, but gives up its admission slot while no turn is running.
+ * Without the pool the stream is opened on speech as usual.
+ */
+static void preopen_stream(struct gdf_pvt *pvt, int max_idle, int rerouted)
+{
+	struct gdf_config *config;
+	int workers = 0;
+	int preopened;
+	int reopen;
+	struct timeval opened_at;
+
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->stream_preopening || pvt->stream_closing) {
+		/* still opening from an earlier turn, or the stream opens on speech once closed */
+		pvt->preopen_turn_over = 0;
+		ast_mutex_unlock(&pvt->lock);
+		return;
+	}
+	preopened = pvt->stream_preopened;
+	opened_at = pvt->stream_opened_at;
+	ast_mutex_unlock(&pvt->lock);
+
+	reopen = preopened && (rerouted || ast_tvdiff_ms(ast_tvnow(), opened_at) >= max_idle);
+	if (reopen) {
+		ast_log(LOG_DEBUG, "Pre-opened stream on %s is %s, reopening\n", pvt->session_id,
+			rerouted ? "on the wrong endpoint" : "idle too long");
+	}
+
+	config = gdf_get_config();
+	if (config) {
+		workers = config->event_workers;
+		ao2_ref(config, -1);
+	}
+	if (!event_pool || workers <= 0) {
+		if (reopen) {
+			close_preopened_stream_async(pvt);
+		}
+		return;
+	}
+
+	if (!preopened || reopen) {
+		start_uplink(pvt);
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->pending_requests++;
+	pvt->stream_preopening = 1;
+	pvt->preopen_turn_over = 0;
+	pvt->preopen_reopen = reopen;
+	ast_mutex_unlock(&pvt->lock);
+
+	if (ast_threadpool_push(event_pool, preopen_stream_task, pvt)) {
+		ast_mutex_lock(&pvt->lock);
+		pvt->pending_requests--;
+		pvt->stream_preopening = 0;
+		pvt->preopen_reopen = 0;
+		ast_mutex_unlock(&pvt->lock);
+		if (reopen) {
+			close_preopened_stream_async(pvt);
+		}
+	}
+}
+
+static void get_turn_timers(struct gdf_pvt *pvt, int *no_input_timeout, int *max_speech_duration)
+{
+	struct gdf_config *config;
+
+	*no_input_timeout = 0;
+	*max_speech_duration = 0;
+
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent;
+		ast_mutex_lock(&pvt->lock);
+		agent = get_logical_agent_by_name(config, pvt->logical_agent_name);
+		ast_mutex_unlock(&pvt->lock);
+		if (agent) {
+			*no_input_timeout = agent->no_input_timeout;
+			*max_speech_duration = agent->max_speech_duration;
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->no_input_timeout >= 0) {
+		*no_input_timeout = pvt->no_input_timeout;
+	}
+	if (pvt->max_speech_duration >= 0) {
+		*max_speech_duration = pvt->max_speech_duration;
+	}
+	ast_mutex_unlock(&pvt->lock);
+}
+
+struct gdf_async_query {
+	struct gdf_pvt *pvt;
+	int prefetch; /* sent from gdf_activate, ahead of the turn */
+	char *language;
+	char event[0];
+};
+
+/*! \brief deliver an event request's result to the turn -- called once per request, on the event pool */
+static void finish_async_query(struct gdf_async_query *query, int res)
+{
+	struct gdf_pvt *pvt = query->pvt;
+	int close_session;
+	int deliver;
+
+	ast_mutex_lock(&pvt->lock);
+	if (query->prefetch) {
+		if (pvt->prefetch_discarded) {
+			/* gdf_start moved on to a different request */
+			pvt->prefetch_state = PREFETCH_NONE;
+			pvt->prefetch_discarded = 0;
+			deliver = 0;
+		} else {
+			pvt->prefetch_state = PREFETCH_COMPLETE;
+			pvt->prefetch_result = res;
+			deliver = pvt->prefetch_claimed;
+			if (deliver) {
+				pvt->prefetch_state = PREFETCH_NONE;
+				pvt->prefetch_claimed = 0;
+			}
+		}
+	} else {
+		deliver = 1;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	if (deliver) {
+		if (res) {
+			ast_log(LOG_WARNING, "Error recognizing event on %s\n", pvt->session_id);
+			record_session_error(pvt, STAT_ERRORS_QUERY);
+		} else {
+			close_preendpointed_audio_recording(pvt);
+			close_postendpointed_audio_recording(pvt);
+			write_end_of_recognition_call_event(pvt);
+		}
+	}
+	gdf_release_admission(pvt);
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->async_query_active--;
+	ast_cond_broadcast(&pvt->async_query_done);
+	if (deliver && pvt->speech) {
+		/* the channel may be in SpeechBackground, which picks this up on its next frame */
+		ast_speech_change_state(pvt->speech, res ? AST_SPEECH_STATE_NOT_READY : AST_SPEECH_STATE_DONE);
+	}
+	close_session = pvt->close_session_after_query && !pvt->async_query_active && !pvt->stream_preopening;
+	ast_mutex_unlock(&pvt->lock);
+
+	if (close_session) {
+		df_close_session(pvt->session);
+	}
+
+	ast_free(query->language);
+	ast_free(query);
+	gdf_pvt_release_pending(pvt);
+}
+
+/*!
+ * \brief get the session ready for an event request and send it -- runs on the event pool
+ *
+ * Everything here may wait: on a prefetch the turn has moved past, on a pre-opened stream
+ * being opened or closed, and in the admission queue. gdf_start and gdf_activate only queue it.
+ */
+static int async_query_task(void *data)
+{
+	struct gdf_async_query *query = data;
+	struct gdf_pvt *pvt = query->pvt;
+	enum gdf_admission_result admission;
+
+	if (!query->prefetch) {
+		/* a discarded prefetch still has the session until it finishes */
+		ast_mutex_lock(&pvt->lock);
+		while (pvt->prefetch_state == PREFETCH_RUNNING) {
+			ast_cond_wait(&pvt->async_query_done, &pvt->lock);
+		}
+		ast_mutex_unlock(&pvt->lock);
+	}
+
+	/* the pvt holds one admission at a time, so the request cannot share it with a pre-opened stream */
+	close_preopened_stream(pvt);
+	if (!query->prefetch) {
+		route_session_endpoint(pvt, 1);
+	}
+
+	admission = gdf_admit_request(pvt);
+	if (admission != ADMISSION_ADMITTED && admission != ADMISSION_QUEUED) {
+		ast_log(LOG_WARNING, "Event %s not admitted (%s) for agent '%s' on %s\n", query->event,
+			admission_result_names[admission], pvt->logical_agent_name, pvt->session_id);
+		finish_async_query(query, -1);
+		return 0;
+	}
+
+	gdf_recognize_event(query);
+	return 0;
+}
+
+/* returns zero if the request was handed to the event pool */
+static int start_async_query(struct gdf_pvt *pvt, const char *event, const char *language, int prefetch)
+{
+	struct gdf_config *config;
+	struct gdf_async_query *query;
+	int workers = 0;
+
+	config = gdf_get_config();
+	if (config) {
+		workers = config->event_workers;
+		ao2_ref(config, -1);
+	}
+	if (!event_pool || workers <= 0) {
+		return -1;
+	}
+
+	query = ast_calloc(1, sizeof(*query) + strlen(event) + 1);
+	if (!query) {
+		return -1;
+	}
+	strcpy(query->event, event); /* safe */
+	query->pvt = pvt;
+	query->prefetch = prefetch;
+	query->language = ast_strdup(language);
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->pending_requests++;
+	pvt->async_query_active++;
+	ast_mutex_unlock(&pvt->lock);
+
+	if (!query->language || ast_threadpool_push(event_pool, async_query_task, query)) {
+		ast_mutex_lock(&pvt->lock);
+		pvt->pending_requests--;
+		pvt->async_query_active--;
+		ast_mutex_unlock(&pvt->lock);
+		ast_free(query->language);
+		ast_free(query);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void cached_response_destructor(void *obj)
+{
+	struct gdf_cached_response *cached = obj;
+	int i;
+
+	for (i = 0; i < cached->result_count; i++) {
+		ast_free(cached->results[i].slot);
+		ast_free(cached->results[i].value);
+	}
+	ast_free(cached->results);
+}
+
+static int cached_response_hash_callback(const void *obj, const int flags)
+{
+	const struct gdf_cached_response *cached = obj;
+	return ast_str_hash((flags & OBJ_KEY) ? (const char *) obj : cached->key);
+}
+
+static int cached_response_compare_callback(void *obj, void *other, int flags)
+{
+	const struct gdf_cached_response *cachedA = obj;
+	const char *key = (flags & OBJ_KEY) ? (const char *) other : ((const struct gdf_cached_response *) other)->key;
+	return (!strcmp(cachedA->key, key) ? CMP_MATCH | CMP_STOP : 0);
+}
+
+AST_THREADSTORAGE(cache_key_buf);
+/* event requests carry no parameters in this engine, so the key is just who was asked what, in what language */
+static const char *build_cache_key(const char *project_id, const char *event, const char *language)
+{
+	struct ast_str *key = ast_str_thread_get(&cache_key_buf, 128);
+	ast_str_set(&key, 0, "%s/%s/%s", project_id, event, language);
+	return ast_str_buffer(key);
+}
+
+static struct gdf_cached_response *find_cached_response(const char *key)
+{
+	struct gdf_cached_response *cached;
+
+	if (!response_cache) {
+		return NULL;
+	}
+
+	cached = ao2_find(response_cache, key, OBJ_KEY);
+	if (cached && ast_tvcmp(ast_tvnow(), cached->expires) >= 0) {
+		ao2_unlink(response_cache, cached);
+		ao2_ref(cached, -1);
+		cached = NULL;
+	}
+	return cached;
+}
+
+static int copy_result(struct dialogflow_result *to, const struct dialogflow_result *from)
+{
+	to->slot = ast_strdup(from->slot);
+	to->value = ast_malloc(from->valueLen + 1);
+	if (!to->slot || !to->value) {
+		return -1;
+	}
+	memcpy(to->value, from->value, from->valueLen);
+	to->value[from->valueLen] = '\0';
+	to->valueLen = from->valueLen;
+	to->score = from->score;
+	return 0;
+}
+
+/*! \brief cache the session's results, along with audio synthesized for them so hits skip TTS too */
+static void store_cached_response(struct gdf_pvt *pvt, const char *synthesized_audio_file)
+{
+	struct gdf_cached_response *cached;
+	const char *agent_name;
+	int count = df_get_result_count(pvt->session);
+	int i;
+
+	if (!response_cache || count <= 0) {
+		return;
+	}
+
+	agent_name = S_OR(pvt->logical_agent_name, pvt->project_id);
+	cached = ao2_alloc(sizeof(*cached) + strlen(pvt->cache_key) + 1 + strlen(agent_name) + 1, cached_response_destructor);
+	if (!cached) {
+		return;
+	}
+	strcpy(cached->key, pvt->cache_key); /* safe */
+	cached->agent_name = cached->key + strlen(cached->key) + 1;
+	strcpy((char *) cached->agent_name, agent_name); /* safe */
+	cached->created = ast_tvnow();
+	cached->expires = ast_tvadd(cached->created, ast_samp2tv(pvt->cache_ttl, 1));
+	cached->results = ast_calloc(count + 1, sizeof(*cached->results));
+	if (!cached->results) {
+		ao2_ref(cached, -1);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct dialogflow_result *df_result = df_get_result(pvt->session, i);
+		if (df_result) {
+			if (copy_result(&cached->results[cached->result_count++], df_result)) {
+				ao2_ref(cached, -1);
+				return;
+			}
+		}
+	}
+
+	if (!ast_strlen_zero(synthesized_audio_file)) {
+		FILE *audio = fopen(synthesized_audio_file, "r");
+		long len;
+		struct dialogflow_result *result = &cached->results[cached->result_count];
+
+		if (!audio || fseek(audio, 0, SEEK_END) || (len = ftell(audio)) <= 0 || fseek(audio, 0, SEEK_SET) ||
+			!(result->value = ast_malloc(len)) || fread(result->value, 1, len, audio) != len ||
+			!(result->slot = ast_strdup("output_audio"))) {
+			/* not worth caching a response that would still need synthesizing */
+			ast_log(LOG_WARNING, "Unable to cache synthesized audio %s\n", synthesized_audio_file);
+			cached->result_count++;
+			if (audio) {
+				fclose(audio);
+			}
+			ao2_ref(cached, -1);
+			return;
+		}
+		fclose(audio);
+		result->valueLen = len;
+		result->score = 100;
+		cached->result_count++;
+	}
+
+	ao2_lock(response_cache);
+	ao2_find(response_cache, cached->key, OBJ_KEY | OBJ_NOLOCK | OBJ_UNLINK | OBJ_NODATA);
+	ao2_link_flags(response_cache, cached, OBJ_NOLOCK);
+	ao2_unlock(response_cache);
+	ao2_ref(cached, -1);
+}
+
+static void log_cached_response(struct gdf_pvt *pvt, const char *event, struct gdf_cached_response *cached)
+{
+	struct dialogflow_log_data *log_data = ast_alloca(sizeof(*log_data) * (cached->result_count + 3));
+	char age_ms[21];
+	int count = 0;
+	int i;
+
+	log_data[count].name = "event";
+	log_data[count++].value = event;
+	log_data[count].name = "cache_hit";
+	log_data[count++].value = "true";
+	sprintf(age_ms, "%" PRId64, (int64_t) ast_tvdiff_ms(ast_tvnow(), cached->created));
+	log_data[count].name = "age_ms";
+	log_data[count++].value = age_ms;
+	for (i = 0; i < cached->result_count; i++) {
+		if (strcasecmp(cached->results[i].slot, "output_audio")) {
+			log_data[count].name = cached->results[i].slot;
+			log_data[count++].value = cached->results[i].value;
+		}
+	}
+
+	gdf_log_call_event(pvt, CALL_LOG_TYPE_DIALOGFLOW, "cached_response", count, log_data);
+}
+
+/*! \brief set up caching for an event turn, returning non-zero if the cache answered it */
+static int use_response_cache(struct gdf_pvt *pvt, const char *event, const char *language)
+{
+	struct gdf_config *config;
+	struct gdf_cached_response *cached = NULL;
+	char *name;
+	char *project_id;
+	int ttl = 0;
+
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->cached_response) {
+		ao2_ref(pvt->cached_response, -1);
+		pvt->cached_response = NULL;
+	}
+	ast_string_field_set(pvt, cache_key, "");
+	name = ast_strdupa(S_OR(pvt->logical_agent_name, pvt->project_id));
+	project_id = ast_strdupa(pvt->project_id);
+	ast_mutex_unlock(&pvt->lock);
+
+	if (ast_strlen_zero(event)) {
+		return 0;
+	}
+
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent = get_logical_agent_by_name(config, name);
+		if (agent) {
+			if (event_in_list(agent->cache_events, event)) {
+				ttl = agent->cache_ttl;
+			}
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
+	}
+	if (ttl <= 0) {
+		return 0;
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	ast_string_field_set(pvt, cache_key, build_cache_key(project_id, event, language));
+	pvt->cache_ttl = ttl;
+	cached = find_cached_response(pvt->cache_key);
+	pvt->cached_response = cached;
+	ast_mutex_unlock(&pvt->lock);
+
+	ast_mutex_lock(&engine_stats.lock);
+	if (cached) {
+		engine_stats.cache_hits++;
+	} else {
+		engine_stats.cache_misses++;
+	}
+	ast_mutex_unlock(&engine_stats.lock);
+	gdf_pvt_count(pvt, cached ? STAT_CACHE_HITS : STAT_CACHE_MISSES, 1);
+
+	if (cached) {
+		log_cached_response(pvt, event, cached);
+	}
+	return cached != NULL;
+}
+
+struct cache_flush_configs {
+	struct gdf_config *old_config;
+	struct gdf_config *new_config;
+};
+
+/* an agent reloaded unchanged is carried over as the same record, so anything else was added, changed or removed */
+static int cached_response_agent_changed(void *obj, void *arg, int flags)
+{
+	struct gdf_cached_response *cached = obj;
+	struct cache_flush_configs *configs = arg;
+	struct gdf_logical_agent *old_agent = get_logical_agent_by_name(configs->old_config, cached->agent_name);
+	struct gdf_logical_agent *new_agent = get_logical_agent_by_name(configs->new_config, cached->agent_name);
+	int changed = !old_agent || old_agent != new_agent;
+
+	if (old_agent) {
+		ao2_ref(old_agent, -1);
+	}
+	if (new_agent) {
+		ao2_ref(new_agent, -1);
+	}
+	return changed ? CMP_MATCH : 0;
+}
+
+/*! \brief drop cached responses of agents the reload added, changed or removed */
+static void flush_changed_cached_responses(struct gdf_config *old_config, struct gdf_config *new_config)
+{
+	struct cache_flush_configs configs = { old_config, new_config };
+
+	if (response_cache && old_config) {
+		ao2_callback(response_cache, OBJ_NODATA | OBJ_MULTIPLE | OBJ_UNLINK, cached_response_agent_changed, &configs);
+	}
+}
+
+static int event_in_list(const char *list, const char *event)
+{
+	char *events = ast_strdupa(S_OR(list, ""));
+	char *name;
+
+	while ((name = strsep(&events, ","))) {
+		name = ast_strip(name);
+		if (!strcmp(name, "*") || !strcasecmp(name, event)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief send the activated event now if the agent allows it, so the response is usually in by gdf_start */
+static void maybe_prefetch_event(struct gdf_pvt *pvt)
+{
+	struct gdf_config *config;
+	char *name;
+	char *event;
+	char *language;
+	int allowed = 0;
+
+	ast_mutex_lock(&pvt->lock);
+	name = ast_strdupa(S_OR(pvt->logical_agent_name, pvt->project_id));
+	event = ast_strdupa(pvt->event);
+	language = ast_strdupa(pvt->language);
+	if (pvt->async_query_active || pvt->prefetch_state != PREFETCH_NONE || ast_strlen_zero(pvt->project_id)) {
+		ast_mutex_unlock(&pvt->lock);
+		return;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	if (ast_strlen_zero(event)) {
+		return;
+	}
+
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent = get_logical_agent_by_name(config, name);
+		if (agent) {
+			allowed = event_in_list(agent->prefetch_events, event);
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
+	}
+	if (!allowed) {
+		return;
+	}
+
+	{
+		/* no point asking for what the cache will answer */
+		struct gdf_cached_response *cached;
+		ast_mutex_lock(&pvt->lock);
+		cached = find_cached_response(build_cache_key(pvt->project_id, event, language));
+		ast_mutex_unlock(&pvt->lock);
+		if (cached) {
+			ao2_ref(cached, -1);
+			return;
+		}
+	}
+
+	/* the request closes any pre-opened stream, which the event turn it is for would not use */
+	ast_mutex_lock(&pvt->lock);
+	ast_string_field_set(pvt, prefetch_event, event);
+	ast_string_field_set(pvt, prefetch_language, language);
+	pvt->prefetch_state = PREFETCH_RUNNING;
+	pvt->prefetch_claimed = 0;
+	pvt->prefetch_discarded = 0;
+	ast_mutex_unlock(&pvt->lock);
+
+	if (start_async_query(pvt, event, language, 1)) {
+		ast_mutex_lock(&pvt->lock);
+		pvt->prefetch_state = PREFETCH_NONE;
+		ast_mutex_unlock(&pvt->lock);
+		return;
+	}
+
+	ast_log(LOG_DEBUG, "Prefetching event %s on %s\n", event, pvt->session_id);
+	ast_mutex_lock(&engine_stats.lock);
+	engine_stats.prefetches++;
+	ast_mutex_unlock(&engine_stats.lock);
+	gdf_pvt_count(pvt, STAT_PREFETCHES, 1);
+}
+
+enum gdf_prefetch_use {
+	PREFETCH_NOT_USED, /* nothing usable, send the request as normal */
+	PREFETCH_PENDING, /* still running, it finishes the turn when it lands */
+	PREFETCH_SUCCEEDED,
+};
+
+/*! \brief use or discard a prefetched response for this turn */
+static enum gdf_prefetch_use claim_prefetch(struct gdf_pvt *pvt, const char *event, const char *language)
+{
+	enum gdf_prefetch_use use = PREFETCH_NOT_USED;
+	int match;
+
+	ast_mutex_lock(&pvt->lock);
+	if (pvt->prefetch_state == PREFETCH_NONE) {
+		ast_mutex_unlock(&pvt->lock);
+		return PREFETCH_NOT_USED;
+	}
+
+	match = !ast_strlen_zero(event) &&
+		!strcasecmp(event, pvt->prefetch_event) && !strcmp(language, pvt->prefetch_language);
+
+	if (match && pvt->prefetch_state == PREFETCH_RUNNING) {
+		pvt->prefetch_claimed = 1;
+		use = PREFETCH_PENDING;
+	} else if (match && !pvt->prefetch_result) {
+		pvt->prefetch_state = PREFETCH_NONE;
+		use = PREFETCH_SUCCEEDED;
+	} else if (pvt->prefetch_state == PREFETCH_RUNNING) {
+		/* the session is busy until it finishes; gdf_write ignores audio and an event request waits until then */
+		pvt->prefetch_discarded = 1;
+	} else {
+		pvt->prefetch_state = PREFETCH_NONE;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	ast_mutex_lock(&engine_stats.lock);
+	if (use == PREFETCH_NOT_USED) {
+		engine_stats.prefetches_wasted++;
+	} else {
+		engine_stats.prefetch_hits++;
+	}
+	ast_mutex_unlock(&engine_stats.lock);
+	gdf_pvt_count(pvt, use == PREFETCH_NOT_USED ? STAT_PREFETCH_WASTED : STAT_PREFETCH_HITS, 1);
+
+	{
+		struct dialogflow_log_data log_data[] = {
+			{ "event", pvt->prefetch_event },
+			{ "used", use == PREFETCH_NOT_USED ? "no" : use == PREFETCH_PENDING ? "pending" : "yes" }
+		};
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_SESSION, "event_prefetch", ARRAY_LEN(log_data), log_data);
+	}
+
+	return use;
+}
+
+static int gdf_start(struct ast_speech *speech)
+{
+	struct gdf_pvt *pvt = speech->data;
+	struct gdf_config *config;
+	char *event = NULL;
+	char *language = NULL;
+	char *project_id = NULL;
+	int stream_recovery_attempts = 0;
+	int stream_recovery_buffer = 0;
+	int record_pre = 0;
+	int record_post = 0;
+	int no_input_timeout;
+	int max_speech_duration;
+	char *agent_name;
+	struct gdf_agent_runtime *runtime;
+	struct gdf_agent_runtime *old_runtime;
+	char statsd_prefix[128];
+
+	config = gdf_get_config();
+	if (config) {
+		stream_recovery_attempts = config->stream_recovery_attempts;
+		stream_recovery_buffer = config->stream_recovery_buffer;
+		record_pre = config->enable_preendpointer_recordings;
+		record_post = config->enable_postendpointer_recordings;
+		ao2_ref(config, -1);
+	}
+
+	get_turn_timers(pvt, &no_input_timeout, &max_speech_duration);
+
+	ast_mutex_lock(&pvt->lock);
+	agent_name = ast_strdupa(S_OR(pvt->logical_agent_name, pvt->project_id));
+	ast_mutex_unlock(&pvt->lock);
+	runtime = ast_strlen_zero(agent_name) ? NULL : get_agent_runtime(agent_name);
+	format_statsd_prefix(statsd_prefix, sizeof(statsd_prefix), agent_name);
+
+	ast_mutex_lock(&pvt->lock);
+	old_runtime = pvt->turn_runtime;
+	pvt->turn_runtime = runtime;
+	ast_string_field_set(pvt, statsd_prefix, statsd_prefix);
+	event = ast_strdupa(pvt->event);
+	language = ast_strdupa(pvt->language);
+	project_id = ast_strdupa(pvt->project_id);
+	ast_string_field_set(pvt, event, "");
+	pvt->vad_state = VAD_STATE_START;
+	pvt->vad_state_duration = 0;
+	pvt->vad_change_duration = 0;
+	pvt->utterance_counter++;
+	pvt->last_admission_result = ADMISSION_NOT_ATTEMPTED;
+	pvt->turn_finished_locally = 0;
+	pvt->interim_response_count = 0;
+	ast_string_field_set(pvt, last_interim_transcript, "");
+	pvt->turn_no_input_timeout = no_input_timeout;
+	pvt->turn_max_speech_duration = max_speech_duration;
+	pvt->speech_duration = 0;
+	pvt->replay_buffer_len = 0;
+	pvt->replay_buffer_overflowed = 0;
+	pvt->replay_attempts = 0;
+	pvt->chunk_len = 0;
+	pvt->replay_max_attempts = stream_recovery_attempts;
+	pvt->replay_buffer_ms = stream_recovery_buffer;
+	pvt->turn_record_pre = record_pre;
+	pvt->turn_record_post = record_post;
+	pvt->turn_start_us = monotonic_us();
+	pvt->speech_start_us = 0;
+	pvt->first_audio_us = 0;
+	pvt->turn_result_us = 0;
+	pvt->turn_query = !ast_strlen_zero(event);
+	ast_mutex_unlock(&pvt->lock);
+
+	if (old_runtime) {
+		ao2_ref(old_runtime, -1);
+	}
+
+	if (pvt->stream_pending) {
+		/* the last turn ended while its stream was still waiting for admission */
+		gdf_release_admission(pvt);
+		pvt->stream_pending = 0;
+	}
+
+	clear_local_results(pvt);
+
+	load_turn_dtmf_settings(pvt);
+	if (pvt->dtmf_mode != DTMF_MODE_OFF && !pvt->dtmf_hook) {
+		attach_dtmf_hook(speech, pvt);
+	}
+
+	if (should_start_call_log(pvt)) {
+		start_call_log(pvt);
+	}
+
+	{
+		char utterance_number[11];
+		struct dialogflow_log_data log_data[] = {
+			{ "event", event },
+			{ "language", language },
+			{ "project_id", project_id },
+			{ "logical_agent_name", pvt->logical_agent_name },
+			{ "utterance", utterance_number },
+			{ "context", pvt->call_logging_context },
+			{ "application", pvt->call_logging_application_name }
+		};
+		sprintf(utterance_number, "%d", pvt->utterance_counter);
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_SESSION, "start", ARRAY_LEN(log_data), log_data);
+	}
+	log_endpointer_start_event(pvt);
+
+	/* nothing here waits on the backend: requests, admission and closing streams all happen on the event pool or reaper */
+	if (use_response_cache(pvt, event, language)) {
+		/* a pre-opened stream is kept for the next turn */
+		gdf_stop_recognition(speech, pvt);
+		return 0;
+	}
+
+	/* ready before the prefetch is claimed, in case it lands and finishes the turn straight away */
+	ast_speech_change_state(speech, AST_SPEECH_STATE_READY);
+	switch (claim_prefetch(pvt, event, language)) {
+	case PREFETCH_PENDING:
+		return 0;
+	case PREFETCH_SUCCEEDED:
+		gdf_stop_recognition(speech, pvt);
+		return 0;
+	case PREFETCH_NOT_USED:
+		break;
+	}
+
+	if (!ast_strlen_zero(event)) {
+		/* a single request, no VAD, recording or audio stream; SpeechBackground plays its prompt meanwhile */
+		if (start_async_query(pvt, event, language, 0)) {
+			ast_log(LOG_WARNING, "Unable to queue event %s on %s, event requests need event_workers\n", event, pvt->session_id);
+			record_session_error(pvt, STAT_ERRORS_QUERY);
+			ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+		}
+	} else {
+		int max_idle;
+		int rerouted = route_session_endpoint(pvt, 1);
+		if (continuous_streaming_enabled(pvt, &max_idle)) {
+			preopen_stream(pvt, max_idle, rerouted);
+		} else {
+			close_preopened_stream_async(pvt);
+		}
+	}
+
+	return 0;
+}
+
+static int gdf_change(struct ast_speech *speech, const char *name, const char *value)
+{
+	struct gdf_pvt *pvt = speech->data;
+
+	if (!strcasecmp(name, GDF_PROP_SESSION_ID_NAME) || !strcasecmp(name, GDF_PROP_ALTERNATE_SESSION_NAME)) {
+		if (ast_strlen_zero(value)) {
+			ast_log(LOG_WARNING, "Session ID must have a value, refusing to set to nothing (remains %s)\n", df_get_session_id(pvt->session));
+			return -1;
+		}
+		df_set_session_id(pvt->session, value);
+		ast_mutex_lock(&pvt->lock);
+		ast_string_field_set(pvt, session_id, value);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_PROJECT_ID_NAME)) {
+		if (ast_strlen_zero(value)) {
+			ast_log(LOG_WARNING, "Project ID must have a value, refusing to set to nothing (remains %s)\n", df_get_project_id(pvt->session));
+			return -1;
+		}
+		ast_mutex_lock(&pvt->lock);
+		ast_string_field_set(pvt, project_id, value);
+		ast_mutex_unlock(&pvt->lock);
+		df_set_project_id(pvt->session, value);
+	} else if (!strcasecmp(name, GDF_PROP_LANGUAGE_NAME)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_string_field_set(pvt, language, value);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_LOG_CONTEXT) || !strcasecmp(name, GDF_PROP_ALTERNATE_LOG_CONTEXT)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_string_field_set(pvt, call_logging_context, value);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_APPLICATION_CONTEXT)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_string_field_set(pvt, call_logging_application_name, value);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_CONTINUOUS_STREAMING)) {
+		ast_mutex_lock(&pvt->lock);
+		pvt->continuous_streaming = ast_strlen_zero(value) ? -1 : ast_true(value);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_CHANNEL)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_string_field_set(pvt, channel_name, value);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_NO_INPUT_TIMEOUT) || !strcasecmp(name, GDF_PROP_MAX_SPEECH_DURATION)) {
+		int i = -1;
+		if (!ast_strlen_zero(value) && (sscanf(value, "%d", &i) != 1 || i < 0)) {
+			ast_log(LOG_WARNING, "Invalid value for %s -- '%s'\n", name, value);
+			return -1;
+		}
+		ast_mutex_lock(&pvt->lock);
+		if (!strcasecmp(name, GDF_PROP_NO_INPUT_TIMEOUT)) {
+			pvt->no_input_timeout = i;
+		} else {
+			pvt->max_speech_duration = i;
+		}
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_BARGE_IN)) {
+		enum gdf_barge_in_policy policy;
+		if (ast_strlen_zero(value) || parse_barge_in_policy(value, &policy)) {
+			ast_log(LOG_WARNING, "Invalid value for " GDF_PROP_BARGE_IN " -- '%s'\n", S_OR(value, ""));
+			return -1;
+		}
+		ast_mutex_lock(&pvt->lock);
+		pvt->barge_in_policy = policy;
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_BARGE_IN_DURATION)) {
+		int i;
+		if (ast_strlen_zero(value)) {
+			ast_log(LOG_WARNING, "Cannot set " GDF_PROP_BARGE_IN_DURATION " to an empty value\n");
+			return -1;
+		} else if (sscanf(value, "%d", &i) == 1) {
+			ast_mutex_lock(&pvt->lock);
+			pvt->barge_in_minimum_duration = i;
+			ast_mutex_unlock(&pvt->lock);
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for " GDF_PROP_BARGE_IN_DURATION " -- '%s'\n", value);
+			return -1;
+		}
+	} else if (!strcasecmp(name, VAD_PROP_VOICE_THRESHOLD)) {
+		int i;
+		if (ast_strlen_zero(value)) {
+			ast_log(LOG_WARNING, "Cannot set " VAD_PROP_VOICE_THRESHOLD " to an empty value\n");
+			return -1;
+		} else if (sscanf(value, "%d", &i) == 1) {
+			ast_mutex_lock(&pvt->lock);
+			pvt->voice_threshold = i;
+			ast_mutex_unlock(&pvt->lock);
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for " VAD_PROP_VOICE_THRESHOLD " -- '%s'\n", value);
+			return -1;
+		}
+	} else if (!strcasecmp(name, VAD_PROP_VOICE_DURATION)) {
+		int i;
+		if (ast_strlen_zero(value)) {
+			ast_log(LOG_WARNING, "Cannot set " VAD_PROP_VOICE_DURATION " to an empty value\n");
+			return -1;
+		} else if (sscanf(value, "%d", &i) == 1) {
+			ast_mutex_lock(&pvt->lock);
+			pvt->voice_minimum_duration = i;
+			ast_mutex_unlock(&pvt->lock);
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for " VAD_PROP_VOICE_DURATION " -- '%s'\n", value);
+			return -1;
+		}
+	} else if (!strcasecmp(name, VAD_PROP_SILENCE_DURATION)) {
+		int i;
+		if (ast_strlen_zero(value)) {
+			ast_log(LOG_WARNING, "Cannot set " VAD_PROP_SILENCE_DURATION " to an empty value\n");
+			return -1;
+		} else if (sscanf(value, "%d", &i) == 1) {
+			ast_mutex_lock(&pvt->lock);
+			pvt->silence_minimum_duration = i;
+			ast_mutex_unlock(&pvt->lock);
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for " VAD_PROP_SILENCE_DURATION " -- '%s'\n", value);
+			return -1;
+		}
+	} else {
+		ast_log(LOG_WARNING, "Unknown property '%s'\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+#ifdef ASTERISK_13_OR_LATER
+static int gdf_get_setting(struct ast_speech *speech, const char *name, char *buf, size_t len)
+{
+	struct gdf_pvt *pvt = speech->data;
+
+	if (!strcasecmp(name, GDF_PROP_SESSION_ID_NAME)) {
+		ast_copy_string(buf, df_get_session_id(pvt->session), len);
+	} else if (!strcasecmp(name, GDF_PROP_PROJECT_ID_NAME)) {
+		ast_copy_string(buf, df_get_project_id(pvt->session), len);
+	} else if (!strcasecmp(name, GDF_PROP_LANGUAGE_NAME)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_copy_string(buf, pvt->language, len);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, VAD_PROP_VOICE_THRESHOLD)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_build_string(&buf, &len, "%d", pvt->voice_threshold);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, VAD_PROP_VOICE_DURATION)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_build_string(&buf, &len, "%d", pvt->voice_minimum_duration);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, VAD_PROP_SILENCE_DURATION)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_build_string(&buf, &len, "%d", pvt->silence_minimum_duration);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_CONTINUOUS_STREAMING)) {
+		int max_idle;
+		ast_copy_string(buf, continuous_streaming_enabled(pvt, &max_idle) ? "yes" : "no", len);
+	} else if (!strcasecmp(name, GDF_PROP_BARGE_IN)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_copy_string(buf, barge_in_policy_to_string(pvt->barge_in_policy), len);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_BARGE_IN_DURATION)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_build_string(&buf, &len, "%d", pvt->barge_in_minimum_duration);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_NO_INPUT_TIMEOUT) || !strcasecmp(name, GDF_PROP_MAX_SPEECH_DURATION)) {
+		int no_input_timeout;
+		int max_speech_duration;
+		get_turn_timers(pvt, &no_input_timeout, &max_speech_duration);
+		ast_build_string(&buf, &len, "%d",
+			!strcasecmp(name, GDF_PROP_NO_INPUT_TIMEOUT) ? no_input_timeout : max_speech_duration);
+	} else if (!strcasecmp(name, GDF_PROP_ADMISSION)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_copy_string(buf, admission_result_names[pvt->last_admission_result], len);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (!strcasecmp(name, GDF_PROP_UPLINK_BYTES)) {
+		ast_mutex_lock(&pvt->lock);
+		ast_build_string(&buf, &len, "%" PRId64, pvt->uplink_bytes + pvt->turn_uplink_bytes);
+		ast_mutex_unlock(&pvt->lock);
+	} else {
+		ast_log(LOG_WARNING, "Unknown property '%s'\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+static int gdf_change_results_type(struct ast_speech *speech, enum ast_speech_results_type results_type)
+{
+	return 0;
+}
+
+static struct ast_speech_result *gdf_get_results(struct ast_speech *speech)
+{
+	/* speech is not locked */
+	struct gdf_pvt *pvt = speech->data;
+	struct gdf_cached_response *cached = pvt->cached_response;
+	int results = cached ? cached->result_count : pvt->turn_finished_locally ? 0 : df_get_result_count(pvt->session);
+	int synthesized = 0;
+	int i;
+	struct ast_speech_result *start = NULL;
+	struct ast_speech_result *end = NULL;
+	static int last_resort = 0;
+
+	struct dialogflow_result *fulfillment_text = NULL;
+	struct dialogflow_result *output_audio = NULL;
+
+	const char *audioFile = NULL;
+	struct gdf_local_result *local_result;
+	int64_t get_results_start = monotonic_us();
+
+	ast_mutex_lock(&pvt->lock);
+	AST_LIST_TRAVERSE(&pvt->local_results, local_result, list) {
+		struct ast_speech_result *new = ast_calloc(1, sizeof(*new));
+		if (new) {
+			new->text = ast_strdup(local_result->value);
+			new->score = local_result->score;
+			new->grammar = ast_strdup(local_result->slot);
+
+			if (end) {
+				AST_LIST_NEXT(end, list) = new;
+				end = new;
+			} else {
+				start = end = new;
+			}
+		}
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	for (i = 0; i < results; i++) {
+		/* this is a borrowed reference */
+		struct dialogflow_result *df_result = cached ? &cached->results[i] : df_get_result(pvt->session, i);
+		if (df_result) {
+			if (!strcasecmp(df_result->slot, "output_audio")) {
+				/* this is fine for now, but we really need a flag on the structure that says it's binary vs. text */
+				output_audio = df_result;
+			} else {
+				struct ast_speech_result *new = ast_calloc(1, sizeof(*new));
+				if (new) {
+					new->text = ast_strdup(df_result->value);
+					new->score = df_result->score;
+					new->grammar = ast_strdup(df_result->slot);
+
+					if (!strcasecmp(df_result->slot, "fulfillment_text")) {
+						fulfillment_text = df_result;
+					}
+				}
+
+				if (end) {
+					AST_LIST_NEXT(end, list) = new;
+					end = new;
+				} else {
+					start = end = new;
+				}
+			}
+		}
+	}
+
+	if (output_audio) { 
+		struct ast_speech_result *new;
+		char tmpFilename[128];
+		int fd;
+		ssize_t written;
+
+		ast_copy_string(tmpFilename, "/tmp/res_speech_gdfe_fulfillment_XXXXXX.wav", sizeof(tmpFilename));
+		fd = mkstemps(tmpFilename, 4);
+
+		if (fd < 0) {
+			ast_log(LOG_WARNING, "Unable to create temporary file for fulfillment message\n");
+			sprintf(tmpFilename, "/tmp/res_speech_gdfe_fulfillment_%d.wav", ast_atomic_fetchadd_int(&last_resort, 1));
+			fd = open(tmpFilename, O_WRONLY | O_CREAT, 0600);
+		}
+		written = write(fd, output_audio->value, output_audio->valueLen);
+		if (written < output_audio->valueLen) {
+			ast_log(LOG_WARNING, "Short write to temporary file for fulfillment message\n");
+		}
+		close(fd);
+
+		audioFile = tmpFilename;
+
+		new = ast_calloc(1, sizeof(*new));
+		if (new) {
+			new->text = ast_strdup(tmpFilename);
+			new->score = 100;
+			new->grammar = ast_strdup("fulfillment_audio");
+
+			if (end) {
+				AST_LIST_NEXT(end, list) = new;
+				end = new;
+			} else {
+				start = end = new;
+			}
+		} else {
+			ast_log(LOG_WARNING, "Unable to allocate speech result slot for synthesized fulfillment text\n");
+		}
+	} else if (fulfillment_text && !ast_strlen_zero(fulfillment_text->value)) {
+		char tmpFilename[128];
+		int fd;
+		struct gdf_config *cfg;
+		char *key;
+		char *tts_endpoint;
+		char *language;
+		int64_t tts_start;
+
+		cfg = gdf_get_config();
+		key = ast_strdupa(cfg->service_key);
+		tts_endpoint = ast_strlen_zero(cfg->tts_endpoint) ? NULL : ast_strdupa(cfg->tts_endpoint);
+		ao2_t_ref(cfg, -1, "done with creating session");
+
+		ast_mutex_lock(&pvt->lock);
+		language = ast_strdupa(pvt->language);
+		ast_mutex_unlock(&pvt->lock);
+
+		ast_copy_string(tmpFilename, "/tmp/res_speech_gdfe_fulfillment_XXXXXX.wav", sizeof(tmpFilename));
+		fd = mkstemps(tmpFilename, 4);
+
+		if (fd >= 0) {
+			close(fd);
+		} else {
+			ast_log(LOG_WARNING, "Unable to create temporary file for fulfillment message\n");
+			sprintf(tmpFilename, "/tmp/res_speech_gdfe_fulfillment_%d.wav", ast_atomic_fetchadd_int(&last_resort, 1));
+		}
+
+		audioFile = tmpFilename;
+
+		tts_start = monotonic_us();
+		gdf_pvt_count(pvt, STAT_TTS_CALLS, 1);
+		if (google_synth_speech(tts_endpoint, key, fulfillment_text->value, language, NULL, tmpFilename)) {
+			ast_log(LOG_WARNING, "Failed to synthesize fulfillment text to %s\n", tmpFilename);
+			record_session_error(pvt, STAT_ERRORS_TTS);
+		} else {
+			struct ast_speech_result *new = ast_calloc(1, sizeof(*new));
+			record_latency(pvt, LATENCY_TTS, tts_start);
+			synthesized = 1;
+			if (new) {
+				new->text = ast_strdup(tmpFilename);
+				new->score = 100;
+				new->grammar = ast_strdup("fulfillment_audio");
+
+				if (end) {
+					AST_LIST_NEXT(end, list) = new;
+					end = new;
+				} else {
+					start = end = new;
+				}
+			} else {
+				ast_log(LOG_WARNING, "Unable to allocate speech result slot for synthesized fulfillment text\n");
+			}
+		}
+	}
+
+	if (!ast_strlen_zero(audioFile)) {
+		if (!ast_strlen_zero(pvt->lastAudioResponse)) {
+			unlink(pvt->lastAudioResponse);
+		}
+		ast_string_field_set(pvt, lastAudioResponse, audioFile);
+	}
+
+	if (!cached && !pvt->turn_finished_locally && !ast_strlen_zero(pvt->cache_key)) {
+		store_cached_response(pvt, synthesized ? audioFile : NULL);
+		ast_string_field_set(pvt, cache_key, "");
+	}
+
+	record_latency(pvt, LATENCY_GET_RESULTS, get_results_start);
+	record_latency(pvt, LATENCY_TURN, pvt->turn_start_us);
+
+	return start;
+}
+
+static void gdf_config_destroy(void *o)
+{
+	struct gdf_config *conf = o;
+
+	ast_string_field_free_memory(conf);
+
+	if (conf->logical_agents) {
+		ao2_ref(conf->logical_agents, -1);
+	}
+}
+
+static struct gdf_config *gdf_get_config(void)
+{
+	struct gdf_config *cfg;
+#ifdef ASTERISK_13_OR_LATER
+	ao2_rdlock(config);
+#else
+	ao2_lock(config);
+#endif
+	cfg = ao2_find(config, NULL, 0);
+	ao2_unlock(config);
+	return cfg;
+}
+
+static void logical_agent_destructor(void *obj)
+{
+	struct gdf_logical_agent *agent = obj;
+
+	ast_free(agent->prefetch_events);
+	ast_free(agent->cache_events);
+	ast_free(agent->dtmf_event);
+	if (agent->interim_match_compiled) {
+		regfree(&agent->interim_match_regex);
+	}
+	ast_free(agent->interim_match);
+}
+
+static struct gdf_logical_agent *logical_agent_alloc(const char *name, const char *project_id, const char *service_key, const char *endpoint)
+{
+	size_t name_len = strlen(name);
+	size_t project_id_len = strlen(project_id);
+	size_t service_key_len = strlen(service_key);
+	size_t endpoint_len = strlen(endpoint);
+	size_t space_needed = name_len + 1 +
+							project_id_len + 1 +
+							service_key_len + 1 +
+							endpoint_len + 1;
+	struct gdf_logical_agent *agent;
+	
+	agent = ao2_alloc(space_needed + sizeof(struct gdf_logical_agent), logical_agent_destructor);
+	if (agent) {
+		ast_copy_string(agent->endpoint, endpoint, endpoint_len + 1);
+		agent->service_key = agent->endpoint + endpoint_len + 1;
+		ast_copy_string((char *)agent->service_key, service_key, service_key_len + 1);
+		agent->project_id = agent->service_key + service_key_len + 1;
+		ast_copy_string((char *)agent->project_id, project_id, project_id_len + 1);
+		agent->name = agent->project_id + project_id_len + 1;
+		ast_copy_string((char *)agent->name, name, name_len + 1);
+	}
+
+	return agent;
+}
+
+static int logical_agent_hash_callback(const void *obj, const int flags)
+{
+	const struct gdf_logical_agent *agent = obj;
+	return ast_str_case_hash(agent->name);
+}
+
+static int logical_agent_compare_callback(void *obj, void *other, int flags)
+{
+	const struct gdf_logical_agent *agentA = obj;
+	const struct gdf_logical_agent *agentB = other;
+	return (!strcasecmp(agentA->name, agentB->name) ? CMP_MATCH | CMP_STOP : 0);
+}
+
+static struct gdf_logical_agent *get_logical_agent_by_name(struct gdf_config *config, const char *name)
+{
+	struct gdf_logical_agent tmpAgent = { .name = name };
+	return ao2_find(config->logical_agents, &tmpAgent, OBJ_POINTER);
+}
+
+struct service_key_file {
+	time_t mtime;
+	off_t size;
+	ino_t inode;
+	char *contents;
+	char path[0];
+};
+
+/* service key files keyed by path, so a reload only re-reads files that changed */
+static struct ao2_container *service_key_files;
+
+static void service_key_file_destructor(void *obj)
+{
+	struct service_key_file *key_file = obj;
+	ast_free(key_file->contents);
+}
+
+static int service_key_file_hash_callback(const void *obj, const int flags)
+{
+	const struct service_key_file *key_file = obj;
+	return ast_str_hash((flags & OBJ_KEY) ? (const char *) obj : key_file->path);
+}
+
+static int service_key_file_compare_callback(void *obj, void *other, int flags)
+{
+	const struct service_key_file *key_fileA = obj;
+	const char *path = (flags & OBJ_KEY) ? (const char *) other : ((const struct service_key_file *) other)->path;
+	return (!strcmp(key_fileA->path, path) ? CMP_MATCH | CMP_STOP : 0);
+}
+
+struct reload_stats {
+	int agents_added;
+	int agents_changed;
+	int agents_removed;
+	int agents_unchanged;
+	int key_files_read;
+	int key_files_cached;
+};
+
+static void agent_runtime_destructor(void *obj)
+{
+	struct gdf_agent_runtime *runtime = obj;
+	ast_mutex_destroy(&runtime->lock);
+	ast_cond_destroy(&runtime->cond);
+}
+
+static int agent_runtime_hash_callback(const void *obj, const int flags)
+{
+	const struct gdf_agent_runtime *runtime = obj;
+	return ast_str_case_hash((flags & OBJ_KEY) ? (const char *) obj : runtime->name);
+}
+
+static int agent_runtime_compare_callback(void *obj, void *other, int flags)
+{
+	const struct gdf_agent_runtime *runtimeA = obj;
+	const char *name = (flags & OBJ_KEY) ? (const char *) other : ((const struct gdf_agent_runtime *) other)->name;
+	return (!strcasecmp(runtimeA->name, name) ? CMP_MATCH | CMP_STOP : 0);
+}
+
+static struct gdf_agent_runtime *get_agent_runtime(const char *name)
+{
+	struct gdf_agent_runtime *runtime;
+
+	ao2_lock(agent_runtimes);
+	runtime = ao2_find(agent_runtimes, name, OBJ_KEY | OBJ_NOLOCK);
+	if (!runtime) {
+		runtime = ao2_alloc(sizeof(*runtime) + strlen(name) + 1, agent_runtime_destructor);
+		if (runtime) {
+			ast_mutex_init(&runtime->lock);
+			ast_cond_init(&runtime->cond, NULL);
+			runtime->last_refill = ast_tvnow();
+			runtime->tokens = -1; /* filled on first use */
+			strcpy(runtime->name, name); /* safe */
+			runtime->stats = gdf_stats_agent_slot(name);
+			ao2_link_flags(agent_runtimes, runtime, OBJ_NOLOCK);
+		}
+	}
+	ao2_unlock(agent_runtimes);
+
+	return runtime;
+}
+
+static int64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_latency_sample(struct gdfe_stats_histogram *histogram, int64_t us)
+{
+	int max;
+	int value = us > INT_MAX ? INT_MAX : us;
+
+	ast_atomic_fetchadd_int(&histogram->counts[gdfe_stats_bucket(us)], 1);
+	ast_atomic_fetchadd_int(&histogram->total, 1);
+	do {
+		max = histogram->max_us;
+	} while (value > max && !__sync_bool_compare_and_swap(&histogram->max_us, max, value));
+}
+
+/*! \brief record the time since since_us for the pvt's agent, unless since_us was never reached */
+static void record_latency(struct gdf_pvt *pvt, enum gdf_latency_stage stage, int64_t since_us)
+{
+	struct gdf_agent_runtime *runtime;
+	int64_t elapsed_us;
+	char metric[32];
+
+	if (!since_us) {
+		return;
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	runtime = pvt->turn_runtime;
+	if (runtime) {
+		ao2_ref(runtime, +1);
+	}
+	ast_mutex_unlock(&pvt->lock);
+	if (!runtime) {
+		/* no agent to record it against */
+		return;
+	}
+
+	elapsed_us = monotonic_us() - since_us;
+	add_latency_sample(&runtime->latency[stage], elapsed_us);
+	if (runtime->stats) {
+		add_latency_sample(&runtime->stats->latency[stage], elapsed_us);
+	}
+
+	snprintf(metric, sizeof(metric), "latency.%s", latency_stage_names[stage]);
+	gdf_statsd(runtime->name, metric, AST_STATSD_TIMER, elapsed_us / 1000, 1);
+	ao2_ref(runtime, -1);
+}
+
+/*!
+ * \brief the start of an agent's metric names, gdfe.<agent>, or gdfe with no agent
+ * \return the length written to prefix
+ */
+static size_t format_statsd_prefix(char *prefix, size_t size, const char *agent)
+{
+	char *c;
+
+	if (ast_strlen_zero(agent)) {
+		return snprintf(prefix, size, "gdfe");
+	}
+	snprintf(prefix, size, "gdfe.%s", agent);
+	/* a dot would add a level to the path, and the rest are part of the StatsD line format */
+	for (c = prefix + 5; *c; c++) {
+		if (strchr(".:|@# ", *c)) {
+			*c = '_';
+		}
+	}
+	return c - prefix;
+}
+
+static void send_statsd(const char *name, const char *type, intmax_t value, int sampled)
+{
+	double rate = 1.0;
+
+	if (sampled) {
+		/* res_statsd drops the metric with this probability and tags the rest so the server scales them */
+		rate = __atomic_load_n(&statsd_sample_ppm, __ATOMIC_RELAXED) / 1000000.0;
+	}
+	ast_statsd_log_full(name, type, value, rate);
+}
+
+/*!
+ * \brief send a StatsD metric as gdfe.<agent>.<metric>, or gdfe.<metric> with no agent
+ * \param sampled whether the configured sample rate applies
+ */
+static void gdf_statsd(const char *agent, const char *metric, const char *type, intmax_t value, int sampled)
+{
+	char name[160];
+	size_t len;
+
+	if (!__atomic_load_n(&statsd_enabled, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	len = format_statsd_prefix(name, sizeof(name), agent);
+	if (len < sizeof(name)) {
+		snprintf(name + len, sizeof(name) - len, ".%s", metric);
+	}
+	send_statsd(name, type, value, sampled);
+}
+
+/*! \brief send a StatsD metric for the pvt's agent, named with the prefix gdf_start cached for the turn */
+static void gdf_pvt_statsd(struct gdf_pvt *pvt, const char *metric, const char *type, intmax_t value, int sampled)
+{
+	char name[160];
+
+	if (!__atomic_load_n(&statsd_enabled, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	if (ast_strlen_zero(pvt->statsd_prefix)) {
+		/* before the first turn */
+		size_t len = format_statsd_prefix(name, sizeof(name), S_OR(pvt->logical_agent_name, pvt->project_id));
+		if (len < sizeof(name)) {
+			snprintf(name + len, sizeof(name) - len, ".%s", metric);
+		}
+	} else {
+		snprintf(name, sizeof(name), "%s.%s", pvt->statsd_prefix, metric);
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	send_statsd(name, type, value, sampled);
+}
+
+/*! \brief add to a counter in this CPU's slot of the shared stats segment */
+static void gdf_stats_add(enum gdf_stat stat, int64_t value)
+{
+	int cpu;
+
+	if (!stats_segment || !value) {
+		return;
+	}
+	cpu = sched_getcpu();
+	/* still atomic, as the thread can be preempted by another on the same CPU */
+	__sync_fetch_and_add(&stats_segment->cpus[(cpu < 0 ? 0 : cpu) % GDFE_STATS_CPU_SLOTS].values[stat], value);
+}
+
+/*! \brief count something in the shared stats segment and, if enabled, StatsD */
+static void gdf_count(const char *agent, enum gdf_stat stat, int64_t value)
+{
+	gdf_stats_add(stat, value);
+	gdf_statsd(agent, stat_names[stat], AST_STATSD_COUNTER, value, 1);
+}
+
+static void gdf_pvt_count(struct gdf_pvt *pvt, enum gdf_stat stat, int64_t value)
+{
+	gdf_stats_add(stat, value);
+	gdf_pvt_statsd(pvt, stat_names[stat], AST_STATSD_COUNTER, value, 1);
+}
+
+/* runtime is locked */
+static void refill_agent_tokens(struct gdf_agent_runtime *runtime, double rate)
+{
+	struct timeval now = ast_tvnow();
+	double burst = MAX(rate, 1.0);
+
+	if (runtime->tokens < 0) {
+		runtime->tokens = burst;
+	} else {
+		runtime->tokens += rate * ast_tvdiff_ms(now, runtime->last_refill) / 1000.0;
+		if (runtime->tokens > burst) {
+			runtime->tokens = burst;
+		}
+	}
+	runtime->last_refill = now;
+}
+
+/*! \brief apply the logical agent's concurrency, rate and queueing limits before talking to DialogFlow
+ *
+ * On admission the session holds a concurrency slot until gdf_release_admission() is called.
+ * Unless block is set a request that has to queue returns ADMISSION_WAITING straight away,
+ * keeping its place in the queue until it is retried or gdf_release_admission() is called.
+ */
+static enum gdf_admission_result admit_request(struct gdf_pvt *pvt, int block)
+{
+	struct gdf_config *config;
+	struct gdf_agent_runtime *runtime;
+	enum gdf_admission_result result;
+	char *name;
+	int max_streams = 0;
+	double rate = 0;
+	int max_queue = 0;
+	int queue_timeout = 0;
+	int waited = 0;
+	int active_streams;
+	struct timeval deadline = { 0, };
+
+	ast_mutex_lock(&pvt->lock);
+	name = ast_strdupa(S_OR(pvt->logical_agent_name, pvt->project_id));
+	runtime = pvt->waiting_runtime;
+	pvt->waiting_runtime = NULL;
+	if (runtime) {
+		/* a retry, still holding its place in the queue */
+		waited = 1;
+		deadline = pvt->admission_deadline;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	if (!runtime) {
+		gdf_release_admission(pvt);
+	}
+
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent = get_logical_agent_by_name(config, name);
+		if (agent) {
+			max_streams = agent->max_concurrent_streams;
+			rate = agent->max_requests_per_second;
+			max_queue = agent->max_queue_length;
+			queue_timeout = agent->queue_timeout;
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
+	}
+
+	if (!runtime) {
+		runtime = get_agent_runtime(name);
+	}
+	if (!runtime) {
+		ast_log(LOG_WARNING, "Unable to allocate runtime state for agent '%s', admitting without limits\n", name);
+		return ADMISSION_ADMITTED;
+	}
+
+	ast_mutex_lock(&runtime->lock);
+	for (;;) {
+		struct timeval wait_until;
+		struct timespec ts;
+
+		if (rate > 0) {
+			refill_agent_tokens(runtime, rate);
+		}
+
+		if ((max_streams <= 0 || runtime->active_streams < max_streams) && (rate <= 0 || runtime->tokens >= 1.0)) {
+			if (rate > 0) {
+				runtime->tokens -= 1.0;
+			}
+			runtime->active_streams++;
+			runtime->admitted++;
+			if (waited) {
+				runtime->queued++;
+				result = ADMISSION_QUEUED;
+			} else {
+				result = ADMISSION_ADMITTED;
+			}
+			break;
+		}
+
+		if (!waited) {
+			if (runtime->waiting >= max_queue || queue_timeout <= 0) {
+				runtime->rejected++;
+				result = ADMISSION_REJECTED;
+				break;
+			}
+			runtime->waiting++;
+			waited = 1;
+			deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(queue_timeout, 1000));
+		}
+
+		if (ast_tvcmp(ast_tvnow(), deadline) >= 0) {
+			runtime->timed_out++;
+			result = ADMISSION_TIMEOUT;
+			break;
+		}
+
+		if (!block) {
+			result = ADMISSION_WAITING;
+			break;
+		}
+
+		wait_until = deadline;
+		if (rate > 0 && runtime->tokens < 1.0) {
+			/* wake up when the next token should be available */
+			struct timeval next_token = ast_tvadd(runtime->last_refill,
+				ast_samp2tv((unsigned int) ((1.0 - runtime->tokens) * 1000.0 / rate) + 1, 1000));
+			if (ast_tvcmp(next_token, wait_until) < 0) {
+				wait_until = next_token;
+			}
+		}
+		ts.tv_sec = wait_until.tv_sec;
+		ts.tv_nsec = wait_until.tv_usec * 1000;
+		ast_cond_timedwait(&runtime->cond, &runtime->lock, &ts);
+	}
+	if (waited && result != ADMISSION_WAITING) {
+		runtime->waiting--;
+	}
+	active_streams = runtime->active_streams;
+	ast_mutex_unlock(&runtime->lock);
+
+	if (result == ADMISSION_WAITING) {
+		/* the runtime reference goes with the place in the queue */
+		ast_mutex_lock(&pvt->lock);
+		pvt->last_admission_result = result;
+		pvt->waiting_runtime = runtime;
+		pvt->admission_deadline = deadline;
+		ast_mutex_unlock(&pvt->lock);
+		return result;
+	}
+
+	gdf_statsd(name, "streams.active", AST_STATSD_GAUGE, active_streams, 0);
+	if (result == ADMISSION_ADMITTED || result == ADMISSION_QUEUED) {
+		gdf_stats_add(STAT_STREAMS_ACTIVE, 1);
+	}
+	if (result == ADMISSION_QUEUED) {
+		gdf_count(name, STAT_ADMISSION_QUEUED, 1);
+	} else if (result == ADMISSION_REJECTED) {
+		gdf_count(name, STAT_ADMISSION_REJECTED, 1);
+	} else if (result == ADMISSION_TIMEOUT) {
+		gdf_count(name, STAT_ADMISSION_TIMEOUT, 1);
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	pvt->last_admission_result = result;
+	if (result == ADMISSION_ADMITTED || result == ADMISSION_QUEUED) {
+		pvt->admitted_runtime = runtime;
+		runtime = NULL;
+	}
+	ast_mutex_unlock(&pvt->lock);
+
+	if (runtime) {
+		ao2_ref(runtime, -1);
+	}
+
+	if (result != ADMISSION_ADMITTED) {
+		struct dialogflow_log_data log_data[] = {
+			{ "logical_agent_name", name },
+			{ "result", admission_result_names[result] }
+		};
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_SESSION, "admission", ARRAY_LEN(log_data), log_data);
+	}
+
+	return result;
+}
+
+/*! \brief admit a request, waiting in the queue if need be -- not for use on the media path */
+static enum gdf_admission_result gdf_admit_request(struct gdf_pvt *pvt)
+{
+	return admit_request(pvt, 1);
+}
+
+/*! \brief admit a request without blocking, for gdf_write; ADMISSION_WAITING means try again on a later frame */
+static enum gdf_admission_result gdf_try_admit_request(struct gdf_pvt *pvt)
+{
+	return admit_request(pvt, 0);
+}
+
+/*! \brief give back the session's concurrency slot, or its place in the queue if it was still waiting */
+static void gdf_release_admission(struct gdf_pvt *pvt)
+{
+	struct gdf_agent_runtime *runtime;
+	struct gdf_agent_runtime *waiting;
+
+	ast_mutex_lock(&pvt->lock);
+	runtime = pvt->admitted_runtime;
+	pvt->admitted_runtime = NULL;
+	waiting = pvt->waiting_runtime;
+	pvt->waiting_runtime = NULL;
+	ast_mutex_unlock(&pvt->lock);
+
+	if (waiting) {
+		ast_mutex_lock(&waiting->lock);
+		waiting->waiting--;
+		ast_mutex_unlock(&waiting->lock);
+		ao2_ref(waiting, -1);
+	}
+
+	if (runtime) {
+		int active_streams;
+		ast_mutex_lock(&runtime->lock);
+		active_streams = --runtime->active_streams;
+		ast_cond_signal(&runtime->cond);
+		ast_mutex_unlock(&runtime->lock);
+		gdf_statsd(runtime->name, "streams.active", AST_STATSD_GAUGE, active_streams, 0);
+		gdf_stats_add(STAT_STREAMS_ACTIVE, -1);
+		ao2_ref(runtime, -1);
+	}
+}
+
+static void first_endpoint(const char *endpoints, char *buf, size_t len)
+{
+	char *list = ast_strdupa(S_OR(endpoints, ""));
+	char *first = strsep(&list, ",");
+	ast_copy_string(buf, ast_strip(first), len);
+}
+
+/* runtime is locked -- keeps the health of endpoints that are still listed */
+static void sync_runtime_endpoints(struct gdf_agent_runtime *runtime, const char *endpoints)
+{
+	struct gdf_endpoint_health updated[GDF_MAX_ENDPOINTS];
+	int count = 0;
+	char *list = ast_strdupa(S_OR(endpoints, ""));
+	char *endpoint;
+	int i;
+
+	while ((endpoint = strsep(&list, ",")) && count < GDF_MAX_ENDPOINTS) {
+		endpoint = ast_strip(endpoint);
+		if (ast_strlen_zero(endpoint) && count > 0) {
+			continue;
+		}
+		memset(&updated[count], 0, sizeof(updated[count]));
+		for (i = 0; i < runtime->endpoint_count; i++) {
+			if (!strcmp(runtime->endpoints[i].endpoint, endpoint)) {
+				updated[count] = runtime->endpoints[i];
+				break;
+			}
+		}
+		ast_copy_string(updated[count].endpoint, endpoint, sizeof(updated[count].endpoint));
+		count++;
+	}
+
+	memcpy(runtime->endpoints, updated, sizeof(updated[0]) * count);
+	runtime->endpoint_count = count;
+}
+
+/*! \brief choose the healthy endpoint with the lowest latency score, preferring list order on ties
+ *
+ * Ejected endpoints are skipped until their timeout passes, at which point a single session is
+ * routed to them as a probe. If everything is ejected the one due back soonest is used.
+ * Runtime is locked.
+ */
+static int choose_endpoint(struct gdf_agent_runtime *runtime, int exclude, int breaker_timeout)
+{
+	struct timeval now = ast_tvnow();
+	int best = -1;
+	int fallback = -1;
+	int i;
+
+	for (i = 0; i < runtime->endpoint_count; i++) {
+		struct gdf_endpoint_health *health = &runtime->endpoints[i];
+
+		if (i == exclude) {
+			continue;
+		}
+		if (health->ejected) {
+			if (fallback < 0 || ast_tvcmp(health->ejected_until, runtime->endpoints[fallback].ejected_until) < 0) {
+				fallback = i;
+			}
+			if (ast_tvcmp(now, health->ejected_until) >= 0 && (!health->probe_in_flight ||
+				ast_tvdiff_ms(now, health->probe_started) > breaker_timeout)) {
+				health->probe_in_flight = 1;
+				health->probe_started = now;
+				return i;
+			}
+			continue;
+		}
+		if (best < 0 || health->latency_score < runtime->endpoints[best].latency_score) {
+			best = i;
+		}
+	}
+
+	return best >= 0 ? best : fallback;
+}
+
+static void get_agent_routing_settings(const char *name, int *breaker_errors, int *breaker_timeout, int *hedge_events, int *hedge_min_delay)
+{
+	struct gdf_config *config;
+
+	*breaker_errors = 5;
+	*breaker_timeout = 30000;
+	*hedge_events = 0;
+	*hedge_min_delay = 500;
+
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent = get_logical_agent_by_name(config, name);
+		if (agent) {
+			*breaker_errors = agent->circuit_breaker_errors;
+			*breaker_timeout = agent->circuit_breaker_timeout;
+			*hedge_events = agent->hedge_events;
+			*hedge_min_delay = agent->hedge_min_delay;
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
+	}
+}
+
+static int get_agent_request_timeout(const char *name)
+{
+	struct gdf_config *config;
+	int request_timeout = 0;
+
+	config = gdf_get_config();
+	if (config) {
+		struct gdf_logical_agent *agent = get_logical_agent_by_name(config, name);
+		if (agent) {
+			request_timeout = agent->request_timeout;
+			ao2_ref(agent, -1);
+		}
+		ao2_ref(config, -1);
+	}
+
+	return request_timeout;
+}
+
+/* returns non-zero if the session was moved to a different endpoint */
+static int route_session_endpoint(struct gdf_pvt *pvt, int only_if_ejected)
+{
+	struct gdf_agent_runtime *runtime;
+	char *name;
+	char *endpoints;
+	char *active_endpoint;
+	char chosen[GDF_ENDPOINT_LEN];
+	int breaker_errors, breaker_timeout, hedge_events, hedge_min_delay;
+	int i;
+
+	ast_mutex_lock(&pvt->lock);
+	name = ast_strdupa(S_OR(pvt->logical_agent_name, pvt->project_id));
+	endpoints = ast_strdupa(S_OR(pvt->endpoint, ""));
+	active_endpoint = ast_strdupa(S_OR(pvt->active_endpoint, ""));
+	ast_mutex_unlock(&pvt->lock);
+
+	if (only_if_ejected && (ast_strlen_zero(name) || !strchr(endpoints, ','))) {
+		return 0;
+	}
+
+	first_endpoint(endpoints, chosen, sizeof(chosen));
+
+	get_agent_routing_settings(name, &breaker_errors, &breaker_timeout, &hedge_events, &hedge_min_delay);
+
+	runtime = get_agent_runtime(name);
+	if (runtime) {
+		ast_mutex_lock(&runtime->lock);
+		sync_runtime_endpoints(runtime, endpoints);
+		if (only_if_ejected) {
+			for (i = 0; i < runtime->endpoint_count; i++) {
+				if (!strcmp(runtime->endpoints[i].endpoint, active_endpoint)) {
+					break;
+				}
+			}
+			if (i < runtime->endpoint_count && !runtime->endpoints[i].ejected) {
+				ast_mutex_unlock(&runtime->lock);
+				ao2_ref(runtime, -1);
+				return 0;
+			}
+		}
+		i = choose_endpoint(runtime, -1, breaker_timeout);
+		if (i >= 0) {
+			ast_copy_string(chosen, runtime->endpoints[i].endpoint, sizeof(chosen));
+		}
+		ast_mutex_unlock(&runtime->lock);
+		ao2_ref(runtime, -1);
+	}
+
+	if (strcmp(chosen, active_endpoint)) {
+		ast_log(LOG_DEBUG, "Routing %s for agent '%s' to endpoint '%s'\n", pvt->session_id, name, chosen);
+	}
+
+	ast_mutex_lock(&pvt->lock);
+	ast_string_field_set(pvt, active_endpoint, chosen);
+	ast_mutex_unlock(&pvt->lock);
+	df_set_endpoint(pvt->session, chosen);
+
+	return strcmp(chosen, active_endpoint) != 0;
+}
+
+static int compare_latency_samples(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/* health is locked by the caller; returns -1 if there are too few samples to tell */
+static int endpoint_p95_latency(const struct gdf_endpoint_health *health)
+{
+	int samples[GDF_LATENCY_SAMPLES];
+	int count = MIN(health->latency_sample_count, GDF_LATENCY_SAMPLES);
+
+	if (count < 8) {
+		return -1;
+	}
+
+	memcpy(samples, health->latency_samples, sizeof(int) * count);
+	qsort(samples, count, sizeof(int), compare_latency_samples);
+	return samples[(count * 95 + 99) / 100 - 1];
+}
+
+/*! \brief update latency scoring and the circuit breaker for an endpoint
+ * \param latency_ms the request latency, or -1 if the outcome carries no useful latency (e.g. a stream)
+ */
+static void record_endpoint_health(const char *name, const char *endpoint, int64_t latency_ms, int success)
+{
+	struct gdf_agent_runtime *runtime;
+	int breaker_errors, breaker_timeout, hedge_events, hedge_min_delay;
+	int i;
+
+	if (ast_strlen_zero(name)) {
+		return;
+	}
+
+	get_agent_routing_settings(name, &breaker_errors, &breaker_timeout, &hedge_events, &hedge_min_delay);
+
+	runtime = get_agent_runtime(name);
+	if (!runtime) {
+		return;
+	}
+
+	ast_mutex_lock(&runtime->lock);
+	for (i = 0; i < runtime->endpoint_count; i++) {
+		struct gdf_endpoint_health *health = &runtime->endpoints[i];
+
+		if (strcmp(health->endpoint, endpoint)) {
+			continue;
+		}
+
+		health->requests++;
+		if (success) {
+			if (latency_ms >= 0) {
+				health->latency_samples[health->latency_sample_count % GDF_LATENCY_SAMPLES] = (int) latency_ms;
+				health->latency_sample_count++;
+				health->latency_score = health->latency_score > 0 ?
+					(0.8 * health->latency_score + 0.2 * latency_ms) : latency_ms;
+			}
+			health->consecutive_errors = 0;
+			if (health->ejected) {
+				ast_log(LOG_NOTICE, "Endpoint '%s' for agent '%s' passed its probe, returning it to service\n", endpoint, name);
+				health->ejected = 0;
+			}
+			health->probe_in_flight = 0;
+		} else {
+			health->errors++;
+			health->consecutive_errors++;
+			if (health->ejected) {
+				/* failed probe -- stay out for another period */
+				health->ejected_until = ast_tvadd(ast_tvnow(), ast_samp2tv(breaker_timeout, 1000));
+				health->probe_in_flight = 0;
+			} else if (breaker_errors > 0 && health->consecutive_errors >= breaker_errors) {
+				ast_log(LOG_WARNING, "Ejecting endpoint '%s' for agent '%s' after %d consecutive errors\n",
+					endpoint, name, health->consecutive_errors);
+				health->ejected = 1;
+				health->ejections++;
+				health->ejected_until = ast_tvadd(ast_tvnow(), ast_samp2tv(breaker_timeout, 1000));
+				health->probe_in_flight = 0;
+			}
+		}
+		break;
+	}
+	ast_mutex_unlock(&runtime->lock);
+	ao2_ref(runtime, -1);
+}
+
+static void record_endpoint_result(struct gdf_pvt *pvt, int64_t latency_ms, int success)
+{
+	char *name;
+	char *endpoint;
+
+	ast_mutex_lock(&pvt->lock);
+	name = ast_strdupa(S_OR(pvt->logical_agent_name, pvt->project_id));
+	endpoint = ast_strdupa(S_OR(pvt->active_endpoint, ""));
+	ast_mutex_unlock(&pvt->lock);
+
+	record_endpoint_health(name, endpoint, latency_ms, success);
+}
+
+static struct dialogflow_session *create_hedge_session(struct gdf_pvt *pvt, const char *endpoint)
+{
+	struct dialogflow_session *session = df_create_session(pvt);
+
+	if (session) {
+		ast_mutex_lock(&pvt->lock);
+		df_set_auth_key(session, pvt->service_key);
+		df_set_project_id(session, pvt->project_id);
+		df_set_session_id(session, pvt->session_id);
+		ast_mutex_unlock(&pvt->lock);
+		df_set_endpoint(session, endpoint);
+	}
+
+	return session;
+}
+
+struct hedged_attempt {
+	struct dialogflow_session *session;
+	char endpoint[GDF_ENDPOINT_LEN];
+	int done;
+	int result;
+	int abandoned; /* it closes its session and releases the pvt when it finishes */
+};
+
+/* an event request with a deadline or hedging; attempts run on the event pool and timers on event_sched */
+struct hedged_event_request {
+	ast_mutex_t lock;
+	struct gdf_async_query *query; /* finished once, by whichever of the attempts or the deadline decides */
+	struct gdf_pvt *pvt;
+	char *event;
+	char *language;
+	char *agent_name;
+	char active_endpoint[GDF_ENDPOINT_LEN];
+	int breaker_timeout;
+	int hedge_delay; /* ms, -1 for no hedging */
+	int request_timeout; /* ms, 0 for no deadline */
+	int hedge_timer; /* scheduler ids, -1 once run or deleted */
+	int deadline_timer;
+	int decided;
+	int winner; /* index of the first attempt to succeed, -1 if none did */
+	int deadline_exceeded;
+	int attempt_count;
+	struct hedged_attempt attempts[2];
+};
+
+/* which sessions to close and how many attempts were abandoned when the request was decided */
+struct hedged_outcome {
+	int close_now[2];
+	int abandoned;
+};
+
+static struct ast_sched_context *event_sched;
+
+static void hedged_event_request_destructor(void *obj)
+{
+	struct hedged_event_request *request = obj;
+	ast_free(request->event);
+	ast_free(request->language);
+	ast_free(request->agent_name);
+	ast_mutex_destroy(&request->lock);
+}
+
+/* request is locked; every attempt still running is abandoned, and finished losers are closed */
+static void decide_hedged_request(struct hedged_event_request *request, int winner, int deadline_exceeded,
+	struct hedged_outcome *outcome)
+{
+	int i;
+
+	request->decided = 1;
+	request->winner = winner;
+	request->deadline_exceeded = deadline_exceeded;
+	memset(outcome, 0, sizeof(*outcome));
+
+	for (i = 0; i < request->attempt_count; i++) {
+		if (i == winner || (i == 0 && winner < 0 && !deadline_exceeded)) {
+			/* the session the pvt keeps */
+			continue;
+		}
+		if (i == 0 && winner < 0 && request->attempts[0].done) {
+			/* the deadline passed with the pvt's own session already free */
+			continue;
+		}
+		if (request->attempts[i].done) {
+			outcome->close_now[i] = 1;
+		} else {
+			request->attempts[i].abandoned = 1;
+			outcome->abandoned++;
+		}
+	}
+}
+
+static void cancel_hedged_timer(struct hedged_event_request *request, int *timer)
+{
+	int id;
+
+	ast_mutex_lock(&request->lock);
+	id = *timer;
+	*timer = -1;
+	ast_mutex_unlock(&request->lock);
+
+	/* a timer that has already fired drops its own reference */
+	if (id > -1 && !ast_sched_del(event_sched, id)) {
+		ao2_ref(request, -1);
+	}
+}
+
+/*! \brief apply the decision to the pvt and deliver the result -- once per request, on the pool or the scheduler thread */
+static void deliver_hedged_request(struct hedged_event_request *request, struct hedged_outcome *outcome)
+{
+	struct gdf_pvt *pvt = request->pvt;
+	int winner = request->winner;
+	int i;
+
+	cancel_hedged_timer(request, &request->hedge_timer);
+	cancel_hedged_timer(request, &request->deadline_timer);
+
+	if (outcome->abandoned) {
+		ast_mutex_lock(&pvt->lock);
+		pvt->pending_requests += outcome->abandoned;
+		ast_mutex_unlock(&pvt->lock);
+	}
+
+	/* swap the pvt's session before closing the one it replaces, so nothing reads a closed session */
+	if (winner > 0) {
+		ast_mutex_lock(&pvt->lock);
+		pvt->session = request->attempts[winner].session;
+		ast_string_field_set(pvt, active_endpoint, request->attempts[winner].endpoint);
+		ast_mutex_unlock(&pvt->lock);
+	} else if (request->deadline_exceeded && request->attempts[0].abandoned) {
+		/* the abandoned request keeps the old session until it finishes, so the pvt needs a new one */
+		struct dialogflow_session *session = create_hedge_session(pvt, request->active_endpoint);
+
+		if (!session) {
+			ast_log(LOG_ERROR, "Unable to replace DialogFlow session for %s after deadline\n", pvt->session_id);
+		}
+		ast_mutex_lock(&pvt->lock);
+		pvt->session = session;
+		ast_mutex_unlock(&pvt->lock);
+	}
+
+	for (i = 0; i < ARRAY_LEN(outcome->close_now); i++) {
+		if (outcome->close_now[i] && request->attempts[i].session) {
+			df_close_session(request->attempts[i].session);
+		}
+	}
+
+	if (winner > 0) {
+		struct dialogflow_log_data log_data[] = {
+			{ "event", request->event },
+			{ "endpoint", request->attempts[winner].endpoint }
+		};
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_DIALOGFLOW, "hedge_won", ARRAY_LEN(log_data), log_data);
+	} else if (request->deadline_exceeded) {
+		char timeout[11];
+		struct dialogflow_log_data log_data[] = {
+			{ "event", request->event },
+			{ "timeout_ms", timeout }
+		};
+
+		sprintf(timeout, "%d", request->request_timeout);
+		gdf_log_call_event(pvt, CALL_LOG_TYPE_DIALOGFLOW, "deadline_exceeded", ARRAY_LEN(log_data), log_data);
+		ast_log(LOG_WARNING, "Event %s on %s exceeded its %dms deadline\n", request->event, pvt->session_id,
+			request->request_timeout);
+		ast_atomic_fetchadd_int(&engine_stats.deadlines_exceeded, 1);
+		gdf_stats_add(STAT_DEADLINES_EXCEEDED, 1);
+	}
+	ast_atomic_fetchadd_int(&engine_stats.abandoned_rpcs, outcome->abandoned);
+	gdf_stats_add(STAT_ABANDONED_RPCS, outcome->abandoned);
+
+	finish_async_query(request->query, winner >= 0 ? 0 : -1);
+}
+
+/*! \brief send one attempt of a hedged request, on the event pool thread that calls it */
+static void run_hedged_attempt(struct hedged_event_request *request, int index)
+{
+	struct hedged_attempt *attempt = &request->attempts[index];
+	struct hedged_outcome outcome;
+	struct timeval start = ast_tvnow();
+	int close_session;
+	int deliver = 0;
+	int i;
+	int res;
+
+	res = df_recognize_event(attempt->session, request->event, request->language, 0);
+	record_endpoint_health(request->agent_name, attempt->endpoint, ast_tvdiff_ms(ast_tvnow(), start), !res);
+
+	ast_mutex_lock(&request->lock);
+	attempt->done = 1;
+	attempt->result = res;
+	close_session = attempt->abandoned;
+	if (!request->decided) {
+		if (!res) {
+			decide_hedged_request(request, index, 0, &outcome);
+			deliver = 1;
+		} else {
+			for (i = 0; i < request->attempt_count && request->attempts[i].done; i++) {
+			}
+			/* the first attempt failing before the hedge timer means there is no hedge */
+			if (i == request->attempt_count) {
+				decide_hedged_request(request, -1, 0, &outcome);
+				deliver = 1;
+			}
+		}
+	}
+	ast_mutex_unlock(&request->lock);
+
+	if (deliver) {
+		deliver_hedged_request(request, &outcome);
+	} else if (close_session) {
+		/* the pvt may have been freed, only its pending count is left to release */
+		df_close_session(attempt->session);
+		gdf_pvt_release_pending(request->pvt);
+	}
+}
+
+static int hedge_attempt_task(void *data)
+{
+	struct hedged_event_request *request = data;
+	struct hedged_attempt *attempt = &request->attempts[1];
+	struct dialogflow_session *session = NULL;
+	int abandoned;
+
+	ast_mutex_lock(&request->lock);
+	abandoned = attempt->abandoned;
+	ast_mutex_unlock(&request->lock);
+
+	if (!abandoned) {
+		session = create_hedge_session(request->pvt, attempt->endpoint);
+	}
+
+	ast_mutex_lock(&request->lock);
+	attempt->session = session;
+	abandoned = attempt->abandoned;
+	ast_mutex_unlock(&request->lock);
+
+	if (abandoned) {
+		/* decided while waiting for a pool thread */
+		if (session) {
+			df_close_session(session);
+		}
+		gdf_pvt_release_pending(request->pvt);
+	} else if (!session) {
+		struct hedged_outcome outcome;
+		int deliver = 0;
+
+		ast_log(LOG_WARNING, "Unable to create hedge session for %s\n", request->pvt->session_id);
+		ast_mutex_lock(&request->lock);
+		attempt->done = 1;
+		attempt->result = -1;
+		if (!request->decided && request->attempts[0].done) {
+			decide_hedged_request(request, -1, 0, &outcome);
+			deliver = 1;
+		}
+		ast_mutex_unlock(&request->lock);
+		if (deliver) {
+			deliver_hedged_request(request, &outcome);
+		}
+	} else {
+		ast_log(LOG_DEBUG, "Hedging event %s on %s to endpoint '%s' after %dms\n", request->event,
+			request->pvt->session_id, attempt->endpoint, request->hedge_delay);
+		run_hedged_attempt(request, 1);
+	}
+
+	ao2_ref(request, -1);
+	return 0;
+}
+
+/* scheduler thread: the first attempt is slow, so send the event to the next best endpoint too */
+static int hedge_timer_fired(const void *data)
+{
+	struct hedged_event_request *request = (struct hedged_event_request *) data;
+	struct gdf_agent_runtime *runtime;
+	char hedge_endpoint[GDF_ENDPOINT_LEN] = "";
+	int i;
+
+	ast_mutex_lock(&request->lock);
+	request->hedge_timer = -1;
+	if (request->decided || request->attempts[0].done) {
+		ast_mutex_unlock(&request->lock);
+		ao2_ref(request, -1);
+		return 0;
+	}
+	ast_mutex_unlock(&request->lock);
+
+	if ((runtime = get_agent_runtime(request->agent_name))) {
+		ast_mutex_lock(&runtime->lock);
+		for (i = 0; i < runtime->endpoint_count; i++) {
+			if (!strcmp(runtime->endpoints[i].endpoint, request->active_endpoint)) {
+				break;
+			}
+		}
+		i = choose_endpoint(runtime, i, request->breaker_timeout);
+		if (i >= 0) {
+			ast_copy_string(hedge_endpoint, runtime->endpoints[i].endpoint, sizeof(hedge_endpoint));
+			runtime->endpoints[i].hedges++;
+		}
+		ast_mutex_unlock(&runtime->lock);
+		ao2_ref(runtime, -1);
+	}
+
+	if (ast_strlen_zero(hedge_endpoint)) {
+		ao2_ref(request, -1);
+		return 0;
+	}
+
+	ast_mutex_lock(&request->lock);
+	if (request->decided || request->attempts[0].done) {
+		ast_mutex_unlock(&request->lock);
+		ao2_ref(request, -1);
+		return 0;
+	}
+	ast_copy_string(request->attempts[1].endpoint, hedge_endpoint, sizeof(request->attempts[1].endpoint));
+	request->attempt_count = 2;
+	ast_mutex_unlock(&request->lock);
+
+	/* the timer's reference passes to the attempt */
+	if (ast_threadpool_push(event_pool, hedge_attempt_task, request)) {
+		ast_mutex_lock(&request->lock);
+		request->attempt_count = 1;
+		ast_mutex_unlock(&request->lock);
+		ao2_ref(request, -1);
+	}
+	return 0;
+}
+
+/*
+ * scheduler thread: the deadline has passed, so the request is decided here rather than queued
+ * behind the very pool threads that are stuck waiting on DialogFlow
+ */
+static int deadline_timer_fired(const void *data)
+{
+	struct hedged_event_request *request = (struct hedged_event_request *) data;
+	struct hedged_outcome outcome;
+	int deliver = 0;
+
+	ast_mutex_lock(&request->lock);
+	request->deadline_timer = -1;
+	if (!request->decided) {
+		decide_hedged_request(request, -1, 1, &outcome);
+		deliver = 1;
+	}
+	ast_mutex_unlock(&request->lock);
+
+	if (deliver) {
+		deliver_hedged_request(request, &outcome);
+	}
+
+	ao2_ref(request, -1);
+	return 0;
+}
+
+/*! \brief send an admitted event request, with an optional deadline and hedging onto a second endpoint -- runs on the event pool
+ *
+ * Without a deadline or hedging (or without a second endpoint to hedge to) this is df_recognize_event()
+ * plus latency scoring on the calling thread. Otherwise the first attempt still runs here, but timers on
+ * event_sched decide the rest: with hedging, if the first attempt has not answered within the endpoint's
+ * p95 latency (no sooner than hedge_min_delay) the same event is sent from another pool thread on the next
+ * best endpoint, and whichever succeeds first becomes the session's DialogFlow session. If the deadline
+ * passes first every outstanding attempt is abandoned and the pvt is given a fresh session. libdfegrpc
+ * cannot cancel a request, so an abandoned attempt runs to completion and its result is discarded.
+ * The result goes to finish_async_query() once, from whichever thread decides it.
+ */
+static void gdf_recognize_event(struct gdf_async_query *query)
+{
+	struct gdf_pvt *pvt = query->pvt;
+	struct hedged_event_request *request;
+	struct gdf_agent_runtime *runtime;
+	char *name;
+	char *active_endpoint;
+	int breaker_errors, breaker_timeout, hedge_events, hedge_min_delay;
+	int request_timeout;
+	int hedge_delay = -1;
+	struct timeval start;
+	int i;
+	int res;
+
+	ast_mutex_lock(&pvt->lock);
+	name = ast_strdupa(S_OR(pvt->logical_agent_name, pvt->project_id));
+	active_endpoint = ast_strdupa(S_OR(pvt->active_endpoint, ""));
+	ast_mutex_unlock(&pvt->lock);
+
+	get_agent_routing_settings(name, &breaker_errors, &breaker_timeout, &hedge_events, &hedge_min_delay);
+	request_timeout = get_agent_request_timeout(name);
+
+	if (hedge_events && (runtime = get_agent_runtime(name))) {
+		ast_mutex_lock(&runtime->lock);
+		for (i = 0; i < runtime->endpoint_count; i++) {
+			if (!strcmp(runtime->endpoints[i].endpoint, active_endpoint)) {
+				hedge_delay = MAX(endpoint_p95_latency(&runtime->endpoints[i]), hedge_min_delay);
+				break;
+			}
+		}
+		if (i >= runtime->endpoint_count || runtime->endpoint_count < 2) {
+			hedge_delay = -1;
+		}
+		ast_mutex_unlock(&runtime->lock);
+		ao2_ref(runtime, -1);
+	}
+
+	request = NULL;
+	if ((hedge_delay >= 0 || request_timeout > 0) && event_sched) {
+		request = ao2_alloc(sizeof(*request), hedged_event_request_destructor);
+	}
+	if (request) {
+		ast_mutex_init(&request->lock);
+		request->query = query;
+		request->pvt = pvt;
+		request->event = ast_strdup(query->event);
+		request->language = ast_strdup(query->language);
+		request->agent_name = ast_strdup(name);
+		ast_copy_string(request->active_endpoint, active_endpoint, sizeof(request->active_endpoint));
+		request->breaker_timeout = breaker_timeout;
+		request->hedge_delay = hedge_delay;
+		request->request_timeout = request_timeout;
+		request->hedge_timer = -1;
+		request->deadline_timer = -1;
+		request->winner = -1;
+		request->attempt_count = 1;
+		request->attempts[0].session = pvt->session;
+		ast_copy_string(request->attempts[0].endpoint, active_endpoint, sizeof(request->attempts[0].endpoint));
+		if (!request->event || !request->language || !request->agent_name) {
+			ao2_ref(request, -1);
+			request = NULL;
+		}
+	}
+
+	if (!request) {
+		start = ast_tvnow();
+		res = df_recognize_event(pvt->session, query->event, query->language, 0);
+		record_endpoint_result(pvt, ast_tvdiff_ms(ast_tvnow(), start), !res);
+		finish_async_query(query, res);
+		return;
+	}
+
+	/* each timer holds a reference, dropped when it fires or is deleted */
+	ast_mutex_lock(&request->lock);
+	if (hedge_delay >= 0) {
+		ao2_ref(request, +1);
+		request->hedge_timer = ast_sched_add(event_sched, hedge_delay, hedge_timer_fired, request);
+		if (request->hedge_timer < 0) {
+			ao2_ref(request, -1);
+		}
+	}
+	if (request_timeout > 0) {
+		ao2_ref(request, +1);
+		request->deadline_timer = ast_sched_add(event_sched, request_timeout, deadline_timer_fired, request);
+		if (request->deadline_timer < 0) {
+			ao2_ref(request, -1);
+		}
+	}
+	ast_mutex_unlock(&request->lock);
+
+	run_hedged_attempt(request, 0);
+	ao2_ref(request, -1);
+}
+
+static struct ast_str *load_service_key(const char *val, struct reload_stats *stats)
+{
+	struct ast_str *buffer = ast_str_create(3 * 1024); /* big enough for the typical key size */
+	if (!buffer) {
+		ast_log(LOG_WARNING, "Memory allocation failure allocating ast_str for loading service key\n");
+		return NULL;
+	}
+
+	if (strchr(val, '{')) {
+		ast_str_set(&buffer, 0, val);
+	} else {
+		struct service_key_file *key_file;
+		struct stat st;
+		FILE *f;
+
+		if (stat(val, &st)) {
+			ast_log(LOG_ERROR, "Unable to stat service key file %s -- %d\n", val, errno);
+			return buffer;
+		}
+
+		key_file = ao2_find(service_key_files, val, OBJ_KEY);
+		if (key_file && key_file->mtime == st.st_mtime && key_file->size == st.st_size && key_file->inode == st.st_ino) {
+			ast_log(LOG_DEBUG, "Service key data from %s is unchanged\n", val);
+			ast_str_set(&buffer, 0, "%s", key_file->contents);
+			ao2_ref(key_file, -1);
+			if (stats) {
+				stats->key_files_cached++;
+			}
+			return buffer;
+		}
+		if (key_file) {
+			ao2_unlink(service_key_files, key_file);
+			ao2_ref(key_file, -1);
+		}
+
+		ast_log(LOG_DEBUG, "Loading service key data from %s\n", val);
+		f = fopen(val, "r");
+		if (f) {
+			char readbuffer[512];
+			size_t read = fread(readbuffer, sizeof(char), sizeof(readbuffer), f);
+			while (read > 0) {
+				ast_str_append_substr(&buffer, 0, readbuffer, read);
+				read = fread(readbuffer, sizeof(char), sizeof(readbuffer), f);
+			}
+			if (ferror(f)) {
+				ast_log(LOG_WARNING, "Error reading %s -- %d\n", val, errno);
+			} else {
+				key_file = ao2_alloc(sizeof(*key_file) + strlen(val) + 1, service_key_file_destructor);
+				if (key_file) {
+					strcpy(key_file->path, val); /* safe */
+					key_file->mtime = st.st_mtime;
+					key_file->size = st.st_size;
+					key_file->inode = st.st_ino;
+					key_file->contents = ast_strdup(ast_str_buffer(buffer));
+					if (key_file->contents) {
+						ao2_link(service_key_files, key_file);
+					}
+					ao2_ref(key_file, -1);
+				}
+			}
+			fclose(f);
+			if (stats) {
+				stats->key_files_read++;
+			}
+		} else {
+			ast_log(LOG_ERROR, "Unable to open service key file %s -- %d\n", val, errno);
+		}
+	}
+
+	return buffer;
+}
+
+#define CONFIGURATION_FILENAME		"res_speech_gdfe.conf"
+static void load_logical_agent_limits(struct ast_config *cfg, const char *category, struct gdf_logical_agent *agent)
+{
+	const char *val;
+
+	val = ast_variable_retrieve(cfg, category, "max_concurrent_streams");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->max_concurrent_streams = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for max_concurrent_streams for %s\n", category);
+		}
+	}
+
+	val = ast_variable_retrieve(cfg, category, "max_requests_per_second");
+	if (!ast_strlen_zero(val)) {
+		double d;
+		if (sscanf(val, "%lf", &d) == 1 && d >= 0) {
+			agent->max_requests_per_second = d;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for max_requests_per_second for %s\n", category);
+		}
+	}
+
+	val = ast_variable_retrieve(cfg, category, "max_queue_length");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->max_queue_length = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for max_queue_length for %s\n", category);
+		}
+	}
+
+	agent->queue_timeout = 1000; /* ms */
+	val = ast_variable_retrieve(cfg, category, "queue_timeout");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->queue_timeout = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for queue_timeout for %s\n", category);
+		}
+	}
+}
+
+static void load_logical_agent_routing(struct ast_config *cfg, const char *category, struct gdf_logical_agent *agent)
+{
+	const char *val;
+
+	agent->circuit_breaker_errors = 5;
+	val = ast_variable_retrieve(cfg, category, "circuit_breaker_errors");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->circuit_breaker_errors = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for circuit_breaker_errors for %s\n", category);
+		}
+	}
+
+	agent->circuit_breaker_timeout = 30000; /* ms */
+	val = ast_variable_retrieve(cfg, category, "circuit_breaker_timeout");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->circuit_breaker_timeout = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for circuit_breaker_timeout for %s\n", category);
+		}
+	}
+
+	agent->hedge_events = 0;
+	val = ast_variable_retrieve(cfg, category, "hedge_events");
+	if (!ast_strlen_zero(val)) {
+		agent->hedge_events = ast_true(val);
+	}
+
+	agent->hedge_min_delay = 500; /* ms */
+	val = ast_variable_retrieve(cfg, category, "hedge_min_delay");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->hedge_min_delay = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for hedge_min_delay for %s\n", category);
+		}
+	}
+
+	agent->request_timeout = 0;
+	val = ast_variable_retrieve(cfg, category, "request_timeout");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->request_timeout = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for request_timeout for %s\n", category);
+		}
+	}
+
+	agent->continuous_streaming = 0;
+	val = ast_variable_retrieve(cfg, category, "continuous_streaming");
+	if (!ast_strlen_zero(val)) {
+		agent->continuous_streaming = ast_true(val);
+	}
+
+	agent->continuous_stream_max_idle = 10000; /* ms */
+	val = ast_variable_retrieve(cfg, category, "continuous_stream_max_idle");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->continuous_stream_max_idle = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for continuous_stream_max_idle for %s\n", category);
+		}
+	}
+
+	val = ast_variable_retrieve(cfg, category, "interim_match");
+	if (!ast_strlen_zero(val)) {
+		int res = regcomp(&agent->interim_match_regex, val, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+		if (!res) {
+			agent->interim_match = ast_strdup(val);
+			agent->interim_match_compiled = 1;
+		} else {
+			char error[128];
+			regerror(res, &agent->interim_match_regex, error, sizeof(error));
+			ast_log(LOG_WARNING, "Invalid value for interim_match for %s -- %s\n", category, error);
+		}
+	}
+
+	agent->interim_match_score = 80;
+	val = ast_variable_retrieve(cfg, category, "interim_match_score");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0 && i <= 100) {
+			agent->interim_match_score = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for interim_match_score for %s\n", category);
+		}
+	}
+}
+
+static void load_logical_agent_timers(struct ast_config *cfg, const char *category, struct gdf_logical_agent *agent)
+{
+	const char *val;
+
+	agent->no_input_timeout = 0;
+	val = ast_variable_retrieve(cfg, category, "no_input_timeout");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->no_input_timeout = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for no_input_timeout for %s\n", category);
+		}
+	}
+
+	agent->max_speech_duration = 0;
+	val = ast_variable_retrieve(cfg, category, "max_speech_duration");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->max_speech_duration = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for max_speech_duration for %s\n", category);
+		}
+	}
+}
+
+static void load_logical_agent_dtmf(struct ast_config *cfg, const char *category, struct gdf_logical_agent *agent)
+{
+	const char *val;
+
+	agent->dtmf_mode = DTMF_MODE_OFF;
+	val = ast_variable_retrieve(cfg, category, "dtmf_mode");
+	if (!ast_strlen_zero(val)) {
+		if (!strcasecmp(val, "collect")) {
+			agent->dtmf_mode = DTMF_MODE_COLLECT;
+		} else if (!strcasecmp(val, "event")) {
+			agent->dtmf_mode = DTMF_MODE_EVENT;
+		} else if (!ast_false(val)) {
+			ast_log(LOG_WARNING, "Invalid value for dtmf_mode for %s\n", category);
+		}
+	}
+
+	agent->dtmf_terminator = '#';
+	val = ast_variable_retrieve(cfg, category, "dtmf_terminator");
+	if (val) {
+		if (strlen(val) <= 1) {
+			agent->dtmf_terminator = val[0];
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for dtmf_terminator for %s\n", category);
+		}
+	}
+
+	agent->dtmf_interdigit_timeout = 2000; /* ms */
+	val = ast_variable_retrieve(cfg, category, "dtmf_interdigit_timeout");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i > 0) {
+			agent->dtmf_interdigit_timeout = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for dtmf_interdigit_timeout for %s\n", category);
+		}
+	}
+
+	agent->dtmf_max_digits = 0;
+	val = ast_variable_retrieve(cfg, category, "dtmf_max_digits");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0 && i <= GDF_MAX_DTMF_DIGITS) {
+			agent->dtmf_max_digits = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for dtmf_max_digits for %s\n", category);
+		}
+	}
+
+	val = ast_variable_retrieve(cfg, category, "dtmf_event");
+	agent->dtmf_event = ast_strdup(S_OR(val, "dtmf"));
+}
+
+static void load_logical_agent_prefetch(struct ast_config *cfg, const char *category, struct gdf_logical_agent *agent)
+{
+	const char *val = ast_variable_retrieve(cfg, category, "prefetch_events");
+
+	if (!ast_strlen_zero(val)) {
+		agent->prefetch_events = ast_strdup(val);
+	}
+}
+
+static void load_logical_agent_cache(struct ast_config *cfg, const char *category, struct gdf_logical_agent *agent)
+{
+	const char *val = ast_variable_retrieve(cfg, category, "cache_events");
+
+	if (!ast_strlen_zero(val)) {
+		agent->cache_events = ast_strdup(val);
+	}
+
+	agent->cache_ttl = 300; /* seconds */
+	val = ast_variable_retrieve(cfg, category, "cache_ttl");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+			agent->cache_ttl = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for cache_ttl for %s\n", category);
+		}
+	}
+}
+
+static void load_logical_agent_uplink(struct ast_config *cfg, const char *category, struct gdf_logical_agent *agent)
+{
+	const char *val;
+
+	agent->stream_chunk_ms = 20;
+	val = ast_variable_retrieve(cfg, category, "stream_chunk_ms");
+	if (!ast_strlen_zero(val)) {
+		int i;
+		if (sscanf(val, "%d", &i) == 1 && i >= 20 && i <= 500) {
+			agent->stream_chunk_ms = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid value for stream_chunk_ms for %s\n", category);
+		}
+	}
+}
+
+static const char *dtmf_mode_to_string(enum gdf_dtmf_mode mode)
+{
+	return mode == DTMF_MODE_COLLECT ? "collect" : mode == DTMF_MODE_EVENT ? "event" : "off";
+}
+
+static int logical_agent_equal(const struct gdf_logical_agent *agentA, const struct gdf_logical_agent *agentB)
+{
+	return !strcmp(agentA->name, agentB->name) &&
+		!strcmp(agentA->project_id, agentB->project_id) &&
+		!strcmp(agentA->service_key, agentB->service_key) &&
+		!strcmp(agentA->endpoint, agentB->endpoint) &&
+		agentA->max_concurrent_streams == agentB->max_concurrent_streams &&
+		agentA->max_requests_per_second == agentB->max_requests_per_second &&
+		agentA->max_queue_length == agentB->max_queue_length &&
+		agentA->queue_timeout == agentB->queue_timeout &&
+		agentA->circuit_breaker_errors == agentB->circuit_breaker_errors &&
+		agentA->circuit_breaker_timeout == agentB->circuit_breaker_timeout &&
+		agentA->hedge_events == agentB->hedge_events &&
+		agentA->hedge_min_delay == agentB->hedge_min_delay &&
+		agentA->request_timeout == agentB->request_timeout &&
+		agentA->continuous_streaming == agentB->continuous_streaming &&
+		agentA->continuous_stream_max_idle == agentB->continuous_stream_max_idle &&
+		!strcmp(S_OR(agentA->interim_match, ""), S_OR(agentB->interim_match, "")) &&
+		agentA->interim_match_score == agentB->interim_match_score &&
+		agentA->no_input_timeout == agentB->no_input_timeout &&
+		agentA->max_speech_duration == agentB->max_speech_duration &&
+		!strcmp(S_OR(agentA->prefetch_events, ""), S_OR(agentB->prefetch_events, "")) &&
+		!strcmp(S_OR(agentA->cache_events, ""), S_OR(agentB->cache_events, "")) &&
+		agentA->cache_ttl == agentB->cache_ttl &&
+		agentA->stream_chunk_ms == agentB->stream_chunk_ms &&
+		agentA->dtmf_mode == agentB->dtmf_mode &&
+		agentA->dtmf_terminator == agentB->dtmf_terminator &&
+		agentA->dtmf_interdigit_timeout == agentB->dtmf_interdigit_timeout &&
+		agentA->dtmf_max_digits == agentB->dtmf_max_digits &&
+		!strcmp(S_OR(agentA->dtmf_event, ""), S_OR(agentB->dtmf_event, ""));
+}
+
+/* if the agent is unchanged from the previous config, reuse the previous record so
+ * sessions already holding it (and anything hung off of it) carry over untouched */
+static struct gdf_logical_agent *reuse_unchanged_logical_agent(struct gdf_config *old_config, struct gdf_logical_agent *agent, struct reload_stats *stats)
+{
+	struct gdf_logical_agent *old_agent = NULL;
+
+	if (old_config && old_config->logical_agents) {
+		old_agent = get_logical_agent_by_name(old_config, agent->name);
+	}
+
+	if (!old_agent) {
+		stats->agents_added++;
+		return agent;
+	}
+
+	if (logical_agent_equal(old_agent, agent)) {
+		stats->agents_unchanged++;
+		ao2_ref(agent, -1);
+		return old_agent;
+	}
+
+	stats->agents_changed++;
+	ao2_ref(old_agent, -1);
+	return agent;
+}
+
+static int count_removed_logical_agents(struct gdf_config *old_config, struct gdf_config *new_config)
+{
+	struct ao2_iterator i;
+	struct gdf_logical_agent *agent;
+	int removed = 0;
+
+	if (!old_config || !old_config->logical_agents) {
+		return 0;
+	}
+
+	i = ao2_iterator_init(old_config->logical_agents, 0);
+	while ((agent = ao2_iterator_next(&i))) {
+		struct gdf_logical_agent *new_agent = get_logical_agent_by_name(new_config, agent->name);
+		if (new_agent) {
+			ao2_ref(new_agent, -1);
+		} else {
+			removed++;
+		}
+		ao2_ref(agent, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	return removed;
+}
+
+static ast_mutex_t reload_lock;
+static pthread_t reload_thread_id = AST_PTHREADT_NULL;
+static int reload_in_progress;
+
+static ast_mutex_t reload_summary_lock;
+static char last_reload_summary[256] = "none";
+
+static void set_reload_summary(const char *summary)
+{
+	ast_mutex_lock(&reload_summary_lock);
+	ast_copy_string(last_reload_summary, summary, sizeof(last_reload_summary));
+	ast_mutex_unlock(&reload_summary_lock);
+}
+
+static void get_reload_summary(char *buf, size_t len)
+{
+	ast_mutex_lock(&reload_summary_lock);
+	ast_copy_string(buf, last_reload_summary, len);
+	ast_mutex_unlock(&reload_summary_lock);
+}
+
+static int load_config(int reload)
+{
+	struct ast_config *cfg = NULL;
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct timeval reload_start = ast_tvnow();
+	char summary[256];
+
+	cfg = ast_config_load(CONFIGURATION_FILENAME, config_flags);
+	if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+		ast_log(LOG_DEBUG, "Configuration unchanged.\n");
+		snprintf(summary, sizeof(summary), "configuration unchanged (%" PRId64 "ms)",
+			(int64_t) ast_tvdiff_ms(ast_tvnow(), reload_start));
+		set_reload_summary(summary);
+		cfg = NULL;
+	} else {
+		struct gdf_config *conf;
+		struct gdf_config *old_config;
+		struct reload_stats stats = { 0, };
+		const char *val;
+		const char *category;
+
+		if (cfg == CONFIG_STATUS_FILEINVALID) {
+			ast_log(LOG_WARNING, "Configuration file invalid\n");
+			cfg = ast_config_new();
+		} else if (cfg == CONFIG_STATUS_FILEMISSING) {
+			ast_log(LOG_WARNING, "Configuration not found, using defaults\n");
+			cfg = ast_config_new();
+		}
+		
+		conf = ao2_alloc(sizeof(*conf), gdf_config_destroy);
+		if (!conf) {
+			ast_log(LOG_WARNING, "Failed to allocate config record for speech gdf\n");
+			ast_config_destroy(cfg);
+			return AST_MODULE_LOAD_FAILURE;
+		}
+
+		if (ast_string_field_init(conf, 3 * 1024)) {
+			ast_log(LOG_WARNING, "Failed to allocate string fields for config for speech gdf\n");
+			ao2_ref(conf, -1);
+			ast_config_destroy(cfg);
+			return AST_MODULE_LOAD_FAILURE;
+		}
+
+		conf->logical_agents = ao2_container_alloc(32, logical_agent_hash_callback, logical_agent_compare_callback);
+		if (!conf->logical_agents) {
+			ast_log(LOG_WARNING, "Failed to allocate logical agent container for speech gdf\n");
+			ao2_ref(conf, -1);
+			ast_config_destroy(cfg);
+		}
+
+		val = ast_variable_retrieve(cfg, "general", "service_key");
+		if (ast_strlen_zero(val)) {
+			ast_log(LOG_VERBOSE, "Service key not provided -- will use default credentials.\n");
+		} else {
+			struct ast_str *buffer = load_service_key(val, &stats);
+			ast_string_field_set(conf, service_key, ast_str_buffer(buffer));
+			ast_free(buffer);
+		}
+
+		val = ast_variable_retrieve(cfg, "general", "endpoint");
+		if (!ast_strlen_zero(val)) {
+			ast_string_field_set(conf, endpoint, val);
+		}
+
+		val = ast_variable_retrieve(cfg, "general", "tts_endpoint");
+		if (!ast_strlen_zero(val)) {
+			ast_string_field_set(conf, tts_endpoint, val);
+		}
+
+		conf->vad_voice_threshold = 512;
+		val = ast_variable_retrieve(cfg, "general", "vad_voice_threshold");
+		if (!ast_strlen_zero(val)) {
+			int i;
+			if (sscanf(val, "%d", &i) == 1) {
+				conf->vad_voice_threshold = i;
+			} else {
+				ast_log(LOG_WARNING, "Invalid value for vad_voice_threshold\n");
+			}
+		}
+
+		conf->vad_voice_minimum_duration = 40; /* ms */
+		val = ast_variable_retrieve(cfg, "general", "vad_voice_minimum_duration");
+		if (!ast_strlen_zero(val)) {
+			int i;
+			if (sscanf(val, "%d", &i) == 1) {
+				conf->vad_voice_minimum_duration = i;
+			} else {
+				ast_log(LOG_WARNING, "Invalid value for vad_voice_minimum_duration\n");
+			}
+		}
+
+		conf->vad_silence_minimum_duration = 500; /* ms */
+		val = ast_variable_retrieve(cfg, "general", "vad_silence_minimum_duration");
+		if (!ast_strlen_zero(val)) {
+			int i;
+			if (sscanf(val, "%d", &i) == 1) {
+				conf->vad_silence_minimum_duration = i;
+			} else {
+				ast_log(LOG_WARNING, "Invalid value for vad_silence_minimum_duration\n");
+			}
+		}
+
+		conf->barge_in_policy = BARGE_IN_ON_RESPONSE;
+		val = ast_variable_retrieve(cfg, "general", "barge_in");
+		if (!ast_strlen_zero(val) && parse_barge_in_policy(val, &conf->barge_in_policy)) {
+			ast_log(LOG_WARNING, "Invalid value for barge_in\n");
+		}
+
+		conf->barge_in_minimum_duration = 0; /* ms */
+		val = ast_variable_retrieve(cfg, "general", "barge_in_minimum_duration");
+		if (!ast_strlen_zero(val)) {
+			int i;
+			if (sscanf(val, "%d", &i) == 1) {
+				conf->barge_in_minimum_duration = i;
+			} else {
+				ast_log(LOG_WARNING, "Invalid value for barge_in_minimum_duration\n");
+			}
+		}
+
+		ast_string_field_set(conf, call_log_location, "/var/log/dialogflow/${APPLICATION}/${STRFTIME(,,%Y/%m/%d/%H)}/");
+		ast_string_field_set(conf, stats_segment, GDFE_STATS_DEFAULT_PATH);
+		val = ast_variable_retrieve(cfg, "general", "stats_segment");
+		if (val) {
+			ast_string_field_set(conf, stats_segment, val);
+		}
+
+		val = ast_variable_retrieve(cfg, "general", "call_log_location");
+		if (!ast_strlen_zero(val)) {
+			ast_string_field_set(conf, call_log_location, val);
+		}
+
+		conf->enable_call_logs = 1;
+		val = ast_variable_retrieve(cfg, "general", "enable_call_logs");
+		if (!ast_strlen_zero(val)) {
+			conf->enable_call_logs = ast_true(val);
+		}
+
+		conf->enable_preendpointer_recordings = 0;
+		val = ast_variable_retrieve(cfg, "general", "enable_preendpointer_recordings");
+		if (!ast_strlen_zero(val)) {
+			conf->enable_preendpointer_recordings = ast_true(val);
+		}
+
+		conf->enable_postendpointer_recordings = 0;
+		val = ast_variable_retrieve(cfg, "general", "enable_postendpointer_recordings");
+		if (!ast_strlen_zero(val)) {
+			conf->enable_postendpointer_recordings = ast_true(val);
+		}
+
+		old_config = gdf_get_config();
+
+		conf->stream_recovery_attempts = 1;
+		val = ast_variable_retrieve(cfg, "general", "stream_recovery_attempts");
+		if (!ast_strlen_zero(val)) {
+			int i;
+			if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+				conf->stream_recovery_attempts = i;
+			} else {
+				ast_log(LOG_WARNING, "Invalid value for stream_recovery_attempts\n");
+			}
+		}
+
+		conf->stream_recovery_buffer = 10000; /* ms */
+		val = ast_variable_retrieve(cfg, "general", "stream_recovery_buffer");
+		if (!ast_strlen_zero(val)) {
+			int i;
+			if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+				conf->stream_recovery_buffer = i;
+			} else {
+				ast_log(LOG_WARNING, "Invalid value for stream_recovery_buffer\n");
+			}
+		}
+
+		conf->statsd = 0;
+		val = ast_variable_retrieve(cfg, "general", "statsd");
+		if (!ast_strlen_zero(val)) {
+			conf->statsd = ast_true(val);
+		}
+
+		conf->statsd_sample_rate = 1.0;
+		val = ast_variable_retrieve(cfg, "general", "statsd_sample_rate");
+		if (!ast_strlen_zero(val)) {
+			double d;
+			if (sscanf(val, "%lf", &d) == 1 && d > 0 && d <= 1) {
+				conf->statsd_sample_rate = d;
+			} else {
+				ast_log(LOG_WARNING, "Invalid value for statsd_sample_rate\n");
+			}
+		}
+
+		conf->event_workers = 16;
+		val = ast_variable_retrieve(cfg, "general", "event_workers");
+		if (!ast_strlen_zero(val)) {
+			int i;
+			if (sscanf(val, "%d", &i) == 1 && i >= 0) {
+				conf->event_workers = i;
+			} else {
+				ast_log(LOG_WARNING, "Invalid value for event_workers\n");
+			}
+		}
+
+		category = NULL;
+		while ((category = ast_category_browse(cfg, category))) {
+			if (strcasecmp("general", category)) {
+				const char *name = category;
+				const char *project_id = ast_variable_retrieve(cfg, category, "project_id");
+				const char *endpoint = ast_variable_retrieve(cfg, category, "endpoint");
+				const char *service_key = ast_variable_retrieve(cfg, category, "service_key");
+
+				if (!ast_strlen_zero(service_key)) {
+					struct ast_str *buffer = load_service_key(service_key, &stats);
+					if (buffer) {
+						service_key = ast_strdupa(ast_str_buffer(buffer));
+						ast_free(buffer);
+					}
+				}
+
+				if (!ast_strlen_zero(project_id)) {
+					struct gdf_logical_agent *agent;
+					
+					agent = logical_agent_alloc(name, project_id, S_OR(service_key, ""), S_OR(endpoint, ""));
+					if (agent) {
+						load_logical_agent_limits(cfg, category, agent);
+						load_logical_agent_routing(cfg, category, agent);
+						load_logical_agent_timers(cfg, category, agent);
+						load_logical_agent_dtmf(cfg, category, agent);
+						load_logical_agent_prefetch(cfg, category, agent);
+						load_logical_agent_cache(cfg, category, agent);
+						load_logical_agent_uplink(cfg, category, agent);
+						agent = reuse_unchanged_logical_agent(old_config, agent, &stats);
+						ao2_link(conf->logical_agents, agent);
+						ao2_ref(agent, -1);
+					} else {
+						ast_log(LOG_WARNING, "Memory allocation failed creating logical agent %s\n", name);
+					}
+				} else {
+					ast_log(LOG_WARNING, "Mapped project_id is required for %s\n", name);
+				}
+			}
+		}
+
+		/* swap out the configs */
+#ifdef ASTERISK_13_OR_LATER
+		ao2_wrlock(config);
+#else
+		ao2_lock(config);
+#endif
+		{
+			struct gdf_config *old_config = gdf_get_config();
+			ao2_unlink(config, old_config);
+			ao2_ref(old_config, -1);
+		}
+		ao2_link(config, conf);
+		ao2_unlock(config);
+
+		__atomic_store_n(&statsd_enabled, conf->statsd, __ATOMIC_RELAXED);
+		__atomic_store_n(&statsd_sample_ppm, MAX(1, (int) (conf->statsd_sample_rate * 1000000)), __ATOMIC_RELAXED);
+
+		if (event_pool && conf->event_workers > 0) {
+			ast_threadpool_set_size(event_pool, conf->event_workers);
+		}
+
+		/* cached responses of agents that have just changed may no longer be right */
+		flush_changed_cached_responses(old_config, conf);
+
+		stats.agents_removed = count_removed_logical_agents(old_config, conf);
+		if (old_config) {
+			ao2_ref(old_config, -1);
+		}
+		ao2_ref(conf, -1);
+
+		snprintf(summary, sizeof(summary),
+			"%d agents added, %d changed, %d removed, %d unchanged; %d key files read, %d unchanged (%" PRId64 "ms)",
+			stats.agents_added, stats.agents_changed, stats.agents_removed, stats.agents_unchanged,
+			stats.key_files_read, stats.key_files_cached, (int64_t) ast_tvdiff_ms(ast_tvnow(), reload_start));
+		set_reload_summary(summary);
+		ast_verb(2, "res_speech_gdfe configuration loaded: %s\n", summary);
+	}
+
+	if (cfg) {
+		ast_config_destroy(cfg);
+	}
+	
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+static void *reload_thread(void *data)
+{
+	ast_mutex_lock(&reload_lock);
+	load_config(1);
+	ast_mutex_unlock(&reload_lock);
+	/* the thread is joined by the next reload or by unload_module */
+	__sync_lock_release(&reload_in_progress);
+	return NULL;
+}
+
+static char *gdfe_reload(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	char summary[256];
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe reload";
+		e->usage = 
+			"Usage: gdfe reload\n"
+			"       Reload res_speech_gdfe configuration.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	default:
+		if (__sync_lock_test_and_set(&reload_in_progress, 1)) {
+			ast_cli(a->fd, "A reload of res_speech_gdfe config is already in progress\n");
+			return CLI_SUCCESS;
+		}
+		/* the flag was clear, so any previous reload thread has finished or is just exiting */
+		if (reload_thread_id != AST_PTHREADT_NULL) {
+			pthread_join(reload_thread_id, NULL);
+			reload_thread_id = AST_PTHREADT_NULL;
+		}
+		get_reload_summary(summary, sizeof(summary));
+		if (ast_pthread_create_background(&reload_thread_id, NULL, reload_thread, NULL)) {
+			reload_thread_id = AST_PTHREADT_NULL;
+			ast_cli(a->fd, "Unable to start reload thread, reloading res_speech_gdfe config from " CONFIGURATION_FILENAME " in place\n");
+			reload_thread(NULL);
+		} else {
+			ast_cli(a->fd, "Reloading res_speech_gdfe config from " CONFIGURATION_FILENAME " in the background\n");
+		}
+		ast_cli(a->fd, "Previous reload: %s\n", summary);
+		ast_cli(a->fd, "\n\n");
+		return CLI_SUCCESS;
+	}
+}
+
+static char *gdfe_show_config(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct gdf_config *config;
+	char summary[256];
+	
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe show config";
+		e->usage = 
+			"Usage: gdfe show config\n"
+			"       Show current gdfe configuration.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	default:
+		config = gdf_get_config();
+		if (config) {
+			struct ao2_iterator i;
+			struct gdf_logical_agent *agent;
+
+			ast_cli(a->fd, "[general]\n");
+			ast_cli(a->fd, "service_key = %s\n", config->service_key);
+			ast_cli(a->fd, "endpoint = %s\n", config->endpoint);
+			ast_cli(a->fd, "tts_endpoint = %s\n", config->tts_endpoint);
+			ast_cli(a->fd, "vad_voice_threshold = %d\n", config->vad_voice_threshold);
+			ast_cli(a->fd, "vad_voice_minimum_duration = %d\n", config->vad_voice_minimum_duration);
+			ast_cli(a->fd, "vad_silence_minimum_duration = %d\n", config->vad_silence_minimum_duration);
+			ast_cli(a->fd, "barge_in = %s\n", barge_in_policy_to_string(config->barge_in_policy));
+			ast_cli(a->fd, "barge_in_minimum_duration = %d\n", config->barge_in_minimum_duration);
+			ast_cli(a->fd, "call_log_location = %s\n", config->call_log_location);
+			ast_cli(a->fd, "stats_segment = %s\n", config->stats_segment);
+			ast_cli(a->fd, "enable_call_logs = %s\n", AST_CLI_YESNO(config->enable_call_logs));
+			ast_cli(a->fd, "enable_preendpointer_recordings = %s\n", AST_CLI_YESNO(config->enable_preendpointer_recordings));
+			ast_cli(a->fd, "enable_postendpointer_recordings = %s\n", AST_CLI_YESNO(config->enable_postendpointer_recordings));
+			ast_cli(a->fd, "stream_recovery_attempts = %d\n", config->stream_recovery_attempts);
+			ast_cli(a->fd, "stream_recovery_buffer = %d\n", config->stream_recovery_buffer);
+			ast_cli(a->fd, "event_workers = %d\n", config->event_workers);
+			ast_cli(a->fd, "statsd = %s\n", AST_CLI_YESNO(config->statsd));
+			ast_cli(a->fd, "statsd_sample_rate = %g\n", config->statsd_sample_rate);
+			get_reload_summary(summary, sizeof(summary));
+			ast_cli(a->fd, "; last reload: %s\n", summary);
+			i = ao2_iterator_init(config->logical_agents, 0);
+			while ((agent = ao2_iterator_next(&i))) {
+				ast_cli(a->fd, "\n[%s]\n", agent->name);
+				ast_cli(a->fd, "project_id = %s\n", agent->project_id);
+				ast_cli(a->fd, "endpoint = %s\n", agent->endpoint);
+				ast_cli(a->fd, "service_key = %s\n", agent->service_key);
+				ast_cli(a->fd, "max_concurrent_streams = %d\n", agent->max_concurrent_streams);
+				ast_cli(a->fd, "max_requests_per_second = %g\n", agent->max_requests_per_second);
+				ast_cli(a->fd, "max_queue_length = %d\n", agent->max_queue_length);
+				ast_cli(a->fd, "queue_timeout = %d\n", agent->queue_timeout);
+				ast_cli(a->fd, "circuit_breaker_errors = %d\n", agent->circuit_breaker_errors);
+				ast_cli(a->fd, "circuit_breaker_timeout = %d\n", agent->circuit_breaker_timeout);
+				ast_cli(a->fd, "hedge_events = %s\n", AST_CLI_YESNO(agent->hedge_events));
+				ast_cli(a->fd, "hedge_min_delay = %d\n", agent->hedge_min_delay);
+				ast_cli(a->fd, "request_timeout = %d\n", agent->request_timeout);
+				ast_cli(a->fd, "continuous_streaming = %s\n", AST_CLI_YESNO(agent->continuous_streaming));
+				ast_cli(a->fd, "continuous_stream_max_idle = %d\n", agent->continuous_stream_max_idle);
+				ast_cli(a->fd, "interim_match = %s\n", S_OR(agent->interim_match, ""));
+				ast_cli(a->fd, "interim_match_score = %d\n", agent->interim_match_score);
+				ast_cli(a->fd, "no_input_timeout = %d\n", agent->no_input_timeout);
+				ast_cli(a->fd, "max_speech_duration = %d\n", agent->max_speech_duration);
+				ast_cli(a->fd, "prefetch_events = %s\n", S_OR(agent->prefetch_events, ""));
+				ast_cli(a->fd, "cache_events = %s\n", S_OR(agent->cache_events, ""));
+				ast_cli(a->fd, "cache_ttl = %d\n", agent->cache_ttl);
+				ast_cli(a->fd, "stream_chunk_ms = %d\n", agent->stream_chunk_ms);
+				ast_cli(a->fd, "dtmf_mode = %s\n", dtmf_mode_to_string(agent->dtmf_mode));
+				ast_cli(a->fd, "dtmf_terminator = %c\n", agent->dtmf_terminator ? agent->dtmf_terminator : ' ');
+				ast_cli(a->fd, "dtmf_interdigit_timeout = %d\n", agent->dtmf_interdigit_timeout);
+				ast_cli(a->fd, "dtmf_max_digits = %d\n", agent->dtmf_max_digits);
+				ast_cli(a->fd, "dtmf_event = %s\n", S_OR(agent->dtmf_event, ""));
+				ao2_ref(agent, -1);
+			}
+			ao2_iterator_destroy(&i);
+			ao2_ref(config, -1);
+		} else {
+			ast_cli(a->fd, "Unable to retrieve configuration\n");
+		}
+		ast_cli(a->fd, "\n");
+		return CLI_SUCCESS;
+	}
+}
+
+static char *gdfe_show_agents(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ao2_iterator i;
+	struct gdf_agent_runtime *runtime;
+	int j;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe show agents";
+		e->usage =
+			"Usage: gdfe show agents\n"
+			"       Show live admission counters and endpoint health for each logical agent.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	default:
+		ast_cli(a->fd, "%-32s %8s %8s %10s %8s %10s %10s\n", "Agent", "Active", "Waiting", "Admitted", "Queued", "Rejected", "Timed out");
+		i = ao2_iterator_init(agent_runtimes, 0);
+		while ((runtime = ao2_iterator_next(&i))) {
+			ast_mutex_lock(&runtime->lock);
+			ast_cli(a->fd, "%-32s %8d %8d %10u %8u %10u %10u\n", runtime->name, runtime->active_streams, runtime->waiting,
+				runtime->admitted, runtime->queued, runtime->rejected, runtime->timed_out);
+			for (j = 0; j < runtime->endpoint_count; j++) {
+				struct gdf_endpoint_health *health = &runtime->endpoints[j];
+				ast_cli(a->fd, "    endpoint '%s': %s, score %.1fms, p95 %dms, %u requests, %u errors, %u ejections, %u hedges\n",
+					S_OR(health->endpoint, "(default)"), health->ejected ? "ejected" : "healthy", health->latency_score,
+					endpoint_p95_latency(health), health->requests, health->errors, health->ejections, health->hedges);
+			}
+			ast_mutex_unlock(&runtime->lock);
+			ao2_ref(runtime, -1);
+		}
+		ao2_iterator_destroy(&i);
+		ast_cli(a->fd, "\n");
+		return CLI_SUCCESS;
+	}
+}
+
+/* pvt is locked */
+static void describe_in_flight(struct gdf_pvt *pvt, char *buf, size_t len)
+{
+	char *next = buf;
+	size_t remaining = len;
+
+	*buf = '\0';
+	if (pvt->recognition_active) {
+		ast_build_string(&next, &remaining, "%s", pvt->stream_preopened ? "stream (pre-opened)" : "stream");
+	}
+	if (pvt->async_query_active) {
+		ast_build_string(&next, &remaining, "%squery", *buf ? ", " : "");
+	}
+	if (pvt->prefetch_state == PREFETCH_RUNNING) {
+		ast_build_string(&next, &remaining, "%sprefetch", *buf ? ", " : "");
+	}
+	if (pvt->pending_requests) {
+		ast_build_string(&next, &remaining, "%s%d abandoned", *buf ? ", " : "", pvt->pending_requests);
+	}
+	if (!*buf) {
+		ast_copy_string(buf, "-", len);
+	}
+}
+
+/* pvt is locked */
+static void describe_last_error(struct gdf_pvt *pvt, char *buf, size_t len)
+{
+	if (pvt->last_error) {
+		snprintf(buf, len, "%s %" PRId64 "s ago", pvt->last_error, ast_tvdiff_sec(ast_tvnow(), pvt->last_error_time));
+	} else {
+		ast_copy_string(buf, "-", len);
+	}
+}
+
+static char *gdfe_show_sessions(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ast_str *lines;
+	struct gdf_pvt *pvt;
+	int count = 0;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe show sessions";
+		e->usage =
+			"Usage: gdfe show sessions\n"
+			"       List the speech sessions that exist right now, including ones\n"
+			"       that have ended but still have requests running.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	lines = ast_str_create(1024);
+	if (!lines) {
+		return CLI_FAILURE;
+	}
+
+	ast_cli(a->fd, "%-32s %-20s %-8s %5s %9s %10s %-20s %s\n", "Session", "Agent", "VAD", "Utts", "Streamed",
+		"Bytes", "In flight", "Last error");
+	for (i = 0; i < SESSION_REGISTRY_SHARDS; i++) {
+		/* formatted under the locks and written after, so a slow console holds up nothing */
+		ast_str_reset(lines);
+		AST_LIST_LOCK(&session_registry[i]);
+		AST_LIST_TRAVERSE(&session_registry[i], pvt, registry_entry) {
+			char in_flight[64];
+			char last_error[64];
+
+			ast_mutex_lock(&pvt->lock);
+			describe_in_flight(pvt, in_flight, sizeof(in_flight));
+			describe_last_error(pvt, last_error, sizeof(last_error));
+			ast_str_append(&lines, 0, "%-32.32s %-20.20s %-8s %5d %8.1fs %10" PRId64 " %-20s %s\n", pvt->session_id,
+				S_OR(pvt->logical_agent_name, S_OR(pvt->project_id, "-")),
+				pvt->destroyed ? "ended" : vad_state_names[pvt->vad_state], pvt->utterance_counter,
+				(pvt->uplink_bytes + pvt->turn_uplink_bytes) / (MULAW_BYTES_PER_MS * 1000.0),
+				pvt->uplink_bytes + pvt->turn_uplink_bytes, in_flight, last_error);
+			ast_mutex_unlock(&pvt->lock);
+			count++;
+		}
+		AST_LIST_UNLOCK(&session_registry[i]);
+		ast_cli(a->fd, "%s", ast_str_buffer(lines));
+	}
+	ast_cli(a->fd, "%d session%s\n\n", count, ESS(count));
+
+	ast_free(lines);
+	return CLI_SUCCESS;
+}
+
+static char *gdfe_show_session(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ast_str *details;
+	struct gdf_pvt *pvt;
+	int found = 0;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe show session";
+		e->usage =
+			"Usage: gdfe show session <session id|channel>\n"
+			"       Show the state of one speech session.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	details = ast_str_create(1024);
+	if (!details) {
+		return CLI_FAILURE;
+	}
+
+	for (i = 0; i < SESSION_REGISTRY_SHARDS && !found; i++) {
+		AST_LIST_LOCK(&session_registry[i]);
+		AST_LIST_TRAVERSE(&session_registry[i], pvt, registry_entry) {
+			char in_flight[64];
+			char last_error[64];
+
+			ast_mutex_lock(&pvt->lock);
+			if (strcmp(pvt->session_id, a->argv[3]) && strcmp(pvt->channel_name, a->argv[3])) {
+				ast_mutex_unlock(&pvt->lock);
+				continue;
+			}
+			describe_in_flight(pvt, in_flight, sizeof(in_flight));
+			describe_last_error(pvt, last_error, sizeof(last_error));
+			ast_str_append(&details, 0, "Session ID:     %s\n", pvt->session_id);
+			ast_str_append(&details, 0, "Channel:        %s\n", S_OR(pvt->channel_name, "-"));
+			ast_str_append(&details, 0, "Agent:          %s\n", S_OR(pvt->logical_agent_name, "-"));
+			ast_str_append(&details, 0, "Project:        %s\n", S_OR(pvt->project_id, "-"));
+			ast_str_append(&details, 0, "Language:       %s\n", S_OR(pvt->language, "-"));
+			ast_str_append(&details, 0, "Endpoint:       %s\n", S_OR(pvt->active_endpoint, S_OR(pvt->endpoint, "(default)")));
+			ast_str_append(&details, 0, "Age:            %" PRId64 "s\n", ast_tvdiff_sec(ast_tvnow(), pvt->created));
+			ast_str_append(&details, 0, "State:          %s\n", pvt->destroyed ? "ended, waiting for requests" : "active");
+			ast_str_append(&details, 0, "VAD state:      %s for %dms\n", vad_state_names[pvt->vad_state], pvt->vad_state_duration);
+			ast_str_append(&details, 0, "Utterances:     %d\n", pvt->utterance_counter);
+			ast_str_append(&details, 0, "Streamed:       %.1fs\n", (pvt->uplink_bytes + pvt->turn_uplink_bytes) / (MULAW_BYTES_PER_MS * 1000.0));
+			ast_str_append(&details, 0, "Uplink:         %" PRId64 " bytes\n", pvt->uplink_bytes + pvt->turn_uplink_bytes);
+			ast_str_append(&details, 0, "In flight:      %s\n", in_flight);
+			ast_str_append(&details, 0, "Admission:      %s\n", S_OR(admission_result_names[pvt->last_admission_result], "-"));
+			ast_str_append(&details, 0, "Last error:     %s\n", last_error);
+			ast_mutex_unlock(&pvt->lock);
+			found = 1;
+			break;
+		}
+		AST_LIST_UNLOCK(&session_registry[i]);
+	}
+
+	if (found) {
+		ast_cli(a->fd, "%s\n", ast_str_buffer(details));
+	} else {
+		ast_cli(a->fd, "No session '%s'\n", a->argv[3]);
+	}
+
+	ast_free(details);
+	return CLI_SUCCESS;
+}
+
+static char *gdfe_show_latency(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ao2_iterator i;
+	struct gdf_agent_runtime *runtime;
+	const char *agent = NULL;
+	int reset = 0;
+	int stage;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe show latency";
+		e->usage =
+			"Usage: gdfe show latency [agent] [reset]\n"
+			"       Show where turns spend their time, per logical agent, as\n"
+			"       percentiles in milliseconds. With reset, the histograms are\n"
+			"       cleared after they are shown.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc > 5) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc > 3) {
+		if (!strcasecmp(a->argv[a->argc - 1], "reset")) {
+			reset = 1;
+		}
+		if (a->argc == 5) {
+			if (!reset) {
+				return CLI_SHOWUSAGE;
+			}
+			agent = a->argv[3];
+		} else if (!reset) {
+			agent = a->argv[3];
+		}
+	}
+
+	i = ao2_iterator_init(agent_runtimes, 0);
+	while ((runtime = ao2_iterator_next(&i))) {
+		if (agent && strcasecmp(agent, runtime->name)) {
+			ao2_ref(runtime, -1);
+			continue;
+		}
+		ast_cli(a->fd, "%s\n", runtime->name);
+		ast_cli(a->fd, "    %-14s %8s %10s %10s %10s %10s\n", "Stage", "Count", "p50", "p90", "p99", "Max");
+		for (stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+			struct gdfe_stats_histogram *histogram = &runtime->latency[stage];
+			int total = histogram->total;
+			if (!total) {
+				continue;
+			}
+			ast_cli(a->fd, "    %-14s %8d %10.1f %10.1f %10.1f %10.1f\n", latency_stage_names[stage], total,
+				gdfe_stats_percentile(histogram, total, 50) / 1000.0, gdfe_stats_percentile(histogram, total, 90) / 1000.0,
+				gdfe_stats_percentile(histogram, total, 99) / 1000.0, histogram->max_us / 1000.0);
+		}
+		if (reset) {
+			/* samples recorded while this runs may be lost, which is fine for a reset */
+			memset(runtime->latency, 0, sizeof(runtime->latency));
+		}
+		ao2_ref(runtime, -1);
+	}
+	ao2_iterator_destroy(&i);
+	ast_cli(a->fd, "\n");
+	return CLI_SUCCESS;
+}
+
+static char *gdfe_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int64_t uptime;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe show stats";
+		e->usage =
+			"Usage: gdfe show stats\n"
+			"       Show engine wide counters.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	default:
+		ast_mutex_lock(&engine_stats.lock);
+		ast_cli(a->fd, "Abandoned RPCs:       %d\n", engine_stats.abandoned_rpcs);
+		ast_cli(a->fd, "Deadlines exceeded:   %d\n", engine_stats.deadlines_exceeded);
+		ast_cli(a->fd, "Teardowns:            %u\n", engine_stats.teardowns);
+		ast_cli(a->fd, "Teardown time (avg):  %" PRId64 "ms\n",
+			engine_stats.teardowns ? engine_stats.teardown_ms_total / engine_stats.teardowns : 0);
+		ast_cli(a->fd, "Teardown time (max):  %" PRId64 "ms\n", engine_stats.teardown_ms_max);
+		ast_cli(a->fd, "Event prefetches:     %u\n", engine_stats.prefetches);
+		ast_cli(a->fd, "Prefetch hits:        %u (%u%%)\n", engine_stats.prefetch_hits,
+			engine_stats.prefetches ? engine_stats.prefetch_hits * 100 / engine_stats.prefetches : 0);
+		ast_cli(a->fd, "Prefetches wasted:    %u\n", engine_stats.prefetches_wasted);
+		ast_cli(a->fd, "Response cache hits:  %u\n", engine_stats.cache_hits);
+		ast_cli(a->fd, "Response cache miss:  %u\n", engine_stats.cache_misses);
+		ast_cli(a->fd, "Cached responses:     %d\n", response_cache ? ao2_container_count(response_cache) : 0);
+		ast_cli(a->fd, "Uplink bytes:         %" PRId64 "\n", engine_stats.uplink_bytes);
+		ast_cli(a->fd, "Uplink messages:      %" PRId64 "\n", engine_stats.uplink_messages);
+		uptime = ast_tvdiff_sec(ast_tvnow(), engine_stats.started);
+		if (uptime > 0) {
+			ast_cli(a->fd, "Uplink rate:          %" PRId64 " messages/sec, %" PRId64 " bytes/sec\n",
+				engine_stats.uplink_messages / uptime, engine_stats.uplink_bytes / uptime);
+		}
+		ast_mutex_unlock(&engine_stats.lock);
+		ast_cli(a->fd, "\n");
+		return CLI_SUCCESS;
+	}
+}
+
+static int64_t thread_cpu_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void print_uplink_benchmark(int fd, const char *encoding, int seconds, int64_t bytes, int64_t cpu_us)
+{
+	ast_cli(fd, "%-8s %12" PRId64 " %10.1f %10" PRId64 " %12.1f %10" PRId64 "\n", encoding, bytes,
+		bytes * 8.0 / seconds / 1000, cpu_us / 1000, (double) cpu_us / seconds,
+		cpu_us ? (int64_t) seconds * 1000000 / cpu_us : 0);
+}
+
+static char *gdfe_benchmark_uplink(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int seconds = 60;
+	int frames;
+	int frame;
+	short linear[160];
+	char mulaw[160];
+	int64_t cpu_us;
+	int64_t bytes;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe benchmark uplink";
+		e->usage =
+			"Usage: gdfe benchmark uplink [seconds]\n"
+			"       Encode the given seconds (default and at most 60) of synthetic 8kHz\n"
+			"       audio with each supported uplink encoding, one 20ms frame per write,\n"
+			"       and show the bandwidth and the CPU time it took.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc > 4) {
+		return CLI_SHOWUSAGE;
+	}
+	/* this runs on the CLI thread, so keep it short */
+	if (a->argc == 4 && (sscanf(a->argv[3], "%d", &seconds) != 1 || seconds < 1 || seconds > 60)) {
+		return CLI_SHOWUSAGE;
+	}
+	frames = seconds * 50;
+
+	ast_cli(a->fd, "%-8s %12s %10s %10s %12s %10s\n", "Encoding", "Bytes", "kbit/s", "CPU ms", "CPU us/sec", "Calls/core");
+
+	/* the audio is generated outside the timed sections, a voiced tone with some noise */
+	cpu_us = 0;
+	bytes = 0;
+	for (frame = 0; frame < frames; frame++) {
+		int64_t frame_start;
+		for (i = 0; i < 160; i++) {
+			int n = frame * 160 + i;
+			linear[i] = (short) (6000 * sin(n * 2 * M_PI * 220 / 8000) + 2000 * sin(n * 2 * M_PI * 1330 / 8000) +
+				(int) (ast_random() % 1000) - 500);
+		}
+		frame_start = thread_cpu_us();
+		for (i = 0; i < 160; i++) {
+			mulaw[i] = AST_LIN2MU(linear[i]);
+		}
+		cpu_us += thread_cpu_us() - frame_start;
+		bytes += sizeof(mulaw);
+	}
+	print_uplink_benchmark(a->fd, "mulaw", seconds, bytes, cpu_us);
+
+	ast_cli(a->fd, "\n");
+	return CLI_SUCCESS;
+}
+
+static char *gdfe_benchmark_resampler(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int seconds = 60;
+	int direction;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe benchmark resampler";
+		e->usage =
+			"Usage: gdfe benchmark resampler [seconds]\n"
+			"       Resample the given seconds (default 60) of synthetic audio between\n"
+			"       8kHz and 16kHz in 20ms frames, and show the CPU time it took.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc > 4) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc == 4 && (sscanf(a->argv[3], "%d", &seconds) != 1 || seconds < 1 || seconds > 3600)) {
+		return CLI_SHOWUSAGE;
+	}
+
+#if defined(__SSE2__)
+	ast_cli(a->fd, "Implementation: SSE2\n");
+#else
+	ast_cli(a->fd, "Implementation: scalar\n");
+#endif
+	ast_cli(a->fd, "%-10s %10s %12s %12s\n", "Direction", "CPU ms", "CPU us/sec", "x realtime");
+
+	for (direction = 0; direction < 2; direction++) {
+		int from_rate = direction ? 8000 : 16000;
+		int to_rate = direction ? 16000 : 8000;
+		int frame_samples = from_rate / 50;
+		short *in = ast_alloca(frame_samples * sizeof(short));
+		short *out = ast_alloca(frame_samples * 2 * sizeof(short));
+		struct gdf_resampler resampler;
+		int64_t cpu_us = 0;
+		int frame;
+		int i;
+
+		resampler_init(&resampler, from_rate, to_rate);
+		for (frame = 0; frame < seconds * 50; frame++) {
+			int64_t frame_start;
+			for (i = 0; i < frame_samples; i++) {
+				int n = frame * frame_samples + i;
+				in[i] = (short) (6000 * sin(n * 2 * M_PI * 220 / from_rate) + 2000 * sin(n * 2 * M_PI * 1330 / from_rate) +
+					(int) (ast_random() % 1000) - 500);
+			}
+			frame_start = thread_cpu_us();
+			resample(&resampler, in, frame_samples, out);
+			cpu_us += thread_cpu_us() - frame_start;
+		}
+		ast_cli(a->fd, "%-10s %10" PRId64 " %12.1f %12" PRId64 "\n", direction ? "8k->16k" : "16k->8k",
+			cpu_us / 1000, (double) cpu_us / seconds, cpu_us ? (int64_t) seconds * 1000000 / cpu_us : 0);
+	}
+
+	ast_cli(a->fd, "\n");
+	return CLI_SUCCESS;
+}
+
+#define LOADTEST_MAX_CALLS	10000
+#define LOADTEST_FRAME_SAMPLES	160 /* 20ms at 8kHz */
+#define LOADTEST_MAX_AUDIO	(16 * 1024 * 1024)
+#define LOADTEST_TURN_FRAMES	(30 * 50) /* SpeechBackground gives up on a turn after about this long */
+
+/* one simulated call, driven the way SpeechBackground drives a channel's speech object */
+struct loadtest_call {
+	struct ast_speech *speech;
+	struct ast_speech_result *results;
+	int audio_offset; /* so the calls are not all speaking at once */
+	int turn_frames;
+};
+
+struct loadtest_run {
+	struct loadtest_call *calls;
+	int call_count;
+	int worker_count;
+	const short *audio;
+	int audio_frames;
+	int frames; /* per call */
+	int speed; /* times real time, 0 for as fast as possible */
+
+	/* updated with atomic operations only */
+	struct gdfe_stats_histogram write_latency;
+	struct gdfe_stats_histogram start_latency;
+	struct gdfe_stats_histogram results_latency;
+	int64_t callback_cpu_us;
+	int64_t blocked_us; /* off CPU while in a callback, mostly waiting on locks */
+	int64_t voluntary_switches;
+	int late_ticks;
+	int turns;
+	int failed_starts;
+};
+
+struct loadtest_worker {
+	struct loadtest_run *run;
+	int index;
+};
+
+/* held by a load test or replay for as long as it runs, and by unload_module so none can start */
+static int loadtest_running;
+
+static int64_t loadtest_rss_bytes(void)
+{
+	FILE *statm = fopen("/proc/self/statm", "r");
+	long pages = 0;
+
+	if (statm) {
+		if (fscanf(statm, "%*s %ld", &pages) != 1) {
+			pages = 0;
+		}
+		fclose(statm);
+	}
+	return (int64_t) pages * sysconf(_SC_PAGESIZE);
+}
+
+/*! \brief time one engine callback, adding its wall time to a histogram and any time off CPU to the run */
+#define LOADTEST_TIMED(run, histogram, call) do { \
+		int64_t wall_start = monotonic_us(); \
+		int64_t cpu_start = thread_cpu_us(); \
+		int64_t wall_us; \
+		int64_t cpu_us; \
+		call; \
+		cpu_us = thread_cpu_us() - cpu_start; \
+		wall_us = monotonic_us() - wall_start; \
+		add_latency_sample(&(run)->histogram, wall_us); \
+		if (wall_us > cpu_us) { \
+			__sync_fetch_and_add(&(run)->blocked_us, wall_us - cpu_us); \
+		} \
+	} while (0)
+
+static void loadtest_start_turn(struct loadtest_run *run, struct loadtest_call *call)
+{
+	int state;
+
+	if (call->results) {
+		ast_speech_results_free(call->results);
+		call->results = NULL;
+	}
+	/* as ast_speech_start does */
+	ast_clear_flag(call->speech, AST_SPEECH_SPOKE);
+	ast_clear_flag(call->speech, AST_SPEECH_QUIET);
+	LOADTEST_TIMED(run, start_latency, gdf_start(call->speech));
+
+	/* gdf_start reports a turn it could not start through the state, not its return value */
+	ast_mutex_lock(&call->speech->lock);
+	state = call->speech->state;
+	ast_mutex_unlock(&call->speech->lock);
+	if (state == AST_SPEECH_STATE_NOT_READY) {
+		ast_atomic_fetchadd_int(&run->failed_starts, 1);
+	}
+	call->turn_frames = 0;
+	ast_atomic_fetchadd_int(&run->turns, 1);
+}
+
+static void loadtest_call_frame(struct loadtest_run *run, struct loadtest_call *call, int frame)
+{
+	const short *audio = run->audio + ((call->audio_offset + frame) % run->audio_frames) * LOADTEST_FRAME_SAMPLES;
+	int state;
+
+	ast_mutex_lock(&call->speech->lock);
+	state = call->speech->state;
+	ast_mutex_unlock(&call->speech->lock);
+
+	if (state == AST_SPEECH_STATE_DONE) {
+		LOADTEST_TIMED(run, results_latency, call->results = gdf_get_results(call->speech));
+		loadtest_start_turn(run, call);
+	} else if (state == AST_SPEECH_STATE_READY) {
+		/* gdf_write works on the frame in place, like a channel's frame */
+		short data[LOADTEST_FRAME_SAMPLES];
+		memcpy(data, audio, sizeof(data));
+		LOADTEST_TIMED(run, write_latency, gdf_write(call->speech, data, sizeof(data)));
+	}
+
+	if (++call->turn_frames >= LOADTEST_TURN_FRAMES) {
+		loadtest_start_turn(run, call);
+	}
+}
+
+static void *loadtest_worker_thread(void *data)
+{
+	struct loadtest_worker *worker = data;
+	struct loadtest_run *run = worker->run;
+	int64_t tick_us = run->speed ? 20000 / run->speed : 0;
+	int64_t started = monotonic_us();
+	int64_t cpu_start = thread_cpu_us();
+	struct rusage usage_start;
+	struct rusage usage_end;
+	int frame;
+	int i;
+
+	getrusage(RUSAGE_THREAD, &usage_start);
+
+	for (i = worker->index; i < run->call_count; i += run->worker_count) {
+		loadtest_start_turn(run, &run->calls[i]);
+	}
+
+	for (frame = 0; frame < run->frames; frame++) {
+		if (tick_us) {
+			int64_t wait_us = started + frame * tick_us - monotonic_us();
+			if (wait_us > 0) {
+				usleep(wait_us);
+			} else if (wait_us < -tick_us) {
+				/* a whole frame behind, so this many calls can't be kept up with at this speed */
+				ast_atomic_fetchadd_int(&run->late_ticks, 1);
+			}
+		}
+		for (i = worker->index; i < run->call_count; i += run->worker_count) {
+			loadtest_call_frame(run, &run->calls[i], frame);
+		}
+	}
+
+	getrusage(RUSAGE_THREAD, &usage_end);
+	__sync_fetch_and_add(&run->callback_cpu_us, thread_cpu_us() - cpu_start);
+	__sync_fetch_and_add(&run->voluntary_switches, usage_end.ru_nvcsw - usage_start.ru_nvcsw);
+
+	return NULL;
+}
+
+static struct ast_speech *loadtest_speech_alloc(const char *agent, int index)
+{
+	struct ast_speech *speech;
+	char name[32];
+	char *grammar;
+
+	speech = ast_calloc(1, sizeof(*speech));
+	if (!speech) {
+		return NULL;
+	}
+	ast_mutex_init(&speech->lock);
+#ifdef ASTERISK_13_OR_LATER
+	if (gdf_create(speech, ast_format_slin)) {
+#else
+	if (gdf_create(speech, AST_FORMAT_SLINEAR)) {
+#endif
+		ast_mutex_destroy(&speech->lock);
+		ast_free(speech);
+		return NULL;
+	}
+
+	snprintf(name, sizeof(name), "loadtest-%d", index);
+	gdf_change(speech, GDF_PROP_SESSION_ID_NAME, name);
+
+	/* select the agent the way SpeechActivateGrammar does, so a logical agent's settings apply */
+	grammar = alloca(BUILTIN_COLON_GRAMMAR_SLASH_LEN + strlen(agent) + 1);
+	sprintf(grammar, "%s%s", BUILTIN_COLON_GRAMMAR_SLASH, agent); /* safe */
+	gdf_activate(speech, grammar);
+	return speech;
+}
+
+static void loadtest_speech_free(struct loadtest_call *call)
+{
+	gdf_destroy(call->speech);
+	if (call->results) {
+		ast_speech_results_free(call->results);
+	}
+	ast_mutex_destroy(&call->speech->lock);
+	ast_free(call->speech);
+}
+
+/*! \brief raw signed linear 8kHz audio from a file, or a generated pattern of talk and silence */
+static short *loadtest_audio(int fd, const char *filename, int *frames)
+{
+	short *audio;
+	int i;
+
+	if (filename) {
+		FILE *file = fopen(filename, "r");
+		long size;
+
+		if (!file) {
+			ast_cli(fd, "Unable to open %s: %s\n", filename, strerror(errno));
+			return NULL;
+		}
+		fseek(file, 0, SEEK_END);
+		size = ftell(file);
+		rewind(file);
+		*frames = MIN(size, LOADTEST_MAX_AUDIO) / (LOADTEST_FRAME_SAMPLES * sizeof(short));
+		if (*frames < 1) {
+			ast_cli(fd, "%s is shorter than one 20ms frame of 8kHz signed linear audio\n", filename);
+			fclose(file);
+			return NULL;
+		}
+		audio = ast_malloc(*frames * LOADTEST_FRAME_SAMPLES * sizeof(short));
+		if (audio && fread(audio, LOADTEST_FRAME_SAMPLES * sizeof(short), *frames, file) != *frames) {
+			ast_cli(fd, "Unable to read %s\n", filename);
+			ast_free(audio);
+			audio = NULL;
+		}
+		fclose(file);
+		return audio;
+	}
+
+	/* 1.5s of a voiced tone, well above the default VAD threshold, then 1.5s of quiet noise */
+	*frames = 150;
+	audio = ast_malloc(*frames * LOADTEST_FRAME_SAMPLES * sizeof(short));
+	if (!audio) {
+		return NULL;
+	}
+	for (i = 0; i < *frames * LOADTEST_FRAME_SAMPLES; i++) {
+		if (i < *frames * LOADTEST_FRAME_SAMPLES / 2) {
+			audio[i] = (short) (6000 * sin(i * 2 * M_PI * 220 / 8000) + 2000 * sin(i * 2 * M_PI * 1330 / 8000) +
+				(int) (ast_random() % 1000) - 500);
+		} else {
+			audio[i] = (short) ((int) (ast_random() % 100) - 50);
+		}
+	}
+	return audio;
+}
+
+static void print_loadtest_latency(int fd, const char *name, const struct gdfe_stats_histogram *histogram)
+{
+	int total = histogram->total;
+
+	if (!total) {
+		ast_cli(fd, "%-12s %10d\n", name, 0);
+		return;
+	}
+	ast_cli(fd, "%-12s %10d %10" PRId64 " %10" PRId64 " %10" PRId64 " %10d\n", name, total,
+		gdfe_stats_percentile(histogram, total, 50), gdfe_stats_percentile(histogram, total, 90),
+		gdfe_stats_percentile(histogram, total, 99), histogram->max_us);
+}
+
+static char *gdfe_loadtest(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct loadtest_run *run;
+	struct loadtest_worker *workers;
+	pthread_t *threads;
+	const char *agent;
+	const char *filename = NULL;
+	int seconds = 30;
+	int64_t rss_start;
+	int64_t rss_created;
+	int64_t rss_streaming;
+	int64_t wall_us;
+	int64_t process_cpu_us;
+	double call_seconds;
+	struct rusage usage_start;
+	struct rusage usage_end;
+	int created = 0;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe loadtest";
+		e->usage =
+			"Usage: gdfe loadtest <agent> <calls> [seconds [speed [file]]]\n"
+			"       Simulate the given number of calls to a logical agent, each\n"
+			"       streaming the given seconds (default 30) of audio through the\n"
+			"       speech engine's callbacks as SpeechBackground would. speed is a\n"
+			"       multiple of real time (default 1), or 0 for as fast as possible.\n"
+			"       The audio is raw 8kHz signed linear read from file, looped, or a\n"
+			"       generated pattern of talk and silence. Point the agent at a mock\n"
+			"       endpoint unless DialogFlow itself is meant to take the load.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc < 4 || a->argc > 7) {
+		return CLI_SHOWUSAGE;
+	}
+	agent = a->argv[2];
+
+	run = ast_calloc(1, sizeof(*run));
+	if (!run) {
+		return CLI_FAILURE;
+	}
+	run->speed = 1;
+	if (sscanf(a->argv[3], "%d", &run->call_count) != 1 || run->call_count < 1 || run->call_count > LOADTEST_MAX_CALLS
+		|| (a->argc > 4 && (sscanf(a->argv[4], "%d", &seconds) != 1 || seconds < 1 || seconds > 3600))
+		|| (a->argc > 5 && (sscanf(a->argv[5], "%d", &run->speed) != 1 || run->speed < 0 || run->speed > 100))) {
+		ast_free(run);
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc > 6) {
+		filename = a->argv[6];
+	}
+
+	if (ast_atomic_fetchadd_int(&loadtest_running, 1)) {
+		ast_atomic_fetchadd_int(&loadtest_running, -1);
+		ast_cli(a->fd, "A load test or replay is already running, or the module is unloading\n");
+		ast_free(run);
+		return CLI_SUCCESS;
+	}
+
+	run->frames = seconds * 50;
+	run->worker_count = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), run->call_count);
+	run->audio = loadtest_audio(a->fd, filename, &run->audio_frames);
+	run->calls = ast_calloc(run->call_count, sizeof(*run->calls));
+	workers = ast_calloc(run->worker_count, sizeof(*workers));
+	threads = ast_calloc(run->worker_count, sizeof(*threads));
+	if (!run->audio || !run->calls || !workers || !threads) {
+		goto cleanup;
+	}
+
+	rss_start = loadtest_rss_bytes();
+	for (created = 0; created < run->call_count; created++) {
+		run->calls[created].speech = loadtest_speech_alloc(agent, created);
+		if (!run->calls[created].speech) {
+			ast_cli(a->fd, "Unable to create call %d\n", created + 1);
+			goto destroy;
+		}
+		run->calls[created].audio_offset = ast_random() % run->audio_frames;
+	}
+	rss_created = loadtest_rss_bytes();
+
+	ast_cli(a->fd, "Running %d calls of %ds to '%s' at %s on %d threads\n", run->call_count, seconds, agent,
+		run->speed ? (run->speed == 1 ? "real time" : "accelerated pace") : "full speed", run->worker_count);
+
+	getrusage(RUSAGE_SELF, &usage_start);
+	wall_us = monotonic_us();
+	for (i = 0; i < run->worker_count; i++) {
+		workers[i].run = run;
+		workers[i].index = i;
+		if (ast_pthread_create(&threads[i], NULL, loadtest_worker_thread, &workers[i])) {
+			ast_cli(a->fd, "Unable to start worker %d, its calls will be idle\n", i + 1);
+			threads[i] = AST_PTHREADT_NULL;
+		}
+	}
+	for (i = 0; i < run->worker_count; i++) {
+		if (threads[i] != AST_PTHREADT_NULL) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	wall_us = monotonic_us() - wall_us;
+	getrusage(RUSAGE_SELF, &usage_end);
+	rss_streaming = loadtest_rss_bytes();
+
+	process_cpu_us = (int64_t) (usage_end.ru_utime.tv_sec + usage_end.ru_stime.tv_sec
+		- usage_start.ru_utime.tv_sec - usage_start.ru_stime.tv_sec) * 1000000
+		+ usage_end.ru_utime.tv_usec + usage_end.ru_stime.tv_usec - usage_start.ru_utime.tv_usec - usage_start.ru_stime.tv_usec;
+	call_seconds = (double) run->call_count * seconds;
+
+	ast_cli(a->fd, "Wall time:            %.1fs (%.1fx real time)\n", wall_us / 1000000.0, seconds * 1000000.0 / wall_us);
+	ast_cli(a->fd, "Turns:                %d (%d failed to start)\n", run->turns, run->failed_starts);
+	ast_cli(a->fd, "Late frame ticks:     %d\n", run->late_ticks);
+	ast_cli(a->fd, "Callback CPU:         %.1fus per call second, %.0f calls per core\n",
+		run->callback_cpu_us / call_seconds, run->callback_cpu_us ? call_seconds * 1000000.0 / run->callback_cpu_us : 0.0);
+	ast_cli(a->fd, "Process CPU:          %.1fus per call second, %.0f calls per core\n",
+		process_cpu_us / call_seconds, process_cpu_us ? call_seconds * 1000000.0 / process_cpu_us : 0.0);
+	ast_cli(a->fd, "Off CPU in callbacks: %.1fus per call second\n", run->blocked_us / call_seconds);
+	ast_cli(a->fd, "Voluntary switches:   %.2f per call second\n", run->voluntary_switches / call_seconds);
+	ast_cli(a->fd, "Memory per session:   %" PRId64 " bytes created, %" PRId64 " bytes streaming (struct %d bytes)\n",
+		(rss_created - rss_start) / run->call_count, (rss_streaming - rss_start) / run->call_count, (int) sizeof(struct gdf_pvt));
+	ast_cli(a->fd, "%-12s %10s %10s %10s %10s %10s\n", "Latency (us)", "Count", "p50", "p90", "p99", "Max");
+	print_loadtest_latency(a->fd, "write", &run->write_latency);
+	print_loadtest_latency(a->fd, "start", &run->start_latency);
+	print_loadtest_latency(a->fd, "get_results", &run->results_latency);
+
+destroy:
+	for (i = 0; i < created; i++) {
+		loadtest_speech_free(&run->calls[i]);
+	}
+cleanup:
+	ast_free(threads);
+	ast_free(workers);
+	ast_free(run->calls);
+	ast_free((short *) run->audio);
+	ast_free(run);
+	ast_atomic_fetchadd_int(&loadtest_running, -1);
+	ast_cli(a->fd, "\n");
+	return CLI_SUCCESS;
+}
+
+#define BENCHMARK_BATCH		64 /* calls between checks of the clock */
+#define BENCHMARK_MAX_THREADS	256
+
+/* what the single threaded benchmarks work on, a session that is never started */
+struct benchmark_context {
+	struct gdf_pvt *pvt;
+	short slin[LOADTEST_FRAME_SAMPLES];
+	char mulaw[LOADTEST_FRAME_SAMPLES];
+	int sink; /* results go here so the calls are not optimized away */
+};
+
+struct benchmark_thread {
+	int64_t deadline;
+	int64_t ops;
+	int64_t cpu_us;
+};
+
+static void benchmark_audio_level(struct benchmark_context *context)
+{
+	/* as gdf_write calls it, with the frame's length in samples rather than bytes */
+	context->sink += calculate_audio_level(context->slin, sizeof(context->slin) / sizeof(short));
+}
+
+static void benchmark_mulaw(struct benchmark_context *context)
+{
+	context->sink += narrow_to_mulaw(context->pvt, context->slin, LOADTEST_FRAME_SAMPLES);
+}
+
+static void benchmark_record_audio(struct benchmark_context *context)
+{
+	maybe_record_audio(context->pvt, context->mulaw, LOADTEST_FRAME_SAMPLES, VAD_STATE_SPEAK);
+}
+
+static void benchmark_call_log(struct benchmark_context *context)
+{
+	/* the size of a typical end of turn event */
+	struct dialogflow_log_data log_data[] = {
+		{ "uplink_bytes", "24000" },
+		{ "uplink_messages", "30" },
+		{ "language", "en-US" },
+	};
+
+	write_call_log_line(context->pvt, CALL_LOG_TYPE_SESSION, "end", ARRAY_LEN(log_data), log_data);
+}
 
-		ast_mutex_lock(&pvt->lock);
-		language = ast_strdupa(pvt->language);
-		ast_mutex_unlock(&pvt->lock);
+static void benchmark_log_filename(struct benchmark_context *context)
+{
+	context->sink += ast_str_strlen(build_log_related_filename_to_thread_local_str(context->pvt, 1, "pre", "ul"));
+}
 
-		ast_copy_string(tmpFilename, "/tmp/res_speech_gdfe_fulfillment_XXXXXX.wav", sizeof(tmpFilename));
-		fd = mkstemps(tmpFilename, 4);
+static void run_benchmark(int fd, const char *name, void (*benchmark)(struct benchmark_context *),
+	struct benchmark_context *context, int seconds)
+{
+	int64_t wall_us = monotonic_us();
+	int64_t cpu_us = thread_cpu_us();
+	int64_t deadline = wall_us + (int64_t) seconds * 1000000;
+	int64_t ops = 0;
+	int i;
 
-		if (fd >= 0) {
-			close(fd);
-		} else {
-			ast_log(LOG_WARNING, "Unable to create temporary file for fulfillment message\n");
-			sprintf(tmpFilename, "/tmp/res_speech_gdfe_fulfillment_%d.wav", ast_atomic_fetchadd_int(&last_resort, 1));
+	do {
+		for (i = 0; i < BENCHMARK_BATCH; i++) {
+			benchmark(context);
 		}
+		ops += BENCHMARK_BATCH;
+	} while (monotonic_us() < deadline);
+	wall_us = monotonic_us() - wall_us;
+	cpu_us = thread_cpu_us() - cpu_us;
 
-		audioFile = tmpFilename;
+	ast_cli(fd, "%-32s %12" PRId64 " %12.1f %12.1f\n", name, ops, wall_us * 1000.0 / ops, cpu_us * 1000.0 / ops);
+}
 
-		if (google_synth_speech(NULL, key, fulfillment_text->value, language, NULL, tmpFilename)) {
-			ast_log(LOG_WARNING, "Failed to synthesize fulfillment text to %s\n", tmpFilename);
-		} else {
-			struct ast_speech_result *new = ast_calloc(1, sizeof(*new));
-			if (new) {
-				new->text = ast_strdup(tmpFilename);
-				new->score = 100;
-				new->grammar = ast_strdup("fulfillment_audio");
+static void *benchmark_config_thread(void *data)
+{
+	struct benchmark_thread *thread = data;
+	int64_t cpu_us = thread_cpu_us();
+	int i;
 
-				if (end) {
-					AST_LIST_NEXT(end, list) = new;
-					end = new;
-				} else {
-					start = end = new;
-				}
-			} else {
-				ast_log(LOG_WARNING, "Unable to allocate speech result slot for synthesized fulfillment text\n");
+	do {
+		for (i = 0; i < BENCHMARK_BATCH; i++) {
+			struct gdf_config *cfg = gdf_get_config();
+			if (cfg) {
+				ao2_ref(cfg, -1);
 			}
 		}
-	}
+		thread->ops += BENCHMARK_BATCH;
+	} while (monotonic_us() < thread->deadline);
+	thread->cpu_us = thread_cpu_us() - cpu_us;
 
-	if (!ast_strlen_zero(audioFile)) {
-		if (!ast_strlen_zero(pvt->lastAudioResponse)) {
-			unlink(pvt->lastAudioResponse);
+	return NULL;
+}
+
+/*! \brief gdf_get_config() from the given number of threads at once, as every session's frames do */
+static void run_config_benchmark(int fd, int thread_count, int seconds)
+{
+	struct benchmark_thread threads[BENCHMARK_MAX_THREADS] = {};
+	pthread_t thread_ids[BENCHMARK_MAX_THREADS];
+	int64_t wall_us = monotonic_us();
+	int64_t ops = 0;
+	int64_t cpu_us = 0;
+	int started;
+	char name[32];
+
+	for (started = 0; started < thread_count; started++) {
+		threads[started].deadline = wall_us + (int64_t) seconds * 1000000;
+		if (ast_pthread_create(&thread_ids[started], NULL, benchmark_config_thread, &threads[started])) {
+			ast_cli(fd, "Unable to start thread %d\n", started + 1);
+			break;
 		}
-		ast_string_field_set(pvt, lastAudioResponse, audioFile);
 	}
+	while (started-- > 0) {
+		pthread_join(thread_ids[started], NULL);
+		ops += threads[started].ops;
+		cpu_us += threads[started].cpu_us;
+	}
+	wall_us = monotonic_us() - wall_us;
 
-	return start;
+	/* wall time per call as each thread sees it */
+	snprintf(name, sizeof(name), "gdf_get_config/%d", thread_count);
+	ast_cli(fd, "%-32s %12" PRId64 " %12.1f %12.1f\n", name, ops, ops ? wall_us * 1000.0 * thread_count / ops : 0.0,
+		ops ? cpu_us * 1000.0 / ops : 0.0);
 }
 
-static void gdf_config_destroy(void *o)
+static char *gdfe_benchmark_functions(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
-	struct gdf_config *conf = o;
+	struct benchmark_context context = {};
+	struct loadtest_call call = {};
+	struct gdf_config *cfg;
+	int recording;
+	int seconds = 1;
+	int threads;
+	int i;
 
-	ast_string_field_free_memory(conf);
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "gdfe benchmark functions";
+		e->usage =
+			"Usage: gdfe benchmark functions [seconds [threads]]\n"
+			"       Run each of the functions called per frame or per event for the\n"
+			"       given seconds (default 1), and gdf_get_config() from 1, 2, 4...\n"
+			"       up to the given number of threads (default the number of CPUs).\n"
+			"       Each line shows a function, the calls made, and the wall and CPU\n"
+			"       time per call in nanoseconds, for comparing builds.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
 
-	if (conf->logical_agents) {
-		ao2_ref(conf->logical_agents, -1);
+	threads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	if (a->argc > 5
+		|| (a->argc > 3 && (sscanf(a->argv[3], "%d", &seconds) != 1 || seconds < 1 || seconds > 600))
+		|| (a->argc > 4 && (sscanf(a->argv[4], "%d", &threads) != 1 || threads < 1 || threads > BENCHMARK_MAX_THREADS))) {
+		return CLI_SHOWUSAGE;
+	}
+
+	call.speech = loadtest_speech_alloc("benchmark", 0);
+	if (!call.speech) {
+		ast_cli(a->fd, "Unable to create a session\n");
+		return CLI_FAILURE;
+	}
+	context.pvt = call.speech->data;
+	gdf_change(call.speech, GDF_PROP_SESSION_ID_NAME, "benchmark");
+	for (i = 0; i < LOADTEST_FRAME_SAMPLES; i++) {
+		context.slin[i] = (short) (6000 * sin(i * 2 * M_PI * 220 / 8000) + 2000 * sin(i * 2 * M_PI * 1330 / 8000) +
+			(int) (ast_random() % 1000) - 500);
+	}
+
+	cfg = gdf_get_config();
+	/* maybe_record_audio follows what gdf_start would have cached for a turn */
+	context.pvt->turn_record_pre = cfg && cfg->enable_preendpointer_recordings;
+	context.pvt->turn_record_post = cfg && cfg->enable_postendpointer_recordings;
+	recording = context.pvt->turn_record_pre || context.pvt->turn_record_post;
+	if (cfg) {
+		ao2_ref(cfg, -1);
 	}
+
+	/* logs and recordings are written to /dev/null, so the disk is not what gets measured */
+	ast_mutex_lock(&context.pvt->lock);
+	ast_string_field_set(context.pvt, call_log_path, "/var/log/asterisk/dialogflow/benchmark/");
+	ast_string_field_set(context.pvt, call_log_file_basename, "0000_benchmark");
+	context.pvt->call_log_file_handle = fopen("/dev/null", "w");
+	context.pvt->utterance_preendpointer_recording_file_handle = fopen("/dev/null", "w");
+	context.pvt->utterance_postendpointer_recording_file_handle = fopen("/dev/null", "w");
+	ast_mutex_unlock(&context.pvt->lock);
+
+	ast_cli(a->fd, "%-32s %12s %12s %12s\n", "Function", "Calls", "ns/call", "CPU_ns/call");
+	run_benchmark(a->fd, "calculate_audio_level", benchmark_audio_level, &context, seconds);
+	run_benchmark(a->fd, "narrow_to_mulaw", benchmark_mulaw, &context, seconds);
+	/* it follows the recording settings, so the name says which path was measured */
+	run_benchmark(a->fd, recording ? "maybe_record_audio/recording" : "maybe_record_audio/off",
+		benchmark_record_audio, &context, seconds);
+	run_benchmark(a->fd, "gdf_log_call_event", benchmark_call_log, &context, seconds);
+	run_benchmark(a->fd, "build_log_related_filename", benchmark_log_filename, &context, seconds);
+	for (i = 1; i < threads; i *= 2) {
+		run_config_benchmark(a->fd, i, seconds);
+	}
+	run_config_benchmark(a->fd, threads, seconds);
+
+	ast_mutex_lock(&context.pvt->lock);
+	if (context.pvt->utterance_preendpointer_recording_file_handle) {
+		fclose(context.pvt->utterance_preendpointer_recording_file_handle);
+		context.pvt->utterance_preendpointer_recording_file_handle = NULL;
+	}
+	if (context.pvt->utterance_postendpointer_recording_file_handle) {
+		fclose(context.pvt->utterance_postendpointer_recording_file_handle);
+		context.pvt->utterance_postendpointer_recording_file_handle = NULL;
+	}
+	ast_mutex_unlock(&context.pvt->lock);
+	loadtest_speech_free(&call);
+
+	ast_cli(a->fd, "\n");
+	return CLI_SUCCESS;
 }
 
-static struct gdf_config *gdf_get_config(void)
+#define REPLAY_DEFAULT_CALLS	100
+#define REPLAY_MAX_DEPTH	8 /* of directories under the one given */
+
+enum replay_decision {
+	REPLAY_START_OF_SPEECH,
+	REPLAY_END_OF_SPEECH,
+	REPLAY_BARGE_IN,
+	REPLAY_DECISIONS
+};
+
+/* the ENDPOINTER events that are compared, named as in the call log */
+static const char *replay_decision_names[] = {
+	[REPLAY_START_OF_SPEECH] = "start_of_speech",
+	[REPLAY_END_OF_SPEECH] = "end_of_speech",
+	[REPLAY_BARGE_IN] = "barge_in",
+};
+
+/* a recorded turn, with the ms from its start at which the original call made each decision, or -1 */
+struct replay_turn {
+	char *recording;
+	char language[16];
+	int voice_duration;
+	int original_ms[REPLAY_DECISIONS];
+	int original_turn_ms;
+};
+
+/* the recorded turns of one call log, replayed in order on one session */
+struct replay_call {
+	struct replay_turn *turns;
+	int turn_count;
+};
+
+struct replay_comparison {
+	int matched;
+	int missing; /* made by the original call but not the replay */
+	int extra; /* made by the replay only */
+	struct gdfe_stats_histogram difference; /* between the times of matched decisions */
+};
+
+struct replay_run {
+	struct replay_call *calls;
+	int call_count;
+	int skipped_turns; /* event and text turns, or turns that were not recorded */
+	const char *agent;
+	int speed; /* times real time, 0 for as fast as possible */
+	int worker_count;
+	int slots_per_worker;
+	FILE *report;
+	ast_mutex_t report_lock;
+
+	/* updated with atomic operations only */
+	int next_call;
+	struct replay_comparison comparisons[REPLAY_DECISIONS];
+	struct gdfe_stats_histogram original_turn;
+	struct gdfe_stats_histogram replayed_turn;
+	int turns;
+	int failed_starts;
+	int unfinished;
+	int late_ticks;
+};
+
+/* where one simulated call at a time is replayed */
+struct replay_slot {
+	struct loadtest_call session;
+	struct replay_call *call;
+	int turn;
+	short *audio; /* the current turn's recording, NULL between turns */
+	int audio_frames;
+	int lead_frames; /* of silence, as the recording only starts once speech was detected */
+	int start_of_speech_shift; /* ms of voice before the recording that the original VAD heard */
+	int frame;
+	int replayed_ms[REPLAY_DECISIONS];
+};
+
+struct replay_worker {
+	struct replay_run *run;
+	struct replay_slot *slots;
+};
+
+/* the fields of a call log line that replay uses */
+struct call_log_line {
+	char type[16];
+	char event[64];
+	char timestamp[40];
+	char language[16];
+	int utterance;
+	int voice_duration;
+};
+
+static int parse_call_log_line(const char *text, struct call_log_line *line)
 {
-	struct gdf_config *cfg;
+	const char *value;
 #ifdef ASTERISK_13_OR_LATER
-	ao2_rdlock(config);
+	struct ast_json *json = ast_json_load_string(text, NULL);
+#define CALL_LOG_FIELD(name) ast_json_string_get(ast_json_object_get(json, name))
 #else
-	ao2_lock(config);
+	json_t *json = json_loads(text, 0, NULL);
+#define CALL_LOG_FIELD(name) json_string_value(json_object_get(json, name))
 #endif
-	cfg = ao2_find(config, NULL, 0);
-	ao2_unlock(config);
-	return cfg;
-}
-
-static void logical_agent_destructor(void *obj)
-{
-	/* noop */
-}
 
-static struct gdf_logical_agent *logical_agent_alloc(const char *name, const char *project_id, const char *service_key, const char *endpoint)
-{
-	size_t name_len = strlen(name);
-	size_t project_id_len = strlen(project_id);
-	size_t service_key_len = strlen(service_key);
-	size_t endpoint_len = strlen(endpoint);
-	size_t space_needed = name_len + 1 +
-							project_id_len + 1 +
-							service_key_len + 1 +
-							endpoint_len + 1;
-	struct gdf_logical_agent *agent;
-	
-	agent = ao2_alloc(space_needed + sizeof(struct gdf_logical_agent), logical_agent_destructor);
-	if (agent) {
-		ast_copy_string(agent->endpoint, endpoint, endpoint_len + 1);
-		agent->service_key = agent->endpoint + endpoint_len + 1;
-		ast_copy_string((char *)agent->service_key, service_key, service_key_len + 1);
-		agent->project_id = agent->service_key + service_key_len + 1;
-		ast_copy_string((char *)agent->project_id, project_id, project_id_len + 1);
-		agent->name = agent->project_id + project_id_len + 1;
-		ast_copy_string((char *)agent->name, name, name_len + 1);
+	if (!json) {
+		return -1;
 	}
+	value = CALL_LOG_FIELD("log_type");
+	ast_copy_string(line->type, S_OR(value, ""), sizeof(line->type));
+	value = CALL_LOG_FIELD("log_event");
+	ast_copy_string(line->event, S_OR(value, ""), sizeof(line->event));
+	value = CALL_LOG_FIELD("log_timestamp");
+	ast_copy_string(line->timestamp, S_OR(value, ""), sizeof(line->timestamp));
+	value = CALL_LOG_FIELD("language");
+	ast_copy_string(line->language, S_OR(value, ""), sizeof(line->language));
+	value = CALL_LOG_FIELD("utterance");
+	line->utterance = value ? atoi(value) : 0;
+	value = CALL_LOG_FIELD(VAD_PROP_VOICE_DURATION);
+	line->voice_duration = value ? atoi(value) : 0;
+#undef CALL_LOG_FIELD
 
-	return agent;
-}
-
-static int logical_agent_hash_callback(const void *obj, const int flags)
-{
-	const struct gdf_logical_agent *agent = obj;
-	return ast_str_case_hash(agent->name);
+#ifdef ASTERISK_13_OR_LATER
+	ast_json_unref(json);
+#else
+	json_decref(json);
+#endif
+	return 0;
 }
 
-static int logical_agent_compare_callback(void *obj, void *other, int flags)
+/*! \brief a call log timestamp in ms, ignoring its zone as a call's timestamps all share one */
+static int64_t call_log_timestamp_ms(const char *timestamp)
 {
-	const struct gdf_logical_agent *agentA = obj;
-	const struct gdf_logical_agent *agentB = other;
-	return (!strcasecmp(agentA->name, agentB->name) ? CMP_MATCH | CMP_STOP : 0);
-}
+	struct tm tm = {};
+	int ms;
 
-static struct gdf_logical_agent *get_logical_agent_by_name(struct gdf_config *config, const char *name)
-{
-	struct gdf_logical_agent tmpAgent = { .name = name };
-	return ao2_find(config->logical_agents, &tmpAgent, OBJ_POINTER);
+	if (sscanf(timestamp, "%d-%d-%dT%d:%d:%d.%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+		&tm.tm_sec, &ms) != 7) {
+		return -1;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	return (int64_t) timegm(&tm) * 1000 + ms;
 }
 
-static struct ast_str *load_service_key(const char *val)
+/*! \brief read the turns of a call log that have a pre-endpointer recording next to it */
+static void load_replay_call(struct replay_run *run, const char *log_path)
 {
-	struct ast_str *buffer = ast_str_create(3 * 1024); /* big enough for the typical key size */
-	if (!buffer) {
-		ast_log(LOG_WARNING, "Memory allocation failure allocating ast_str for loading service key\n");
-		return NULL;
+	struct replay_call call = {};
+	struct replay_turn *turn = NULL;
+	int prefix_len = strlen(log_path) - strlen("_log.jsonl");
+	int64_t turn_start = 0;
+	char *text = NULL;
+	size_t text_size = 0;
+	FILE *file;
+
+	file = fopen(log_path, "r");
+	if (!file) {
+		ast_log(LOG_WARNING, "Unable to open call log %s -- %d: %s\n", log_path, errno, strerror(errno));
+		return;
 	}
 
-	if (strchr(val, '{')) {
-		ast_str_set(&buffer, 0, val);
-	} else {
-		FILE *f;
-		ast_log(LOG_DEBUG, "Loading service key data from %s\n", val);
-		f = fopen(val, "r");
-		if (f) {
-			char readbuffer[512];
-			size_t read = fread(readbuffer, sizeof(char), sizeof(readbuffer), f);
-			while (read > 0) {
-				ast_str_append_substr(&buffer, 0, readbuffer, read);
-				read = fread(readbuffer, sizeof(char), sizeof(readbuffer), f);
+	while (getline(&text, &text_size, file) > 0) {
+		struct call_log_line line;
+		int64_t at;
+		int i;
+
+		if (parse_call_log_line(text, &line)) {
+			continue;
+		}
+		at = call_log_timestamp_ms(line.timestamp);
+
+		if (!strcmp(line.type, "SESSION") && !strcmp(line.event, "start")) {
+			struct replay_turn *turns;
+			struct stat st;
+			char *recording;
+
+			turn = NULL;
+			if (ast_asprintf(&recording, "%.*s_pre_%d.ul", prefix_len, log_path, line.utterance) < 0) {
+				break;
 			}
-			if (ferror(f)) {
-				ast_log(LOG_WARNING, "Error reading %s -- %d\n", val, errno);
+			if (stat(recording, &st) || at < 0) {
+				ast_free(recording);
+				run->skipped_turns++;
+				continue;
 			}
-			fclose(f);
-		} else {
-			ast_log(LOG_ERROR, "Unable to open service key file %s -- %d\n", val, errno);
+			turns = ast_realloc(call.turns, (call.turn_count + 1) * sizeof(*turns));
+			if (!turns) {
+				ast_free(recording);
+				break;
+			}
+			call.turns = turns;
+			turn = &call.turns[call.turn_count++];
+			memset(turn, 0, sizeof(*turn));
+			turn->recording = recording;
+			ast_copy_string(turn->language, line.language, sizeof(turn->language));
+			for (i = 0; i < REPLAY_DECISIONS; i++) {
+				turn->original_ms[i] = -1;
+			}
+			turn->original_turn_ms = -1;
+			turn_start = at;
+		} else if (!turn || at < 0) {
+			continue;
+		} else if (!strcmp(line.type, "ENDPOINTER")) {
+			if (!strcmp(line.event, "start")) {
+				turn->voice_duration = line.voice_duration;
+			}
+			for (i = 0; i < REPLAY_DECISIONS; i++) {
+				if (!strcmp(line.event, replay_decision_names[i]) && turn->original_ms[i] < 0) {
+					turn->original_ms[i] = at - turn_start;
+				}
+			}
+		} else if (!strcmp(line.type, "SESSION") && !strcmp(line.event, "end")) {
+			turn->original_turn_ms = at - turn_start;
+			turn = NULL;
 		}
 	}
-
-	return buffer;
+	ast_std_free(text);
+	fclose(file);
+
+	if (call.turn_count) {
+		struct replay_call *calls = ast_realloc(run->calls, (run->call_count + 1) * sizeof(*calls));
+		if (calls) {
+			run->calls = calls;
+			run->calls[run->call_count++] = call;
+			return;
+		}
+	}
+	while (call.turn_count--) {
+		ast_free(call.turns[call.turn_count].recording);
+	}
+	ast_free(call.turns);
 }
 
-#define CONFIGURATION_FILENAME		"res_speech_gdfe.conf"
-static int load_config(int reload)
+static void find_call_logs(struct replay_run *run, const char *path, int depth)
 {
-	struct ast_config *cfg = NULL;
-	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	struct dirent *entry;
+	DIR *dir;
 
-	cfg = ast_config_load(CONFIGURATION_FILENAME, config_flags);
-	if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
-		ast_log(LOG_DEBUG, "Configuration unchanged.\n");
-	} else {
-		struct gdf_config *conf;
-		const char *val;
-		const char *category;
+	dir = opendir(path);
+	if (!dir) {
+		ast_log(LOG_WARNING, "Unable to read %s -- %d: %s\n", path, errno, strerror(errno));
+		return;
+	}
+	while ((entry = readdir(dir))) {
+		size_t len = strlen(entry->d_name);
+		struct stat st;
+		char *child;
 
-		if (cfg == CONFIG_STATUS_FILEINVALID) {
-			ast_log(LOG_WARNING, "Configuration file invalid\n");
-			cfg = ast_config_new();
-		} else if (cfg == CONFIG_STATUS_FILEMISSING) {
-			ast_log(LOG_WARNING, "Configuration not found, using defaults\n");
-			cfg = ast_config_new();
+		if (entry->d_name[0] == '.' || ast_asprintf(&child, "%s/%s", path, entry->d_name) < 0) {
+			continue;
 		}
-		
-		conf = ao2_alloc(sizeof(*conf), gdf_config_destroy);
-		if (!conf) {
-			ast_log(LOG_WARNING, "Failed to allocate config record for speech gdf\n");
-			ast_config_destroy(cfg);
-			return AST_MODULE_LOAD_FAILURE;
+		if (stat(child, &st)) {
+			/* gone since it was listed */
+		} else if (S_ISDIR(st.st_mode) && depth < REPLAY_MAX_DEPTH) {
+			find_call_logs(run, child, depth + 1);
+		} else if (S_ISREG(st.st_mode) && len > strlen("_log.jsonl") &&
+			!strcmp(entry->d_name + len - strlen("_log.jsonl"), "_log.jsonl")) {
+			load_replay_call(run, child);
 		}
+		ast_free(child);
+	}
+	closedir(dir);
+}
 
-		if (ast_string_field_init(conf, 3 * 1024)) {
-			ast_log(LOG_WARNING, "Failed to allocate string fields for config for speech gdf\n");
-			ao2_ref(conf, -1);
-			ast_config_destroy(cfg);
-			return AST_MODULE_LOAD_FAILURE;
-		}
+/*! \brief a mu-law recording as signed linear, padded with silence to whole frames */
+static short *replay_audio(const char *recording, int *frames)
+{
+	unsigned char *mulaw;
+	short *audio;
+	long size;
+	FILE *file;
+	int i;
 
-		conf->logical_agents = ao2_container_alloc(32, logical_agent_hash_callback, logical_agent_compare_callback);
-		if (!conf->logical_agents) {
-			ast_log(LOG_WARNING, "Failed to allocate logical agent container for speech gdf\n");
-			ao2_ref(conf, -1);
-			ast_config_destroy(cfg);
-		}
+	file = fopen(recording, "r");
+	if (!file) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	rewind(file);
+	if (size <= 0 || size > LOADTEST_MAX_AUDIO) {
+		fclose(file);
+		return NULL;
+	}
 
-		val = ast_variable_retrieve(cfg, "general", "service_key");
-		if (ast_strlen_zero(val)) {
-			ast_log(LOG_VERBOSE, "Service key not provided -- will use default credentials.\n");
-		} else {
-			struct ast_str *buffer = load_service_key(val);
-			ast_string_field_set(conf, service_key, ast_str_buffer(buffer));
-			ast_free(buffer);
-		}
+	*frames = (size + LOADTEST_FRAME_SAMPLES - 1) / LOADTEST_FRAME_SAMPLES;
+	mulaw = ast_malloc(*frames * LOADTEST_FRAME_SAMPLES);
+	audio = ast_malloc(*frames * LOADTEST_FRAME_SAMPLES * sizeof(short));
+	if (!mulaw || !audio || fread(mulaw, 1, size, file) != (size_t) size) {
+		ast_free(mulaw);
+		ast_free(audio);
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
 
-		val = ast_variable_retrieve(cfg, "general", "endpoint");
-		if (!ast_strlen_zero(val)) {
-			ast_string_field_set(conf, endpoint, val);
-		}
+	memset(mulaw + size, 0xff, *frames * LOADTEST_FRAME_SAMPLES - size); /* mu-law silence */
+	for (i = 0; i < *frames * LOADTEST_FRAME_SAMPLES; i++) {
+		audio[i] = AST_MULAW(mulaw[i]);
+	}
+	ast_free(mulaw);
+	return audio;
+}
 
-		conf->vad_voice_threshold = 512;
-		val = ast_variable_retrieve(cfg, "general", "vad_voice_threshold");
-		if (!ast_strlen_zero(val)) {
-			int i;
-			if (sscanf(val, "%d", &i) == 1) {
-				conf->vad_voice_threshold = i;
-			} else {
-				ast_log(LOG_WARNING, "Invalid value for vad_voice_threshold\n");
-			}
-		}
+/*! \brief start the next of the call's turns that can be replayed, or return 0 if it has none left */
+static int replay_start_turn(struct replay_run *run, struct replay_slot *slot)
+{
+	struct ast_speech *speech = slot->session.speech;
+
+	for (; slot->turn < slot->call->turn_count; slot->turn++) {
+		struct replay_turn *turn = &slot->call->turns[slot->turn];
+		int state;
+		int i;
 
-		conf->vad_voice_minimum_duration = 40; /* ms */
-		val = ast_variable_retrieve(cfg, "general", "vad_voice_minimum_duration");
-		if (!ast_strlen_zero(val)) {
-			int i;
-			if (sscanf(val, "%d", &i) == 1) {
-				conf->vad_voice_minimum_duration = i;
-			} else {
-				ast_log(LOG_WARNING, "Invalid value for vad_voice_minimum_duration\n");
-			}
+		slot->audio = replay_audio(turn->recording, &slot->audio_frames);
+		if (!slot->audio) {
+			ast_log(LOG_WARNING, "Unable to read recording %s\n", turn->recording);
+			ast_atomic_fetchadd_int(&run->failed_starts, 1);
+			continue;
 		}
-
-		conf->vad_silence_minimum_duration = 500; /* ms */
-		val = ast_variable_retrieve(cfg, "general", "vad_silence_minimum_duration");
-		if (!ast_strlen_zero(val)) {
-			int i;
-			if (sscanf(val, "%d", &i) == 1) {
-				conf->vad_silence_minimum_duration = i;
-			} else {
-				ast_log(LOG_WARNING, "Invalid value for vad_silence_minimum_duration\n");
-			}
+		/*
+		 * The recording starts with the frame on which the original VAD detected speech, so it is played
+		 * at that frame and the audio after it lines up with the original. The voice_duration of voice
+		 * that led up to the detection was not recorded, so the replayed VAD hears voice_duration - 20ms
+		 * less of it and the replayed start_of_speech is moved back by that much.
+		 */
+		slot->lead_frames = MAX(turn->original_ms[REPLAY_START_OF_SPEECH] / 20 - 1, 0);
+		slot->start_of_speech_shift = MAX(turn->voice_duration - 20, 0);
+		slot->frame = 0;
+		for (i = 0; i < REPLAY_DECISIONS; i++) {
+			slot->replayed_ms[i] = -1;
 		}
 
-		ast_string_field_set(conf, call_log_location, "/var/log/dialogflow/${APPLICATION}/${STRFTIME(,,%Y/%m/%d/%H)}/");
-		val = ast_variable_retrieve(cfg, "general", "call_log_location");
-		if (!ast_strlen_zero(val)) {
-			ast_string_field_set(conf, call_log_location, val);
+		if (slot->session.results) {
+			ast_speech_results_free(slot->session.results);
+			slot->session.results = NULL;
 		}
-
-		conf->enable_call_logs = 1;
-		val = ast_variable_retrieve(cfg, "general", "enable_call_logs");
-		if (!ast_strlen_zero(val)) {
-			conf->enable_call_logs = ast_true(val);
+		if (!ast_strlen_zero(turn->language)) {
+			gdf_change(speech, GDF_PROP_LANGUAGE_NAME, turn->language);
+		}
+		/* as ast_speech_start does */
+		ast_clear_flag(speech, AST_SPEECH_SPOKE);
+		ast_clear_flag(speech, AST_SPEECH_QUIET);
+		gdf_start(speech);
+		/* gdf_start reports a turn it could not start through the state, not its return value */
+		ast_mutex_lock(&speech->lock);
+		state = speech->state;
+		ast_mutex_unlock(&speech->lock);
+		if (state != AST_SPEECH_STATE_NOT_READY) {
+			ast_atomic_fetchadd_int(&run->turns, 1);
+			return 1;
 		}
+		ast_atomic_fetchadd_int(&run->failed_starts, 1);
+		ast_free(slot->audio);
+		slot->audio = NULL;
+	}
+	return 0;
+}
 
-		conf->enable_preendpointer_recordings = 0;
-		val = ast_variable_retrieve(cfg, "general", "enable_preendpointer_recordings");
-		if (!ast_strlen_zero(val)) {
-			conf->enable_preendpointer_recordings = ast_true(val);
+/*! \brief compare the turn with the original, turn_ms being -1 if it never finished */
+static void replay_finish_turn(struct replay_run *run, struct replay_slot *slot, int turn_ms)
+{
+	struct replay_turn *turn = &slot->call->turns[slot->turn];
+	int i;
+
+	for (i = 0; i < REPLAY_DECISIONS; i++) {
+		struct replay_comparison *comparison = &run->comparisons[i];
+		int original = turn->original_ms[i];
+		int replayed = slot->replayed_ms[i];
+
+		if (original >= 0 && replayed >= 0) {
+			ast_atomic_fetchadd_int(&comparison->matched, 1);
+			add_latency_sample(&comparison->difference, (int64_t) abs(replayed - original) * 1000);
+		} else if (original >= 0) {
+			ast_atomic_fetchadd_int(&comparison->missing, 1);
+		} else if (replayed >= 0) {
+			ast_atomic_fetchadd_int(&comparison->extra, 1);
 		}
+	}
+	if (turn->original_turn_ms >= 0) {
+		add_latency_sample(&run->original_turn, (int64_t) turn->original_turn_ms * 1000);
+	}
+	if (turn_ms >= 0) {
+		add_latency_sample(&run->replayed_turn, (int64_t) turn_ms * 1000);
+	} else {
+		ast_atomic_fetchadd_int(&run->unfinished, 1);
+	}
 
-		conf->enable_postendpointer_recordings = 0;
-		val = ast_variable_retrieve(cfg, "general", "enable_postendpointer_recordings");
-		if (!ast_strlen_zero(val)) {
-			conf->enable_postendpointer_recordings = ast_true(val);
+	if (run->report) {
+		ast_mutex_lock(&run->report_lock);
+		fprintf(run->report, "%s %d %d %d %d %d %d %d %d\n", turn->recording,
+			turn->original_ms[REPLAY_START_OF_SPEECH], slot->replayed_ms[REPLAY_START_OF_SPEECH],
+			turn->original_ms[REPLAY_END_OF_SPEECH], slot->replayed_ms[REPLAY_END_OF_SPEECH],
+			turn->original_ms[REPLAY_BARGE_IN], slot->replayed_ms[REPLAY_BARGE_IN],
+			turn->original_turn_ms, turn_ms);
+		ast_mutex_unlock(&run->report_lock);
+	}
+
+	ast_free(slot->audio);
+	slot->audio = NULL;
+	slot->turn++;
+}
+
+/*! \brief one 20ms tick of a slot, returning 0 once there are no calls left for it */
+static int replay_slot_frame(struct replay_run *run, struct replay_slot *slot)
+{
+	struct ast_speech *speech;
+	struct gdf_pvt *pvt;
+	enum VAD_STATE vad_state;
+	short data[LOADTEST_FRAME_SAMPLES];
+	int audio_frame;
+	int state;
+
+	if (!slot->call) {
+		int index = ast_atomic_fetchadd_int(&run->next_call, 1);
+		if (index >= run->call_count) {
+			return 0;
+		}
+		slot->call = &run->calls[index];
+		slot->turn = 0;
+		slot->session.speech = loadtest_speech_alloc(run->agent, index);
+		if (!slot->session.speech) {
+			ast_atomic_fetchadd_int(&run->failed_starts, slot->call->turn_count);
+			slot->call = NULL;
 		}
+		return 1;
+	}
+	if (!slot->audio && !replay_start_turn(run, slot)) {
+		loadtest_speech_free(&slot->session);
+		memset(&slot->session, 0, sizeof(slot->session));
+		slot->call = NULL;
+		return 1;
+	}
 
-		category = NULL;
-		while ((category = ast_category_browse(cfg, category))) {
-			if (strcasecmp("general", category)) {
-				const char *name = category;
-				const char *project_id = ast_variable_retrieve(cfg, category, "project_id");
-				const char *endpoint = ast_variable_retrieve(cfg, category, "endpoint");
-				const char *service_key = ast_variable_retrieve(cfg, category, "service_key");
+	speech = slot->session.speech;
+	pvt = speech->data;
+	ast_mutex_lock(&speech->lock);
+	state = speech->state;
+	ast_mutex_unlock(&speech->lock);
 
-				if (!ast_strlen_zero(service_key)) {
-					struct ast_str *buffer = load_service_key(service_key);
-					if (buffer) {
-						service_key = ast_strdupa(ast_str_buffer(buffer));
-						ast_free(buffer);
-					}
-				}
+	if (state == AST_SPEECH_STATE_DONE) {
+		slot->session.results = gdf_get_results(speech);
+		replay_finish_turn(run, slot, slot->frame * 20);
+		return 1;
+	}
+	if (state != AST_SPEECH_STATE_READY || slot->frame >= LOADTEST_TURN_FRAMES) {
+		replay_finish_turn(run, slot, -1);
+		return 1;
+	}
 
-				if (!ast_strlen_zero(project_id)) {
-					struct gdf_logical_agent *agent;
-					
-					agent = logical_agent_alloc(name, project_id, S_OR(service_key, ""), S_OR(endpoint, ""));
-					if (agent) {
-						ao2_link(conf->logical_agents, agent);
-						ao2_ref(agent, -1);
-					} else {
-						ast_log(LOG_WARNING, "Memory allocation failed creating logical agent %s\n", name);
-					}
-				} else {
-					ast_log(LOG_WARNING, "Mapped project_id is required for %s\n", name);
-				}
+	/* the caller is taken to be silent before and after the recording */
+	audio_frame = slot->frame - slot->lead_frames;
+	if (audio_frame >= 0 && audio_frame < slot->audio_frames) {
+		memcpy(data, slot->audio + audio_frame * LOADTEST_FRAME_SAMPLES, sizeof(data));
+	} else {
+		memset(data, 0, sizeof(data));
+	}
+	gdf_write(speech, data, sizeof(data));
+	slot->frame++;
+
+	ast_mutex_lock(&pvt->lock);
+	vad_state = pvt->vad_state;
+	ast_mutex_unlock(&pvt->lock);
+	if (vad_state != VAD_STATE_START && slot->replayed_ms[REPLAY_START_OF_SPEECH] < 0) {
+		slot->replayed_ms[REPLAY_START_OF_SPEECH] = MAX(slot->frame * 20 - slot->start_of_speech_shift, 0);
+	}
+	if (vad_state == VAD_STATE_SILENT && slot->replayed_ms[REPLAY_END_OF_SPEECH] < 0) {
+		slot->replayed_ms[REPLAY_END_OF_SPEECH] = slot->frame * 20;
+	}
+	if (ast_test_flag(speech, AST_SPEECH_SPOKE) && slot->replayed_ms[REPLAY_BARGE_IN] < 0) {
+		slot->replayed_ms[REPLAY_BARGE_IN] = slot->frame * 20;
+	}
+	return 1;
+}
+
+static void *replay_worker_thread(void *data)
+{
+	struct replay_worker *worker = data;
+	struct replay_run *run = worker->run;
+	int64_t tick_us = run->speed ? 20000 / run->speed : 0;
+	int64_t started = monotonic_us();
+	int64_t tick;
+	int active = 1;
+	int i;
+
+	for (tick = 0; active; tick++) {
+		if (tick_us) {
+			int64_t wait_us = started + tick * tick_us - monotonic_us();
+			if (wait_us > 0) {
+				usleep(wait_us);
+			} else if (wait_us < -tick_us) {
+				ast_atomic_fetchadd_int(&run->late_ticks, 1);
 			}
 		}
-
-		/* swap out the configs */
-#ifdef ASTERISK_13_OR_LATER
-		ao2_wrlock(config);
-#else
-		ao2_lock(config);
-#endif
-		{
-			struct gdf_config *old_config = gdf_get_config();
-			ao2_unlink(config, old_config);
-			ao2_ref(old_config, -1);
+		active = 0;
+		for (i = 0; i < run->slots_per_worker; i++) {
+			active |= replay_slot_frame(run, &worker->slots[i]);
 		}
-		ao2_link(config, conf);
-		ao2_unlock(config);
-		ao2_ref(conf, -1);
 	}
 
-	if (cfg) {
-		ast_config_destroy(cfg);
-	}
-	
-	return AST_MODULE_LOAD_SUCCESS;
+	return NULL;
 }
 
-static char *gdfe_reload(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+static void print_replay_histogram(int fd, const char *name, const struct gdfe_stats_histogram *histogram)
 {
-	switch (cmd) {
-	case CLI_INIT:
-		e->command = "gdfe reload";
-		e->usage = 
-			"Usage: gdfe reload\n"
-			"       Reload res_speech_gdfe configuration.\n";
-		return NULL;
-	case CLI_GENERATE:
-		return NULL;
-	default:
-		ast_cli(a->fd, "Reloading res_speech_gdfe config from " CONFIGURATION_FILENAME "\n");
-		load_config(1);
-		ast_cli(a->fd, "Reload complete\n");
-		ast_cli(a->fd, "\n\n");
-		return CLI_SUCCESS;
+	int total = histogram->total;
+
+	if (!total) {
+		ast_cli(fd, "%-16s %8d\n", name, 0);
+		return;
 	}
+	ast_cli(fd, "%-16s %8d %10" PRId64 " %10" PRId64 " %10" PRId64 " %10d\n", name, total,
+		gdfe_stats_percentile(histogram, total, 50) / 1000, gdfe_stats_percentile(histogram, total, 90) / 1000,
+		gdfe_stats_percentile(histogram, total, 99) / 1000, histogram->max_us / 1000);
 }
 
-static char *gdfe_show_config(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+static char *gdfe_replay(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
-	struct gdf_config *config;
-	
+	struct replay_run *run;
+	struct replay_worker *workers = NULL;
+	struct replay_slot *slots = NULL;
+	pthread_t *threads = NULL;
+	const char *path;
+	int calls_at_once = REPLAY_DEFAULT_CALLS;
+	int64_t wall_us;
+	struct stat st;
+	int turn_count = 0;
+	int i;
+
 	switch (cmd) {
 	case CLI_INIT:
-		e->command = "gdfe show config";
-		e->usage = 
-			"Usage: gdfe show config\n"
-			"       Show current gdfe configuration.\n";
+		e->command = "gdfe replay";
+		e->usage =
+			"Usage: gdfe replay <directory> <agent> [speed [calls [report]]]\n"
+			"       Replay the turns recorded in the call logs under directory (or a\n"
+			"       single *_log.jsonl file) through the speech engine for an agent,\n"
+			"       feeding each turn's pre-endpointer recording to the VAD and the\n"
+			"       stream as its call did, with up to calls (default 100) calls at\n"
+			"       once. speed is a multiple of real time (default 1), or 0 for as\n"
+			"       fast as possible; turn times are only comparable at 1. The\n"
+			"       ENDPOINTER decisions and turn times are compared with the call\n"
+			"       logs, and one line per turn is written to report if given.\n";
 		return NULL;
 	case CLI_GENERATE:
 		return NULL;
-	default:
-		config = gdf_get_config();
-		if (config) {
-			struct ao2_iterator i;
-			struct gdf_logical_agent *agent;
+	}
 
-			ast_cli(a->fd, "[general]\n");
-			ast_cli(a->fd, "service_key = %s\n", config->service_key);
-			ast_cli(a->fd, "endpoint = %s\n", config->endpoint);
-			ast_cli(a->fd, "vad_voice_threshold = %d\n", config->vad_voice_threshold);
-			ast_cli(a->fd, "vad_voice_minimum_duration = %d\n", config->vad_voice_minimum_duration);
-			ast_cli(a->fd, "vad_silence_minimum_duration = %d\n", config->vad_silence_minimum_duration);
-			ast_cli(a->fd, "call_log_location = %s\n", config->call_log_location);
-			ast_cli(a->fd, "enable_call_logs = %s\n", AST_CLI_YESNO(config->enable_call_logs));
-			ast_cli(a->fd, "enable_preendpointer_recordings = %s\n", AST_CLI_YESNO(config->enable_preendpointer_recordings));
-			ast_cli(a->fd, "enable_postendpointer_recordings = %s\n", AST_CLI_YESNO(config->enable_postendpointer_recordings));
-			i = ao2_iterator_init(config->logical_agents, 0);
-			while ((agent = ao2_iterator_next(&i))) {
-				ast_cli(a->fd, "\n[%s]\n", agent->name);
-				ast_cli(a->fd, "project_id = %s\n", agent->project_id);
-				ast_cli(a->fd, "endpoint = %s\n", agent->endpoint);
-				ast_cli(a->fd, "service_key = %s\n", agent->service_key);
-				ao2_ref(agent, -1);
-			}
-			ao2_iterator_destroy(&i);
-			ao2_ref(config, -1);
-		} else {
-			ast_cli(a->fd, "Unable to retrieve configuration\n");
-		}
-		ast_cli(a->fd, "\n");
+	if (a->argc < 4 || a->argc > 7) {
+		return CLI_SHOWUSAGE;
+	}
+	path = a->argv[2];
+
+	run = ast_calloc(1, sizeof(*run));
+	if (!run) {
+		return CLI_FAILURE;
+	}
+	run->agent = a->argv[3];
+	run->speed = 1;
+	if ((a->argc > 4 && (sscanf(a->argv[4], "%d", &run->speed) != 1 || run->speed < 0 || run->speed > 100))
+		|| (a->argc > 5 && (sscanf(a->argv[5], "%d", &calls_at_once) != 1 || calls_at_once < 1
+			|| calls_at_once > LOADTEST_MAX_CALLS))) {
+		ast_free(run);
+		return CLI_SHOWUSAGE;
+	}
+
+	if (ast_atomic_fetchadd_int(&loadtest_running, 1)) {
+		ast_atomic_fetchadd_int(&loadtest_running, -1);
+		ast_cli(a->fd, "A load test or replay is already running, or the module is unloading\n");
+		ast_free(run);
 		return CLI_SUCCESS;
 	}
+	ast_mutex_init(&run->report_lock);
+
+	if (stat(path, &st)) {
+		ast_cli(a->fd, "Unable to find %s\n", path);
+		goto cleanup;
+	} else if (S_ISDIR(st.st_mode)) {
+		find_call_logs(run, path, 0);
+	} else {
+		load_replay_call(run, path);
+	}
+	for (i = 0; i < run->call_count; i++) {
+		turn_count += run->calls[i].turn_count;
+	}
+	if (!turn_count) {
+		ast_cli(a->fd, "No recorded turns found in %s (%d without a recording)\n", path, run->skipped_turns);
+		goto cleanup;
+	}
+
+	if (a->argc > 6) {
+		run->report = fopen(a->argv[6], "w");
+		if (!run->report) {
+			ast_cli(a->fd, "Unable to open %s -- %s\n", a->argv[6], strerror(errno));
+			goto cleanup;
+		}
+		fprintf(run->report, "recording start_of_speech replayed_start_of_speech end_of_speech replayed_end_of_speech "
+			"barge_in replayed_barge_in turn_ms replayed_turn_ms\n");
+	}
+
+	calls_at_once = MIN(calls_at_once, run->call_count);
+	run->worker_count = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), calls_at_once);
+	run->slots_per_worker = (calls_at_once + run->worker_count - 1) / run->worker_count;
+	workers = ast_calloc(run->worker_count, sizeof(*workers));
+	slots = ast_calloc(run->worker_count * run->slots_per_worker, sizeof(*slots));
+	threads = ast_calloc(run->worker_count, sizeof(*threads));
+	if (!workers || !slots || !threads) {
+		goto cleanup;
+	}
+
+	ast_cli(a->fd, "Replaying %d turns from %d calls to '%s' at %s, %d calls at once on %d threads\n", turn_count,
+		run->call_count, run->agent, run->speed ? (run->speed == 1 ? "real time" : "accelerated pace") : "full speed",
+		run->worker_count * run->slots_per_worker, run->worker_count);
+
+	wall_us = monotonic_us();
+	for (i = 0; i < run->worker_count; i++) {
+		workers[i].run = run;
+		workers[i].slots = &slots[i * run->slots_per_worker];
+		if (ast_pthread_create(&threads[i], NULL, replay_worker_thread, &workers[i])) {
+			ast_cli(a->fd, "Unable to start worker %d, the others will take its calls\n", i + 1);
+			threads[i] = AST_PTHREADT_NULL;
+		}
+	}
+	for (i = 0; i < run->worker_count; i++) {
+		if (threads[i] != AST_PTHREADT_NULL) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+	wall_us = monotonic_us() - wall_us;
+
+	ast_cli(a->fd, "Wall time:        %.1fs\n", wall_us / 1000000.0);
+	ast_cli(a->fd, "Turns:            %d replayed, %d failed to start, %d did not finish, %d not recorded\n",
+		run->turns, run->failed_starts, run->unfinished, run->skipped_turns);
+	ast_cli(a->fd, "Late frame ticks: %d\n", run->late_ticks);
+	ast_cli(a->fd, "%-16s %8s %8s %8s %10s %10s %10s\n", "Decision", "Matched", "Missing", "Extra",
+		"p50 diff", "p90 diff", "Max diff");
+	for (i = 0; i < REPLAY_DECISIONS; i++) {
+		const struct replay_comparison *comparison = &run->comparisons[i];
+		int total = comparison->difference.total;
+
+		ast_cli(a->fd, "%-16s %8d %8d %8d %10" PRId64 " %10" PRId64 " %10d\n", replay_decision_names[i],
+			comparison->matched, comparison->missing, comparison->extra,
+			total ? gdfe_stats_percentile(&comparison->difference, total, 50) / 1000 : 0,
+			total ? gdfe_stats_percentile(&comparison->difference, total, 90) / 1000 : 0,
+			comparison->difference.max_us / 1000);
+	}
+	ast_cli(a->fd, "%-16s %8s %10s %10s %10s %10s\n", "Turn time (ms)", "Count", "p50", "p90", "p99", "Max");
+	print_replay_histogram(a->fd, "original", &run->original_turn);
+	print_replay_histogram(a->fd, "replayed", &run->replayed_turn);
+
+cleanup:
+	if (run->report) {
+		fclose(run->report);
+	}
+	for (i = 0; i < run->call_count; i++) {
+		while (run->calls[i].turn_count--) {
+			ast_free(run->calls[i].turns[run->calls[i].turn_count].recording);
+		}
+		ast_free(run->calls[i].turns);
+	}
+	ast_free(run->calls);
+	ast_free(threads);
+	ast_free(slots);
+	ast_free(workers);
+	ast_mutex_destroy(&run->report_lock);
+	ast_free(run);
+	ast_atomic_fetchadd_int(&loadtest_running, -1);
+	ast_cli(a->fd, "\n");
+	return CLI_SUCCESS;
 }
 
 static struct ast_cli_entry gdfe_cli[] = {
 	AST_CLI_DEFINE(gdfe_reload, "Reload gdfe configuration"),
 	AST_CLI_DEFINE(gdfe_show_config, "Show current gdfe configuration"),
+	AST_CLI_DEFINE(gdfe_show_agents, "Show live per-agent admission counters"),
+	AST_CLI_DEFINE(gdfe_show_stats, "Show engine wide counters"),
+	AST_CLI_DEFINE(gdfe_show_latency, "Show per-stage turn latency for each logical agent"),
+	AST_CLI_DEFINE(gdfe_show_sessions, "List live speech sessions"),
+	AST_CLI_DEFINE(gdfe_show_session, "Show the state of one speech session"),
+	AST_CLI_DEFINE(gdfe_benchmark_uplink, "Compare uplink encodings for bandwidth and CPU"),
+	AST_CLI_DEFINE(gdfe_benchmark_resampler, "Measure the 8kHz/16kHz resampler"),
+	AST_CLI_DEFINE(gdfe_benchmark_functions, "Time the engine's per-frame and per-event functions"),
+	AST_CLI_DEFINE(gdfe_loadtest, "Drive simulated calls through the speech engine"),
+	AST_CLI_DEFINE(gdfe_replay, "Replay recorded turns and compare them with their call logs"),
 };
 
 static int call_log_enabled_for_pvt(struct gdf_pvt *pvt)
@@ -1458,6 +7798,13 @@ static int call_log_enabled_for_pvt(struct gdf_pvt *pvt)
 #endif
 
 static void gdf_log_call_event(struct gdf_pvt *pvt, enum gdf_call_log_type type, const char *event, size_t log_data_size, const struct dialogflow_log_data *log_data)
+{
+	if (call_log_enabled_for_pvt(pvt)) {
+		write_call_log_line(pvt, type, event, log_data_size, log_data);
+	}
+}
+
+static void write_call_log_line(struct gdf_pvt *pvt, enum gdf_call_log_type type, const char *event, size_t log_data_size, const struct dialogflow_log_data *log_data)
 {
 	struct timeval timeval_now;
 	struct ast_tm tm_now = {};
@@ -1471,10 +7818,6 @@ static void gdf_log_call_event(struct gdf_pvt *pvt, enum gdf_call_log_type type,
 	json_t *log_message;
 #endif
 
-	if (!call_log_enabled_for_pvt(pvt)) {
-		return;
-	}
-    
 	timeval_now = ast_tvnow();
 	ast_localtime(&timeval_now, &tm_now, NULL);
 
@@ -1564,6 +7907,7 @@ static struct ast_speech_engine gdf_engine = {
 static enum ast_module_load_result load_module(void)
 {
 	struct gdf_config *cfg;
+	int i;
 
 	config = ao2_container_alloc(1, NULL, NULL);
 	if (!config) {
@@ -1581,10 +7925,80 @@ static enum ast_module_load_result load_module(void)
 	ao2_link(config, cfg);
 	ao2_ref(cfg, -1);
 
+	service_key_files = ao2_container_alloc(17, service_key_file_hash_callback, service_key_file_compare_callback);
+	if (!service_key_files) {
+		ast_log(LOG_ERROR, "Failed to allocate service key file container\n");
+		ao2_ref(config, -1);
+		return AST_MODULE_LOAD_FAILURE;
+	}
+
+	agent_runtimes = ao2_container_alloc(32, agent_runtime_hash_callback, agent_runtime_compare_callback);
+	if (!agent_runtimes) {
+		ast_log(LOG_ERROR, "Failed to allocate agent runtime container\n");
+		ao2_ref(service_key_files, -1);
+		ao2_ref(config, -1);
+		return AST_MODULE_LOAD_FAILURE;
+	}
+
+	response_cache = ao2_container_alloc(61, cached_response_hash_callback, cached_response_compare_callback);
+	if (!response_cache) {
+		ast_log(LOG_WARNING, "Failed to allocate response cache, event responses will not be cached\n");
+	}
+
+	ast_mutex_init(&reload_lock);
+	ast_mutex_init(&reload_summary_lock);
+	ast_mutex_init(&engine_stats.lock);
+	engine_stats.started = ast_tvnow();
+	for (i = 0; i < SESSION_REGISTRY_SHARDS; i++) {
+		AST_LIST_HEAD_INIT(&session_registry[i]);
+	}
+	init_resampler_taps();
+
+	reaper = ast_taskprocessor_get("gdfe-reaper", TPS_REF_DEFAULT);
+	if (!reaper) {
+		ast_log(LOG_WARNING, "Failed to create session reaper, sessions will be torn down on the channel thread\n");
+	}
+
 	if (load_config(0)) {
 		ast_log(LOG_WARNING, "Failed to load configuration\n");
 	}
 
+	{
+		struct gdf_config *cfg = gdf_get_config();
+		if (cfg) {
+			/* agent runtimes claim slots as they are created, so this comes first */
+			open_stats_segment(cfg->stats_segment);
+			ao2_ref(cfg, -1);
+		}
+	}
+
+	{
+		struct gdf_config *cfg = gdf_get_config();
+		struct ast_threadpool_options options = {
+			.version = AST_THREADPOOL_OPTIONS_VERSION,
+			.idle_timeout = 0,
+			.auto_increment = 0,
+			.initial_size = cfg ? cfg->event_workers : 0,
+			.max_size = 0,
+		};
+		if (cfg) {
+			ao2_ref(cfg, -1);
+		}
+		event_pool = ast_threadpool_create("gdfe-events", NULL, &options);
+		if (!event_pool) {
+			ast_log(LOG_WARNING, "Failed to create event pool, event requests will fail\n");
+		}
+	}
+
+	event_sched = ast_sched_context_create();
+	if (event_sched && ast_sched_start_thread(event_sched)) {
+		ast_sched_context_destroy(event_sched);
+		event_sched = NULL;
+	}
+	if (!event_sched) {
+		ast_log(LOG_WARNING, "Failed to create event scheduler, event requests will not be hedged or given deadlines\n");
+	}
+
 #ifdef ASTERISK_13_OR_LATER
 	gdf_engine.formats = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
 
@@ -1594,6 +8008,11 @@ static enum ast_module_load_result load_module(void)
 		return AST_MODULE_LOAD_FAILURE;
 	}
 
+	/*
+	 * The format is negotiated against the channel's native formats, so slin16 is only used for channels
+	 * that natively carry it; G.722, Opus and other wideband codecs are still handed 8kHz audio.
+	 */
+	ast_format_cap_append(gdf_engine.formats, ast_format_slin16, 20);
 	ast_format_cap_append(gdf_engine.formats, ast_format_ulaw, 20);
 #else
 	gdf_engine.formats = AST_FORMAT_SLINEAR;
@@ -1618,13 +8037,67 @@ static enum ast_module_load_result load_module(void)
 
 static int unload_module(void)
 {
+	int i;
+
+	/* their sessions and worker threads live in this module, so it cannot go while they run */
+	if (ast_atomic_fetchadd_int(&loadtest_running, 1)) {
+		ast_atomic_fetchadd_int(&loadtest_running, -1);
+		ast_log(LOG_WARNING, "Unable to unload while a gdfe loadtest or replay is running\n");
+		return -1;
+	}
+
 	if (ast_speech_unregister(gdf_engine.name)) {
 		ast_log(LOG_WARNING, "Failed to unregister GDF speech engine\n");
+		ast_atomic_fetchadd_int(&loadtest_running, -1);
 		return -1;
 	}
 
 	ast_cli_unregister_multiple(gdfe_cli, ARRAY_LEN(gdfe_cli));
 
+	/* with the CLI gone no new reload can start; wait out one that is running */
+	if (reload_thread_id != AST_PTHREADT_NULL) {
+		pthread_join(reload_thread_id, NULL);
+		reload_thread_id = AST_PTHREADT_NULL;
+	}
+
+	ast_mutex_lock(&reload_lock);
+	if (service_key_files) {
+		ao2_ref(service_key_files, -1);
+		service_key_files = NULL;
+	}
+	ast_mutex_unlock(&reload_lock);
+	ast_mutex_destroy(&reload_lock);
+	ast_mutex_destroy(&reload_summary_lock);
+
+	if (event_sched) {
+		ast_sched_context_destroy(event_sched);
+		event_sched = NULL;
+	}
+
+	if (event_pool) {
+		ast_threadpool_shutdown(event_pool);
+		event_pool = NULL;
+	}
+
+	if (reaper) {
+		/* outstanding teardowns run before the reaper goes away */
+		reaper = ast_taskprocessor_unreference(reaper);
+	}
+
+	ao2_ref(agent_runtimes, -1);
+	agent_runtimes = NULL;
+
+	close_stats_segment();
+
+	for (i = 0; i < SESSION_REGISTRY_SHARDS; i++) {
+		AST_LIST_HEAD_DESTROY(&session_registry[i]);
+	}
+
+	if (response_cache) {
+		ao2_ref(response_cache, -1);
+		response_cache = NULL;
+	}
+
 #ifdef ASTERISK_13_OR_LATER
 	ao2_t_ref(gdf_engine.formats, -1, "unloading module");
 #endif
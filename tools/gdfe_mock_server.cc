@@ -0,0 +1,866 @@
+/*
+ * gdfe_mock_server -- a local stand-in for the DialogFlow sessions and
+ * text-to-speech gRPC services, for benchmarking and testing
+ * res_speech_gdfe without Google credentials or a network
+ *
+ * Copyright (C) 2018, USAN, Inc.
+ *
+ * Daniel Collins <daniel.collins@usan.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source asterisk tree.
+ *
+ */
+
+/*
+ * Implements Sessions.StreamingDetectIntent, Sessions.DetectIntent and
+ * TextToSpeech.SynthesizeSpeech. Responses come from a script (see
+ * mock_script.conf.sample); each RPC can be given a latency distribution,
+ * a share of injected errors, and the server as a whole concurrency and
+ * rate limits. Random choices come from a generator seeded per RPC from
+ * --seed and the RPC's sequence number, so a run with the same calls in the
+ * same order behaves the same way.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fnmatch.h>
+#include <pthread.h>
+
+#include <grpcpp/grpcpp.h>
+
+#ifndef DIALOGFLOW_API
+#define DIALOGFLOW_API v2beta1
+#endif
+#define MOCK_STRINGIFY(x) #x
+#define MOCK_SESSION_HEADER(api) MOCK_STRINGIFY(google/cloud/dialogflow/api/session.grpc.pb.h)
+
+#include MOCK_SESSION_HEADER(DIALOGFLOW_API)
+#include "google/cloud/texttospeech/v1/cloud_tts.grpc.pb.h"
+
+namespace df = google::cloud::dialogflow::DIALOGFLOW_API;
+namespace tts = google::cloud::texttospeech::v1;
+
+using grpc::ServerContext;
+using grpc::Status;
+using grpc::StatusCode;
+
+namespace {
+
+/* where a latency applies */
+enum stage {
+	STAGE_OPEN, /* before a streaming call reads past its first request */
+	STAGE_INTERIM, /* before the first interim transcript */
+	STAGE_FINAL, /* from the client half-closing to the final result */
+	STAGE_DETECT, /* a DetectIntent call, or an event or text streaming call */
+	STAGE_TTS,
+	STAGE_COUNT
+};
+
+const char *stage_names[STAGE_COUNT] = { "open", "interim", "final", "detect", "tts" };
+
+/* where an error can be injected */
+enum fault {
+	FAULT_STREAMING, /* when a streaming call starts */
+	FAULT_MIDSTREAM, /* halfway through a streamed utterance */
+	FAULT_DETECT,
+	FAULT_TTS,
+	FAULT_COUNT
+};
+
+const char *fault_names[FAULT_COUNT] = { "streaming", "midstream", "detect", "tts" };
+
+struct latency {
+	enum { NONE, FIXED, UNIFORM, NORMAL, LOGNORMAL } kind = NONE;
+	double a = 0;
+	double b = 0;
+
+	int sample_ms(std::mt19937_64 &rng) const
+	{
+		double ms = 0;
+
+		switch (kind) {
+		case NONE:
+			return 0;
+		case FIXED:
+			ms = a;
+			break;
+		case UNIFORM:
+			ms = std::uniform_real_distribution<double>(a, b)(rng);
+			break;
+		case NORMAL:
+			ms = std::normal_distribution<double>(a, b)(rng);
+			break;
+		case LOGNORMAL:
+			/* a is the median, b the shape (sigma) */
+			ms = std::lognormal_distribution<double>(std::log(a), b)(rng);
+			break;
+		}
+		return ms < 0 ? 0 : (int) ms;
+	}
+};
+
+struct injected_error {
+	double probability = 0;
+	StatusCode code = StatusCode::UNAVAILABLE;
+};
+
+/* one scripted response */
+struct response {
+	std::string transcript = "this is a mock transcript"; /* for audio */
+	double confidence = 0.9;
+	std::string intent = "Default Fallback Intent";
+	std::string action;
+	std::string fulfillment_text;
+	std::vector<std::pair<std::string, std::string>> parameters;
+	std::string telephony_synthesize_speech;
+	std::string telephony_play_audio;
+	std::string telephony_transfer_call;
+};
+
+/*
+ * Responses are keyed by "audio", "event:<name>" or "text:<pattern>", where
+ * the event name and text are fnmatch patterns, and [default] answers
+ * anything nothing else matches. A key can be given several times, and a
+ * session gets that key's responses in turn.
+ */
+struct script {
+	typedef std::pair<std::string, std::vector<response>> section;
+
+	std::vector<section> sections;
+	response fallback;
+
+	bool load(const std::string &path)
+	{
+		std::ifstream file(path);
+		std::string line;
+		std::vector<response> *current = nullptr;
+		int number = 0;
+
+		if (!file) {
+			std::cerr << "Unable to open script " << path << std::endl;
+			return false;
+		}
+		while (std::getline(file, line)) {
+			number++;
+			line = trim(line);
+			if (line.empty() || line[0] == ';' || line[0] == '#') {
+				continue;
+			}
+			if (line[0] == '[' && line.back() == ']') {
+				current = &responses_for(line.substr(1, line.size() - 2));
+				current->emplace_back();
+				continue;
+			}
+			size_t eq = line.find('=');
+			if (!current || eq == std::string::npos) {
+				std::cerr << path << ":" << number << ": expected [section] or name = value" << std::endl;
+				return false;
+			}
+			if (!set(current->back(), trim(line.substr(0, eq)), trim(line.substr(eq + 1)))) {
+				std::cerr << path << ":" << number << ": unknown setting" << std::endl;
+				return false;
+			}
+		}
+		for (auto &s : sections) {
+			if (s.first == "default") {
+				fallback = s.second.front();
+			}
+		}
+		return true;
+	}
+
+	/* kind is "audio", "event" or "text" */
+	const section *match(const std::string &kind, const std::string &value) const
+	{
+		for (auto &s : sections) {
+			const std::string &key = s.first;
+			if (kind == "audio" ? key == "audio" :
+				key.compare(0, kind.size() + 1, kind + ":") == 0 &&
+				!fnmatch(key.substr(kind.size() + 1).c_str(), value.c_str(), FNM_CASEFOLD)) {
+				return &s;
+			}
+		}
+		return nullptr;
+	}
+
+	const response &pick(const section *s, int turn) const
+	{
+		return s ? s->second[turn % s->second.size()] : fallback;
+	}
+
+private:
+	std::vector<response> &responses_for(const std::string &key)
+	{
+		for (auto &s : sections) {
+			if (s.first == key) {
+				return s.second;
+			}
+		}
+		sections.emplace_back(key, std::vector<response>());
+		return sections.back().second;
+	}
+
+	static std::string trim(const std::string &s)
+	{
+		size_t start = s.find_first_not_of(" \t\r\n");
+		size_t end = s.find_last_not_of(" \t\r\n");
+		return start == std::string::npos ? "" : s.substr(start, end - start + 1);
+	}
+
+	static bool set(response &r, const std::string &name, const std::string &value)
+	{
+		if (name == "transcript") {
+			r.transcript = value;
+		} else if (name == "confidence") {
+			r.confidence = std::atof(value.c_str());
+		} else if (name == "intent") {
+			r.intent = value;
+		} else if (name == "action") {
+			r.action = value;
+		} else if (name == "fulfillment_text") {
+			r.fulfillment_text = value;
+		} else if (name.compare(0, 6, "param.") == 0) {
+			r.parameters.emplace_back(name.substr(6), value);
+		} else if (name == "telephony_synthesize_speech") {
+			r.telephony_synthesize_speech = value;
+		} else if (name == "telephony_play_audio") {
+			r.telephony_play_audio = value;
+		} else if (name == "telephony_transfer_call") {
+			r.telephony_transfer_call = value;
+		} else {
+			return false;
+		}
+		return true;
+	}
+};
+
+struct options {
+	std::string listen = "localhost:50051";
+	std::string tls_cert;
+	std::string tls_key;
+	std::string script_path;
+	uint64_t seed = 1;
+	int utterance_ms = 1500;
+	int interim_ms = 300;
+	int max_concurrent = 0;
+	double rate = 0;
+	bool verbose = false;
+	latency latencies[STAGE_COUNT];
+	injected_error errors[FAULT_COUNT];
+};
+
+options opts;
+script responses;
+
+std::atomic<uint64_t> rpc_sequence(0);
+std::atomic<int> rpcs_in_flight(0);
+std::atomic<uint64_t> rpcs_served[3];
+std::atomic<uint64_t> rpcs_throttled(0);
+std::atomic<uint64_t> errors_injected(0);
+
+std::mutex bucket_lock;
+double bucket_tokens = -1;
+std::chrono::steady_clock::time_point bucket_refilled;
+
+std::mutex turns_lock;
+std::map<std::string, int> turns; /* by session and script key */
+
+/* the response a session gets next for a script section */
+const response &next_response(const std::string &session, const script::section *s)
+{
+	int turn = 0;
+
+	if (s) {
+		std::lock_guard<std::mutex> lock(turns_lock);
+		turn = turns[session + "|" + s->first]++;
+	}
+	return responses.pick(s, turn);
+}
+
+bool take_token()
+{
+	std::lock_guard<std::mutex> lock(bucket_lock);
+	auto now = std::chrono::steady_clock::now();
+
+	if (bucket_tokens < 0) {
+		bucket_tokens = opts.rate;
+	} else {
+		bucket_tokens += opts.rate * std::chrono::duration<double>(now - bucket_refilled).count();
+		if (bucket_tokens > opts.rate) {
+			bucket_tokens = opts.rate;
+		}
+	}
+	bucket_refilled = now;
+	if (bucket_tokens < 1) {
+		return false;
+	}
+	bucket_tokens -= 1;
+	return true;
+}
+
+/* admits an RPC against the concurrency and rate limits for as long as it lives */
+class admission {
+public:
+	admission()
+	{
+		int in_flight = ++rpcs_in_flight;
+		if (opts.max_concurrent && in_flight > opts.max_concurrent) {
+			status_ = Status(StatusCode::RESOURCE_EXHAUSTED, "mock: too many concurrent requests");
+		} else if (opts.rate > 0 && !take_token()) {
+			status_ = Status(StatusCode::RESOURCE_EXHAUSTED, "mock: request rate exceeded");
+		}
+		if (!status_.ok()) {
+			rpcs_throttled++;
+		}
+	}
+
+	~admission()
+	{
+		rpcs_in_flight--;
+	}
+
+	bool ok() const
+	{
+		return status_.ok();
+	}
+
+	const Status &status() const
+	{
+		return status_;
+	}
+
+private:
+	Status status_;
+};
+
+std::mt19937_64 rpc_rng()
+{
+	return std::mt19937_64(opts.seed * 1000003 + rpc_sequence++);
+}
+
+void pause(std::mt19937_64 &rng, enum stage stage)
+{
+	int ms = opts.latencies[stage].sample_ms(rng);
+	if (ms > 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+	}
+}
+
+bool inject(std::mt19937_64 &rng, enum fault fault, Status *status)
+{
+	const injected_error &error = opts.errors[fault];
+
+	/* always drawn, so one fault's setting does not change the others' draws */
+	if (std::uniform_real_distribution<double>(0, 1)(rng) >= error.probability) {
+		return false;
+	}
+	errors_injected++;
+	*status = Status(error.code, std::string("mock: injected ") + fault_names[fault] + " error");
+	return true;
+}
+
+std::string response_id(std::mt19937_64 &rng)
+{
+	char id[40];
+	snprintf(id, sizeof(id), "mock-%016llx", (unsigned long long) rng());
+	return id;
+}
+
+void fill_query_result(df::QueryResult *result, const response &r, const std::string &query_text,
+	const std::string &language)
+{
+	result->set_query_text(query_text);
+	result->set_language_code(language);
+	result->set_speech_recognition_confidence(r.confidence);
+	result->set_action(r.action);
+	result->set_all_required_params_present(true);
+	result->set_fulfillment_text(r.fulfillment_text);
+	for (auto &parameter : r.parameters) {
+		(*result->mutable_parameters()->mutable_fields())[parameter.first].set_string_value(parameter.second);
+	}
+	if (!r.fulfillment_text.empty()) {
+		df::Intent::Message *message = result->add_fulfillment_messages();
+		message->mutable_text()->add_text(r.fulfillment_text);
+	}
+	if (!r.telephony_synthesize_speech.empty()) {
+		df::Intent::Message *message = result->add_fulfillment_messages();
+		message->set_platform(df::Intent::Message::TELEPHONY);
+		message->mutable_telephony_synthesize_speech()->set_text(r.telephony_synthesize_speech);
+	}
+	if (!r.telephony_play_audio.empty()) {
+		df::Intent::Message *message = result->add_fulfillment_messages();
+		message->set_platform(df::Intent::Message::TELEPHONY);
+		message->mutable_telephony_play_audio()->set_audio_uri(r.telephony_play_audio);
+	}
+	if (!r.telephony_transfer_call.empty()) {
+		df::Intent::Message *message = result->add_fulfillment_messages();
+		message->set_platform(df::Intent::Message::TELEPHONY);
+		message->mutable_telephony_transfer_call()->set_phone_number(r.telephony_transfer_call);
+	}
+	result->mutable_intent()->set_display_name(r.intent);
+	result->mutable_intent()->set_name("projects/mock/agent/intents/" + r.intent);
+	result->set_intent_detection_confidence(r.confidence);
+}
+
+/* answers an event or text query, as DetectIntent or a streaming call does */
+void answer_query(const std::string &session, const df::QueryInput &input, df::QueryResult *result)
+{
+	std::string kind = input.has_event() ? "event" : "text";
+	std::string value = input.has_event() ? input.event().name() : input.text().text();
+	std::string language = input.has_event() ? input.event().language_code() : input.text().language_code();
+
+	fill_query_result(result, next_response(session, responses.match(kind, value)), input.has_text() ? value : "",
+		language);
+}
+
+/* bytes of audio per ms, or 0 if it can't be known from the bytes (Opus) */
+int audio_bytes_per_ms(const df::InputAudioConfig &config)
+{
+	int rate = config.sample_rate_hertz() ? config.sample_rate_hertz() : 8000;
+
+	switch (config.audio_encoding()) {
+	case df::AUDIO_ENCODING_MULAW:
+		return rate / 1000;
+	case df::AUDIO_ENCODING_LINEAR_16:
+		return rate / 1000 * 2;
+	default:
+		return 0;
+	}
+}
+
+std::string words(const std::string &transcript, int count)
+{
+	std::istringstream in(transcript);
+	std::string word;
+	std::string out;
+
+	while (count-- > 0 && in >> word) {
+		out += (out.empty() ? "" : " ") + word;
+	}
+	return out;
+}
+
+int word_count(const std::string &transcript)
+{
+	std::istringstream in(transcript);
+	std::string word;
+	int count = 0;
+
+	while (in >> word) {
+		count++;
+	}
+	return count;
+}
+
+class sessions_service final : public df::Sessions::Service {
+	Status DetectIntent(ServerContext *context, const df::DetectIntentRequest *request,
+		df::DetectIntentResponse *reply) override
+	{
+		admission admitted;
+		std::mt19937_64 rng = rpc_rng();
+		Status status;
+
+		if (!admitted.ok()) {
+			return admitted.status();
+		}
+		rpcs_served[0]++;
+		pause(rng, STAGE_DETECT);
+		if (inject(rng, FAULT_DETECT, &status)) {
+			return status;
+		}
+		reply->set_response_id(response_id(rng));
+		if (request->query_input().has_audio_config()) {
+			const response &r = next_response(request->session(), responses.match("audio", ""));
+			fill_query_result(reply->mutable_query_result(), r, r.transcript,
+				request->query_input().audio_config().language_code());
+		} else {
+			answer_query(request->session(), request->query_input(), reply->mutable_query_result());
+		}
+		if (opts.verbose) {
+			std::cout << "DetectIntent " << request->session() << " -> " << reply->query_result().intent().display_name() << std::endl;
+		}
+		return Status::OK;
+	}
+
+	Status StreamingDetectIntent(ServerContext *context,
+		grpc::ServerReaderWriter<df::StreamingDetectIntentResponse, df::StreamingDetectIntentRequest> *stream) override
+	{
+		admission admitted;
+		std::mt19937_64 rng = rpc_rng();
+		df::StreamingDetectIntentRequest request;
+		df::StreamingDetectIntentResponse reply;
+		Status status;
+
+		if (!admitted.ok()) {
+			return admitted.status();
+		}
+		rpcs_served[1]++;
+		if (!stream->Read(&request)) {
+			return Status(StatusCode::INVALID_ARGUMENT, "mock: no request");
+		}
+		pause(rng, STAGE_OPEN);
+		if (inject(rng, FAULT_STREAMING, &status)) {
+			return status;
+		}
+
+		std::string session = request.session();
+		df::QueryInput input = request.query_input();
+
+		if (!input.has_audio_config()) {
+			pause(rng, STAGE_DETECT);
+			reply.set_response_id(response_id(rng));
+			answer_query(session, input, reply.mutable_query_result());
+			stream->Write(reply);
+			return Status::OK;
+		}
+
+		const response &r = next_response(session, responses.match("audio", ""));
+		int bytes_per_ms = audio_bytes_per_ms(input.audio_config());
+		int total_words = word_count(r.transcript);
+		bool midstream_error = inject(rng, FAULT_MIDSTREAM, &status);
+		auto first_audio = std::chrono::steady_clock::time_point();
+		int64_t audio_bytes = request.input_audio().size();
+		int audio_ms = 0;
+		int next_interim_ms = opts.interim_ms;
+		bool interim_sent = false;
+		bool ended = false;
+
+		for (;;) {
+			if (first_audio == std::chrono::steady_clock::time_point() && audio_bytes) {
+				first_audio = std::chrono::steady_clock::now();
+			}
+			if (bytes_per_ms) {
+				audio_ms = audio_bytes / bytes_per_ms;
+			} else if (audio_bytes) {
+				/* Opus can't be timed from its size, so it is timed as it arrives */
+				audio_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+					std::chrono::steady_clock::now() - first_audio).count();
+			}
+			if (!ended && midstream_error && audio_ms >= opts.utterance_ms / 2) {
+				return status;
+			}
+			while (!ended && audio_ms >= next_interim_ms && next_interim_ms < opts.utterance_ms) {
+				int count = total_words * next_interim_ms / opts.utterance_ms;
+				next_interim_ms += opts.interim_ms;
+				if (!count) {
+					continue;
+				}
+				if (!interim_sent) {
+					pause(rng, STAGE_INTERIM);
+					interim_sent = true;
+				}
+				reply.Clear();
+				reply.set_response_id(response_id(rng));
+				reply.mutable_recognition_result()->set_message_type(df::StreamingRecognitionResult::TRANSCRIPT);
+				reply.mutable_recognition_result()->set_transcript(words(r.transcript, count));
+				reply.mutable_recognition_result()->set_stability(0.8);
+				stream->Write(reply);
+			}
+			if (!ended && audio_ms >= opts.utterance_ms) {
+				reply.Clear();
+				reply.set_response_id(response_id(rng));
+				reply.mutable_recognition_result()->set_message_type(df::StreamingRecognitionResult::END_OF_SINGLE_UTTERANCE);
+				stream->Write(reply);
+				ended = true;
+			}
+			if (!stream->Read(&request)) {
+				break;
+			}
+			audio_bytes += request.input_audio().size();
+		}
+
+		/* the client has half-closed, as it does after the end of the utterance or when it gives up */
+		pause(rng, STAGE_FINAL);
+		reply.Clear();
+		reply.set_response_id(response_id(rng));
+		reply.mutable_recognition_result()->set_message_type(df::StreamingRecognitionResult::TRANSCRIPT);
+		reply.mutable_recognition_result()->set_transcript(r.transcript);
+		reply.mutable_recognition_result()->set_is_final(true);
+		reply.mutable_recognition_result()->set_confidence(r.confidence);
+		stream->Write(reply);
+
+		reply.Clear();
+		reply.set_response_id(response_id(rng));
+		fill_query_result(reply.mutable_query_result(), r, r.transcript, input.audio_config().language_code());
+		stream->Write(reply);
+
+		if (opts.verbose) {
+			std::cout << "StreamingDetectIntent " << session << " " << audio_ms << "ms -> " << r.intent << std::endl;
+		}
+		return Status::OK;
+	}
+};
+
+class tts_service final : public tts::TextToSpeech::Service {
+	Status SynthesizeSpeech(ServerContext *context, const tts::SynthesizeSpeechRequest *request,
+		tts::SynthesizeSpeechResponse *reply) override
+	{
+		admission admitted;
+		std::mt19937_64 rng = rpc_rng();
+		Status status;
+
+		if (!admitted.ok()) {
+			return admitted.status();
+		}
+		rpcs_served[2]++;
+		pause(rng, STAGE_TTS);
+		if (inject(rng, FAULT_TTS, &status)) {
+			return status;
+		}
+		if (request->audio_config().audio_encoding() != tts::LINEAR16) {
+			return Status(StatusCode::UNIMPLEMENTED, "mock: only LINEAR16 is synthesized");
+		}
+
+		/* about as long as the text would take to say, as a quiet tone in a WAV file */
+		const std::string &text = request->input().has_ssml() ? request->input().ssml() : request->input().text();
+		uint32_t rate = request->audio_config().sample_rate_hertz() ? request->audio_config().sample_rate_hertz() : 8000;
+		uint32_t samples = rate * std::min<size_t>(std::max<size_t>(text.size() * 60, 200), 30000) / 1000;
+		std::string wav(44 + samples * 2, '\0');
+		auto put32 = [&wav](size_t at, uint32_t value) {
+			for (int i = 0; i < 4; i++) {
+				wav[at + i] = (char) (value >> (8 * i));
+			}
+		};
+		auto put16 = [&wav](size_t at, uint16_t value) {
+			wav[at] = (char) value;
+			wav[at + 1] = (char) (value >> 8);
+		};
+
+		memcpy(&wav[0], "RIFF", 4);
+		put32(4, 36 + samples * 2);
+		memcpy(&wav[8], "WAVEfmt ", 8);
+		put32(16, 16);
+		put16(20, 1); /* PCM */
+		put16(22, 1); /* mono */
+		put32(24, rate);
+		put32(28, rate * 2);
+		put16(32, 2);
+		put16(34, 16);
+		memcpy(&wav[36], "data", 4);
+		put32(40, samples * 2);
+		for (uint32_t i = 0; i < samples; i++) {
+			put16(44 + i * 2, (uint16_t) (int16_t) (2000 * std::sin(i * 2 * M_PI * 440 / rate)));
+		}
+		reply->set_audio_content(wav);
+
+		if (opts.verbose) {
+			std::cout << "SynthesizeSpeech " << text.size() << " characters -> " << samples * 1000 / rate << "ms" << std::endl;
+		}
+		return Status::OK;
+	}
+};
+
+bool parse_latency(const std::string &arg)
+{
+	size_t eq = arg.find('=');
+	std::string name = arg.substr(0, eq);
+	double a = 0;
+	double b = 0;
+	char kind[16];
+	int stage;
+
+	for (stage = 0; stage < STAGE_COUNT && name != stage_names[stage]; stage++) {
+	}
+	if (eq == std::string::npos || stage == STAGE_COUNT) {
+		return false;
+	}
+	latency &l = opts.latencies[stage];
+	int fields = sscanf(arg.c_str() + eq + 1, "%15[a-z]:%lf:%lf", kind, &a, &b);
+	if (fields == 2 && !strcmp(kind, "fixed")) {
+		l.kind = latency::FIXED;
+	} else if (fields == 3 && !strcmp(kind, "uniform")) {
+		l.kind = latency::UNIFORM;
+	} else if (fields == 3 && !strcmp(kind, "normal")) {
+		l.kind = latency::NORMAL;
+	} else if (fields == 3 && !strcmp(kind, "lognormal") && a > 0) {
+		l.kind = latency::LOGNORMAL;
+	} else {
+		return false;
+	}
+	l.a = a;
+	l.b = b;
+	return true;
+}
+
+bool parse_error(const std::string &arg)
+{
+	static const std::map<std::string, StatusCode> codes = {
+		{ "CANCELLED", StatusCode::CANCELLED },
+		{ "UNKNOWN", StatusCode::UNKNOWN },
+		{ "INVALID_ARGUMENT", StatusCode::INVALID_ARGUMENT },
+		{ "DEADLINE_EXCEEDED", StatusCode::DEADLINE_EXCEEDED },
+		{ "NOT_FOUND", StatusCode::NOT_FOUND },
+		{ "PERMISSION_DENIED", StatusCode::PERMISSION_DENIED },
+		{ "UNAUTHENTICATED", StatusCode::UNAUTHENTICATED },
+		{ "RESOURCE_EXHAUSTED", StatusCode::RESOURCE_EXHAUSTED },
+		{ "FAILED_PRECONDITION", StatusCode::FAILED_PRECONDITION },
+		{ "ABORTED", StatusCode::ABORTED },
+		{ "INTERNAL", StatusCode::INTERNAL },
+		{ "UNAVAILABLE", StatusCode::UNAVAILABLE },
+	};
+	size_t eq = arg.find('=');
+	std::string name = arg.substr(0, eq);
+	int fault;
+
+	for (fault = 0; fault < FAULT_COUNT && name != fault_names[fault]; fault++) {
+	}
+	if (eq == std::string::npos || fault == FAULT_COUNT) {
+		return false;
+	}
+	std::string value = arg.substr(eq + 1);
+	size_t colon = value.find(':');
+	injected_error &error = opts.errors[fault];
+	error.probability = std::atof(value.substr(0, colon).c_str());
+	if (colon != std::string::npos) {
+		auto code = codes.find(value.substr(colon + 1));
+		if (code == codes.end()) {
+			return false;
+		}
+		error.code = code->second;
+	}
+	return error.probability >= 0 && error.probability <= 1;
+}
+
+std::string read_file(const std::string &path)
+{
+	std::ifstream file(path);
+	std::stringstream contents;
+
+	contents << file.rdbuf();
+	return contents.str();
+}
+
+void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options]\n"
+		"  --listen ADDRESS             listen here (default localhost:50051)\n"
+		"  --tls-cert FILE --tls-key FILE\n"
+		"                               serve TLS with this certificate and key\n"
+		"  --script FILE                scripted responses (see mock_script.conf.sample)\n"
+		"  --seed N                     seed for random choices (default 1)\n"
+		"  --latency STAGE=DIST         delay a stage: open, interim, final, detect or tts;\n"
+		"                               DIST is fixed:MS, uniform:MIN:MAX, normal:MEAN:SD\n"
+		"                               or lognormal:MEDIAN:SIGMA\n"
+		"  --utterance-ms MS            audio before the end of an utterance (default 1500)\n"
+		"  --interim-ms MS              audio between interim transcripts (default 300)\n"
+		"  --max-concurrent N           refuse requests beyond this many in flight\n"
+		"  --rate N                     refuse requests beyond this many per second\n"
+		"  --error POINT=PROB[:CODE]    fail this share of requests at streaming, midstream,\n"
+		"                               detect or tts with a gRPC status (default UNAVAILABLE)\n"
+		"  --verbose                    print each request\n";
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[])
+{
+	sigset_t signals;
+	int signal;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		bool ok = true;
+
+		if (arg == "--verbose") {
+			opts.verbose = true;
+			continue;
+		} else if (arg == "--help" || !has_value) {
+			usage(argv[0]);
+			return arg == "--help" ? 0 : 1;
+		}
+		std::string value = argv[++i];
+		if (arg == "--listen") {
+			opts.listen = value;
+		} else if (arg == "--tls-cert") {
+			opts.tls_cert = value;
+		} else if (arg == "--tls-key") {
+			opts.tls_key = value;
+		} else if (arg == "--script") {
+			opts.script_path = value;
+		} else if (arg == "--seed") {
+			opts.seed = std::strtoull(value.c_str(), nullptr, 10);
+		} else if (arg == "--latency") {
+			ok = parse_latency(value);
+		} else if (arg == "--utterance-ms") {
+			opts.utterance_ms = std::atoi(value.c_str());
+			ok = opts.utterance_ms > 0;
+		} else if (arg == "--interim-ms") {
+			opts.interim_ms = std::atoi(value.c_str());
+			ok = opts.interim_ms > 0;
+		} else if (arg == "--max-concurrent") {
+			opts.max_concurrent = std::atoi(value.c_str());
+		} else if (arg == "--rate") {
+			opts.rate = std::atof(value.c_str());
+		} else if (arg == "--error") {
+			ok = parse_error(value);
+		} else {
+			ok = false;
+		}
+		if (!ok) {
+			std::cerr << "Invalid option " << arg << " " << value << std::endl;
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!opts.script_path.empty() && !responses.load(opts.script_path)) {
+		return 1;
+	}
+
+	std::shared_ptr<grpc::ServerCredentials> credentials = grpc::InsecureServerCredentials();
+	if (!opts.tls_cert.empty()) {
+		grpc::SslServerCredentialsOptions ssl;
+		ssl.pem_key_cert_pairs.push_back({ read_file(opts.tls_key), read_file(opts.tls_cert) });
+		credentials = grpc::SslServerCredentials(ssl);
+	}
+
+	/* handled by sigwait below rather than asynchronously */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	sessions_service sessions;
+	tts_service synthesizer;
+	grpc::ServerBuilder builder;
+	builder.AddListeningPort(opts.listen, credentials);
+	builder.RegisterService(&sessions);
+	builder.RegisterService(&synthesizer);
+	std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+	if (!server) {
+		std::cerr << "Unable to listen on " << opts.listen << std::endl;
+		return 1;
+	}
+	std::cout << "Mock DialogFlow listening on " << opts.listen << (opts.tls_cert.empty() ? "" : " (TLS)") << std::endl;
+
+	sigwait(&signals, &signal);
+	server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
+
+	std::cout << "DetectIntent:          " << rpcs_served[0] << "\n"
+		<< "StreamingDetectIntent: " << rpcs_served[1] << "\n"
+		<< "SynthesizeSpeech:      " << rpcs_served[2] << "\n"
+		<< "Throttled:             " << rpcs_throttled << "\n"
+		<< "Injected errors:       " << errors_injected << std::endl;
+	return 0;
+}
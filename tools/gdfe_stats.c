@@ -0,0 +1,177 @@
+/*
+ * gdfe_stats -- print the counters and latency histograms res_speech_gdfe
+ * keeps in its shared stats segment
+ *
+ * Copyright (C) 2018, USAN, Inc.
+ *
+ * Daniel Collins <daniel.collins@usan.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source asterisk tree.
+ *
+ */
+
+/*
+ * The segment is mapped read only and never locked, so this can be run as
+ * often as a monitoring agent likes without touching Asterisk. Output is one
+ * value per line:
+ *
+ *   <counter> <value>
+ *   latency.<agent>.<stage> <count> <p50> <p90> <p99> <max>
+ *
+ * with latencies in milliseconds.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gdfe_stats.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-f segment] [-a agent] [-i seconds]\n", name);
+	fprintf(stderr, "  -f  the stats segment (default %s)\n", GDFE_STATS_DEFAULT_PATH);
+	fprintf(stderr, "  -a  only show latencies for this agent\n");
+	fprintf(stderr, "  -i  print again every this many seconds\n");
+}
+
+static const struct gdfe_stats_segment *map_segment(const char *path)
+{
+	const struct gdfe_stats_segment *segment;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*segment)) {
+		fprintf(stderr, "%s is not a stats segment\n", path);
+		close(fd);
+		return NULL;
+	}
+	segment = mmap(NULL, sizeof(*segment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (segment->magic != GDFE_STATS_MAGIC) {
+		fprintf(stderr, "%s is not a stats segment, or is still being created\n", path);
+	} else if (segment->version != GDFE_STATS_VERSION || segment->size != sizeof(*segment)) {
+		fprintf(stderr, "%s has version %u, this reader understands version %d\n", path, segment->version,
+			GDFE_STATS_VERSION);
+	} else {
+		return segment;
+	}
+	munmap((void *) segment, sizeof(*segment));
+	return NULL;
+}
+
+static void print_segment(const struct gdfe_stats_segment *segment, const char *agent)
+{
+	unsigned int stat_count = segment->stat_count < GDFE_STATS_MAX_COUNTERS ? segment->stat_count : GDFE_STATS_MAX_COUNTERS;
+	unsigned int stage_count = segment->stage_count < GDFE_STATS_MAX_STAGES ? segment->stage_count : GDFE_STATS_MAX_STAGES;
+	unsigned int agent_count = segment->agent_count < GDFE_STATS_MAX_AGENTS ? segment->agent_count : GDFE_STATS_MAX_AGENTS;
+	unsigned int i;
+	unsigned int j;
+
+	printf("pid %d%s\n", segment->pid, kill(segment->pid, 0) && errno == ESRCH ? " (exited)" : "");
+	printf("uptime %" PRId64 "\n", (int64_t) time(NULL) - segment->started);
+
+	for (i = 0; i < stat_count; i++) {
+		int64_t total = 0;
+		for (j = 0; j < segment->cpu_slots && j < GDFE_STATS_CPU_SLOTS; j++) {
+			total += segment->cpus[j].values[i];
+		}
+		printf("%.*s %" PRId64 "\n", GDFE_STATS_NAME_LEN, segment->stat_names[i], total);
+	}
+
+	for (i = 0; i < agent_count; i++) {
+		const struct gdfe_stats_agent *slot = &segment->agents[i];
+		char name[GDFE_STATS_NAME_LEN];
+
+		snprintf(name, sizeof(name), "%.*s", GDFE_STATS_NAME_LEN - 1, slot->name);
+		if (agent && strcasecmp(agent, name)) {
+			continue;
+		}
+		for (j = 0; j < stage_count; j++) {
+			struct gdfe_stats_histogram histogram;
+			int total;
+
+			/* a private copy, so the percentiles add up even while samples arrive */
+			memcpy(&histogram, &slot->latency[j], sizeof(histogram));
+			total = histogram.total;
+			if (!total) {
+				continue;
+			}
+			printf("latency.%s.%.*s %d %.1f %.1f %.1f %.1f\n", name, GDFE_STATS_NAME_LEN, segment->stage_names[j], total,
+				gdfe_stats_percentile(&histogram, total, 50) / 1000.0,
+				gdfe_stats_percentile(&histogram, total, 90) / 1000.0,
+				gdfe_stats_percentile(&histogram, total, 99) / 1000.0,
+				histogram.max_us / 1000.0);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = GDFE_STATS_DEFAULT_PATH;
+	const char *agent = NULL;
+	int interval = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:a:i:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'a':
+			agent = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			if (interval < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	for (;;) {
+		/* remapped each time, as loading the module again replaces the segment */
+		const struct gdfe_stats_segment *segment = map_segment(path);
+
+		if (segment) {
+			print_segment(segment, agent);
+			munmap((void *) segment, sizeof(*segment));
+		} else if (!interval) {
+			return 1;
+		}
+		if (!interval) {
+			break;
+		}
+		printf("\n");
+		fflush(stdout);
+		sleep(interval);
+	}
+
+	return 0;
+}